@@ -76,7 +76,124 @@ void bf_bs_copy_range(bf_bitset_t *dst,
                       unsigned int src_offset,
                       unsigned int n_bits);
 
+/* Set or clear "n_bits" bits starting at "position". */
+void bf_bs_set_range(bf_bitset_t *bs, int position, int n_bits);
+void bf_bs_clr_range(bf_bitset_t *bs, int position, int n_bits);
+
+/* Get the number of bits set among "n_bits" bits starting at "position". */
+int bf_bs_count_range(bf_bitset_t *bs, int position, int n_bits);
+
+/* Returns the bit position of the first run of "n" clear bits starting at or
+ * after "start" and returns -1 if there is no such run. */
+int bf_bs_first_clr_run(bf_bitset_t *bs, int start, int n);
+
+/* Returns the bit position of the last bit set below "position", pass the
+ * width of the set to search all of it. Returns -1 if no bits are set. */
+int bf_bs_last_set(bf_bitset_t *bs, int position);
+
 /* Get the number of bits set. */
 int bf_bs_pop_count(bf_bitset_t *bs);
 
+/* Whole set operations. All the sets have the same width, "dst" may be one
+ * of the operands. They run on the widest vector instructions the CPU
+ * supports. */
+
+/* dst = x & y */
+void bf_bs_and(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y);
+
+/* dst = x | y */
+void bf_bs_or(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y);
+
+/* dst = x ^ y */
+void bf_bs_xor(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y);
+
+/* dst = x & ~y */
+void bf_bs_andnot(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y);
+
+/* Get the number of bits set in both sets. */
+int bf_bs_intersect_count(bf_bitset_t *x, bf_bitset_t *y);
+
+/* Bitset with a summary of its words, for large sets searched often.
+ * For every word of the set a first level keeps one bit telling whether the
+ * word has any bit set and one telling whether it has any bit clear, and a
+ * second level does the same for the words of the first level. Searches go
+ * through the summaries with a few ctz instead of scanning the set.
+ * The bits must only be changed through the bf_hbs_* functions, call
+ * bf_hbs_sync after changing "bs" directly. "bs" can be passed to the
+ * read only bf_bs_* functions. */
+typedef struct bf_hbitset_t {
+  bf_bitset_t bs;
+  uint64_t *l1[2];  // Words with bits set, words with bits clear
+  uint64_t *l2[2];
+  unsigned l1_len;
+  unsigned l2_len;
+} bf_hbitset_t;
+
+#define BF_HBITSET_L1_SIZE(width) \
+  BF_BITSET_ARRAY_SIZE(BF_BITSET_ARRAY_SIZE(width))
+#define BF_HBITSET_L2_SIZE(width) \
+  BF_BITSET_ARRAY_SIZE(BF_HBITSET_L1_SIZE(width))
+#define BF_HBITSET_ARRAY_SIZE(width) \
+  (BF_BITSET_ARRAY_SIZE(width) +     \
+   2 * (BF_HBITSET_L1_SIZE(width) + BF_HBITSET_L2_SIZE(width)))
+
+#define BF_HBITSET(var, width)                         \
+  bf_hbitset_t var;                                    \
+  uint64_t var##_[BF_HBITSET_ARRAY_SIZE(width)] = {0}; \
+  bf_hbs_init(&var, width, var##_);
+
+/* Initialize a bitset over BF_HBITSET_ARRAY_SIZE(width) words of "mem", the
+ * bits being the first BF_BITSET_ARRAY_SIZE(width) words. */
+void bf_hbs_init(bf_hbitset_t *hbs, int width, uint64_t *mem);
+
+/* Rebuild the summaries from the bits. */
+void bf_hbs_sync(bf_hbitset_t *hbs);
+
+/* Same as the bf_bs_* functions of the same name. */
+bool bf_hbs_set(bf_hbitset_t *hbs, int position, int val);
+bool bf_hbs_get(bf_hbitset_t *hbs, int position);
+void bf_hbs_set_all(bf_hbitset_t *hbs, int val);
+void bf_hbs_set_range(bf_hbitset_t *hbs, int position, int n_bits);
+void bf_hbs_clr_range(bf_hbitset_t *hbs, int position, int n_bits);
+int bf_hbs_first_set(bf_hbitset_t *hbs, int position);
+int bf_hbs_first_clr(bf_hbitset_t *hbs, int position);
+
+/* Bitset which can be changed by several threads at once without a lock.
+ * Single bit updates are atomic read-modify-writes and searches read each
+ * word atomically, so a search sees every word as it was at some point but
+ * not the whole set at one point in time. */
+typedef struct bf_atomic_bitset_t {
+  unsigned width;  // Number of bits
+  uint64_t *bs;
+} bf_atomic_bitset_t;
+
+#define BF_ATOMIC_BITSET(var, width)                  \
+  bf_atomic_bitset_t var;                             \
+  uint64_t var##_[BF_BITSET_ARRAY_SIZE(width)] = {0}; \
+  bf_abs_init(&var, width, var##_);
+
+/* Same as the bf_bs_* functions of the same name. bf_abs_set_all is not
+ * atomic as a whole, each word is. */
+void bf_abs_init(bf_atomic_bitset_t *bs, int width, uint64_t *mem);
+bool bf_abs_set(bf_atomic_bitset_t *bs, int position, int val);
+bool bf_abs_get(bf_atomic_bitset_t *bs, int position);
+void bf_abs_set_all(bf_atomic_bitset_t *bs, int val);
+int bf_abs_first_set(bf_atomic_bitset_t *bs, int position);
+int bf_abs_first_clr(bf_atomic_bitset_t *bs, int position);
+int bf_abs_pop_count(bf_atomic_bitset_t *bs);
+
+/* Set or clear the bit at "position", return it's previous value. */
+bool bf_abs_test_and_set(bf_atomic_bitset_t *bs, int position);
+bool bf_abs_test_and_clr(bf_atomic_bitset_t *bs, int position);
+
+/* Sets the first clear bit after "position" and returns its position, so
+ * concurrent callers never get the same bit. Returns -1 if no bits are
+ * clear. */
+int bf_abs_claim_first_clr(bf_atomic_bitset_t *bs, int position);
+
+/* Copies the bits into "dst", which has the same width, with relaxed loads.
+ * When "clear" is true the bits are cleared as they are copied, so no bit
+ * set concurrently is lost between two calls. */
+void bf_abs_snapshot(bf_atomic_bitset_t *bs, bf_bitset_t *dst, bool clear);
+
 #endif /* _BF_BITSET_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/** cbitset.h - Compressed bitset for large index spaces mixing sparse and
+ * dense regions.
+ * The bits are split in chunks of 64K, each kept in the smallest of three
+ * containers: a sorted array of the bits set, a plain bitmap or a list of
+ * runs of bits set. Chunks with no bits set take no memory. The search
+ * functions behave as the bf_fbs_* functions of the same name.
+ */
+
+#ifndef _BF_CBITSET_H_
+#define _BF_CBITSET_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <target-utils/fbitset/fbitset.h>
+
+typedef struct bf_cbitset_s {
+  unsigned int width;  // Number of bits;
+  void *chunks;        // Judy array of chunk number to container
+} bf_cbitset_t;
+
+/* Initialize a bitset. */
+void bf_cbs_init(bf_cbitset_t *bs, unsigned int width);
+
+/* Set the bit at "position" to "val", return it's previous value. */
+bool bf_cbs_set(bf_cbitset_t *bs, int position, int val);
+
+/* Return the value of the bit at "position". */
+bool bf_cbs_get(bf_cbitset_t *bs, int position);
+
+/* Position is exclusive. Start search from width to find the last free */
+int bf_cbs_prev_clr_contiguous(bf_cbitset_t *bs,
+                               int position,
+                               unsigned int count);
+
+/* Position is exclusive. Start searching from -1 to find the first free*/
+int bf_cbs_first_clr_contiguous(bf_cbitset_t *bs,
+                                int position,
+                                unsigned int count);
+
+/* Position is exclusive. Start searching from -1 to find the first set. */
+int bf_cbs_first_set(bf_cbitset_t *bs, int position);
+
+/* Position is exclusive. Writes the positions of up to "max" bits set after
+ * "position" to "out", in order, and returns how many were written. */
+int bf_cbs_get_set_bits(bf_cbitset_t *bs, int position, int *out, int max);
+
+/* Get the number of bits set. */
+unsigned int bf_cbs_pop_count(bf_cbitset_t *bs);
+
+/* x |= y and x &= y, both sets have the same width. */
+bf_fbitset_sts_t bf_cbs_or(bf_cbitset_t *x, bf_cbitset_t *y);
+bf_fbitset_sts_t bf_cbs_and(bf_cbitset_t *x, bf_cbitset_t *y);
+
+/* Moves every chunk to its smallest container, turning long runs of bits
+ * set into run lists. Worth calling after filling a set. */
+void bf_cbs_optimize(bf_cbitset_t *bs);
+
+/* Bytes of heap memory behind the set, the bf_cbitset_t itself excluded. */
+size_t bf_cbs_memory_used(bf_cbitset_t *bs);
+
+void bf_cbs_destroy(bf_cbitset_t *bs);
+
+#endif /* _BF_CBITSET_H_ */
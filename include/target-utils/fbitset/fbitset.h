@@ -13,9 +13,11 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-/** fbitset.h - Faster bitset implemented using judy.
- * Almost double the performance over bitset implemented using
- * bit arrays
+/** fbitset.h - Bitset implemented using judy.
+ * Memory follows the number of bits set rather than the width, and the
+ * searches skip the empty regions, which suits large sparse sets. A plain
+ * bf_bitset_t is faster per bit; bf_fbs_init_adaptive narrows the gap for
+ * sets with dense regions.
  */
 
 #ifndef _BF_FBITSET_H_
@@ -23,10 +25,20 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct bf_fbitset_s {
   unsigned int width;  // Number of bits;
   void *fbs;
+  /* Optional index of the runs of clear bits, see bf_fbs_run_index_enable */
+  void *free_runs;  // Judy array of run start to run length
+  void *run_sizes;  // Judy array of run length to Judy1 set of run starts
+  bool run_index;
+  /* Chunks kept as plain words rather than in fbs, see bf_fbs_init_adaptive */
+  void **dense;  // Words of each chunk by chunk number, NULL if in fbs
+  void *dense_chunks;  // Judy array of the chunk numbers in "dense"
+  unsigned int sets;  // Bits newly set in fbs, to check chunks now and then
+  bool adaptive;
 } bf_fbitset_t;
 
 typedef enum bf_fbitset_sts_e {
@@ -37,12 +49,61 @@ typedef enum bf_fbitset_sts_e {
 /* Initialize a bitset. */
 void bf_fbs_init(bf_fbitset_t *bs, unsigned int width);
 
+/* Initialize a bitset which keeps every chunk of 4096 bits either in Judy
+ * or as plain words, whichever suits its population. A chunk moves to words
+ * once an eighth of its bits are set and back to Judy when fewer than a
+ * thirty-second are, so a chunk near a limit does not move back and forth.
+ * Dense chunks then take a bit operation instead of a Judy update and 512
+ * bytes at most. All the bf_fbs_* functions work the same on both. */
+void bf_fbs_init_adaptive(bf_fbitset_t *bs, unsigned int width);
+
+/* Keep an index of the runs of clear bits by length, updated on every
+ * change, so that the contiguous clear searches take a lookup per distinct
+ * run length instead of a walk over every set and clear boundary. Worth it
+ * on fragmented sets searched often. */
+bf_fbitset_sts_t bf_fbs_run_index_enable(bf_fbitset_t *bs);
+
 /* Set the bit at "position" to "val", return it's previous value. */
 bool bf_fbs_set(bf_fbitset_t *bs, int position, int val);
 
 /* Return the value of the bit at "position". */
 bool bf_fbs_get(bf_fbitset_t *bs, int position);
 
+/* Set "count" bits starting at "position" to "val". Only the bits whose
+ * value changes are visited. On BF_FBITSET_MALLOC_ERR part of the range
+ * may have been set. */
+bf_fbitset_sts_t bf_fbs_set_range(bf_fbitset_t *bs,
+                                  int position,
+                                  unsigned int count,
+                                  int val);
+
+/* Get the number of bits set among "count" bits starting at "position". */
+unsigned int bf_fbs_count_range(bf_fbitset_t *bs,
+                                int position,
+                                unsigned int count);
+
+/* Cursor over the bits set, or clear, of a bitset. Runs of the wanted value
+ * are found with one search at each end and then handed out without
+ * looking the bits up one by one. */
+typedef struct bf_fbitset_iter_s {
+  bf_fbitset_t *bs;
+  unsigned long pos;      // Next bit to look at
+  unsigned long run_end;  // Bits from pos to run_end have the wanted value
+  bool set;               // Bits set or clear are wanted
+  bool known;             // Bit pos has the wanted value
+} bf_fbitset_iter_t;
+
+/* Position is exclusive. Start from -1 to go over the whole set. The bits
+ * must not change while the cursor is in use. */
+void bf_fbs_iter_init(bf_fbitset_iter_t *it,
+                      bf_fbitset_t *bs,
+                      int position,
+                      bool set);
+
+/* Writes the positions of up to "max" next bits with the wanted value to
+ * "out" and returns how many were written, 0 at the end of the set. */
+int bf_fbs_iter_next(bf_fbitset_iter_t *it, int *out, int max);
+
 /* Position is exclusive. Start search from width to find the last free */
 int bf_fbs_prev_clr_contiguous(bf_fbitset_t *bs,
                                int position,
@@ -56,6 +117,15 @@ int bf_fbs_first_clr_contiguous(bf_fbitset_t *bs,
 /* Position is exclusive. Start searching from -1 to find the first set. */
 int bf_fbs_first_set(bf_fbitset_t *bs, int position);
 
+/* Get the number of bits set. */
+unsigned int bf_fbs_pop_count(bf_fbitset_t *bs);
+
+/* Fraction of the bits set, from 0 to 1. */
+double bf_fbs_density(bf_fbitset_t *bs);
+
+/* Bytes of heap memory behind the set, the bf_fbitset_t itself excluded. */
+size_t bf_fbs_memory_used(bf_fbitset_t *bs);
+
 void bf_fbs_destroy(bf_fbitset_t *bs);
 
 #endif /* _BF_FBITSET_H_ */
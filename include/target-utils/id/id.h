@@ -26,6 +26,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,9 +34,33 @@ extern "C" {
 
 typedef void *bf_id_allocator;
 
+/* Engines backing an id allocator. Both are used through the same
+ * bf_id_allocator_* API.
+ *   JUDY  Allocated ids kept in a Judy1 array. Memory grows with the number
+ *         of allocated ids, the lowest free id is handed out first.
+ *   DENSE One bit per id in a flat word array with a summary bit per word
+ *         telling whether it is full. Fixed memory footprint of about one
+ *         bit per id, good for small and densely used pools. Allocation is
+ *         next fit, searching from after the last allocated id.
+ */
+typedef enum bf_id_allocator_engine_e {
+  BF_ID_ALLOCATOR_ENGINE_JUDY = 0,
+  BF_ID_ALLOCATOR_ENGINE_DENSE
+} bf_id_allocator_engine_t;
+
+/* Which free run a range of ids is taken from */
+typedef enum bf_id_allocator_fit_e {
+  BF_ID_ALLOCATOR_FIRST_FIT = 0,  // The one with the lowest ids
+  BF_ID_ALLOCATOR_BEST_FIT        // The shortest one
+} bf_id_allocator_fit_t;
+
 bf_id_allocator *bf_id_allocator_new(unsigned int initial_size,
                                      bool zero_based);
 
+bf_id_allocator *bf_id_allocator_new_engine(unsigned int initial_size,
+                                            bool zero_based,
+                                            bf_id_allocator_engine_t engine);
+
 void bf_id_allocator_destroy(bf_id_allocator *allocator);
 
 unsigned int bf_id_allocator_allocate(bf_id_allocator *allocator);
@@ -43,10 +68,37 @@ unsigned int bf_id_allocator_allocate(bf_id_allocator *allocator);
 int bf_id_allocator_allocate_contiguous(bf_id_allocator *allocator,
                                         uint8_t count);
 
+/* Allocates count contiguous ids, the offset of the first one from the first
+ * id of the allocator being a multiple of align. The free runs are kept in an
+ * index built on the first call, which is then kept up to date by every call
+ * changing the allocator.
+ */
+int bf_id_allocator_allocate_range(bf_id_allocator *allocator,
+                                   uint32_t count,
+                                   uint32_t align,
+                                   bf_id_allocator_fit_t fit);
+
 void bf_id_allocator_release(bf_id_allocator *allocator, unsigned int id);
 
 void bf_id_allocator_set(bf_id_allocator *allocator, unsigned int id);
 
+int bf_id_allocator_set_range(bf_id_allocator *allocator,
+                              unsigned int id,
+                              unsigned int count);
+
+int bf_id_allocator_release_range(bf_id_allocator *allocator,
+                                  unsigned int id,
+                                  unsigned int count);
+
+unsigned int bf_id_allocator_count(bf_id_allocator *allocator);
+
+/* Allocated ids over the size of the allocator */
+double bf_id_allocator_density(bf_id_allocator *allocator);
+
+/* Bytes of heap memory behind the allocator handle: its state, the ids and
+ * the free run index */
+size_t bf_id_allocator_memory_used(bf_id_allocator *allocator);
+
 int bf_id_allocator_is_set(bf_id_allocator *allocator, unsigned int id);
 
 int bf_id_allocator_get_first(bf_id_allocator *allocator);
@@ -56,6 +108,30 @@ int bf_id_allocator_get_next(bf_id_allocator *allocator, unsigned int id);
 void bf_id_allocator_copy(bf_id_allocator *dst_allocator,
                           bf_id_allocator *src_allocator);
 
+/* Thread safe front end of the id allocator. Every thread keeps a cache of
+ * ids taken from the shared allocator a magazine at a time and gives them
+ * back a magazine at a time, so the shared allocator lock is only taken once
+ * every magazine_size calls. Ids cached by a thread are released when the
+ * thread exits or calls bf_id_allocator_mt_flush.
+ */
+typedef void *bf_id_allocator_mt;
+
+bf_id_allocator_mt *bf_id_allocator_mt_new(unsigned int initial_size,
+                                           bool zero_based,
+                                           bf_id_allocator_engine_t engine,
+                                           unsigned int magazine_size);
+
+void bf_id_allocator_mt_destroy(bf_id_allocator_mt *allocator);
+
+unsigned int bf_id_allocator_mt_allocate(bf_id_allocator_mt *allocator);
+
+void bf_id_allocator_mt_release(bf_id_allocator_mt *allocator,
+                                unsigned int id);
+
+void bf_id_allocator_mt_flush(bf_id_allocator_mt *allocator);
+
+int bf_id_allocator_mt_is_set(bf_id_allocator_mt *allocator, unsigned int id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,7 @@
 #ifndef _bf_map_h_
 #define _bf_map_h_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Utility to map an unsigned long to a pointer.  Pointers can be added to a
@@ -36,6 +37,15 @@ typedef enum bf_map_sts_t {
 bf_map_sts_t bf_map_add(bf_map_t *map, unsigned long key, void *data);
 bf_map_sts_t bf_map_rmv(bf_map_t *map, unsigned long key);
 bf_map_sts_t bf_map_get(bf_map_t *map, unsigned long key, void **data);
+/* Looks up n keys. data[i] and, unless sts is NULL, sts[i] get the result of
+ * the lookup of keys[i], data[i] is NULL when the key is missing. Keys close
+ * to each other are looked up together in key order, which keeps the top of
+ * the Judy tree in cache. Returns BF_MAP_OK when every key was found. */
+bf_map_sts_t bf_map_get_batch(bf_map_t *map,
+                              const unsigned long *keys,
+                              uint32_t n,
+                              void **data,
+                              bf_map_sts_t *sts);
 bf_map_sts_t bf_map_get_rmv(bf_map_t *map, unsigned long key, void **data);
 bf_map_sts_t bf_map_get_first(bf_map_t *map, unsigned long *key, void **data);
 bf_map_sts_t bf_map_get_next(bf_map_t *map, unsigned long *key, void **data);
@@ -45,5 +55,10 @@ bf_map_sts_t bf_map_get_first_rmv(bf_map_t *map,
 bf_map_sts_t bf_map_init(bf_map_t *map);
 void bf_map_destroy(bf_map_t *map);
 uint32_t bf_map_count(bf_map_t *map);
+/* Bytes of heap memory behind the map, the bf_map_t itself excluded. */
+size_t bf_map_memory_used(bf_map_t *map);
+/* Number of keys over the span from the lowest to the highest key, 0 when
+ * the map is empty. Close to 1 when the keys are packed together. */
+double bf_map_density(bf_map_t *map);
 
 #endif
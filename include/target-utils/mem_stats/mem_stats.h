@@ -0,0 +1,89 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/** mem_stats.h - Process wide registry of containers, to report the memory
+ * used and population of all the containers registered under a name.
+ * The containers are read when the statistics are read, from the thread
+ * reading them. A container registered without a lock function must not
+ * change while statistics are read; one registered with a lock function is
+ * only read between lock_fn(lock_arg, true) and lock_fn(lock_arg, false).
+ * The registry lock is held meanwhile, so that lock must not be held while
+ * calling into the registry. A container must be unregistered before it is
+ * destroyed.
+ * Memory used is the heap memory behind the handle of the container: the
+ * Judy arrays and blocks a bf_fbitset_t, bf_cbitset_t or bf_map_t points to,
+ * which leaves out the caller owned bf_fbitset_t, bf_cbitset_t and bf_map_t
+ * themselves, and for an id allocator everything its handle points to.
+ */
+
+#ifndef _BF_MEM_STATS_H_
+#define _BF_MEM_STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+typedef enum bf_mem_stats_type_e {
+  BF_MEM_STATS_FBITSET,       // bf_fbitset_t *
+  BF_MEM_STATS_CBITSET,       // bf_cbitset_t *
+  BF_MEM_STATS_MAP,           // bf_map_t *, the map must not move
+  BF_MEM_STATS_ID_ALLOCATOR,  // bf_id_allocator *
+} bf_mem_stats_type_t;
+
+typedef enum bf_mem_stats_sts_e {
+  BF_MEM_STATS_OK,
+  BF_MEM_STATS_ERR,
+  BF_MEM_STATS_NOT_FOUND
+} bf_mem_stats_sts_t;
+
+/* Totals of the containers registered under a name */
+typedef struct bf_mem_stats_s {
+  const char *name;
+  unsigned int instances;
+  size_t memory_used;          // Bytes
+  unsigned long population;    // Bits set, keys or allocated ids
+  double density;              // Mean density of the instances
+} bf_mem_stats_t;
+
+typedef void (*bf_mem_stats_cb_t)(const bf_mem_stats_t *stats, void *cookie);
+
+/* Takes the lock of a container when lock is true, releases it otherwise */
+typedef void (*bf_mem_stats_lock_t)(void *lock_arg, bool lock);
+
+/* Adds a container under a name, several containers may share a name.
+ * lock_fn may be NULL, see above. */
+bf_mem_stats_sts_t bf_mem_stats_register(const char *name,
+                                         bf_mem_stats_type_t type,
+                                         void *container,
+                                         bf_mem_stats_lock_t lock_fn,
+                                         void *lock_arg);
+
+bf_mem_stats_sts_t bf_mem_stats_unregister(void *container);
+
+/* Totals of the containers registered under "name". */
+bf_mem_stats_sts_t bf_mem_stats_get(const char *name, bf_mem_stats_t *stats);
+
+/* Calls "cb" with the totals of every name, in name order. The registry is
+ * locked meanwhile, "cb" must not register or unregister containers. */
+bf_mem_stats_sts_t bf_mem_stats_walk(bf_mem_stats_cb_t cb, void *cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BF_MEM_STATS_H_ */
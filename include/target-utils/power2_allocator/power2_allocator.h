@@ -16,10 +16,28 @@
 #ifndef _POWER2_ALLOCATOR_H_
 #define _POWER2_ALLOCATOR_H_
 
+/* Engines backing a power2 allocator. Both have the same alignment contract
+ * and are used through the same power2_allocator_* API.
+ *   JUDY   Free lists and in use list kept in Judy arrays. Memory grows with
+ *          the number of allocations, good for large and sparsely used
+ *          tables.
+ *   BITMAP Flat bitmaps sized by total_size with summary words searched with
+ *          ctz. Fixed memory footprint of about 4 bits per index and lower
+ *          latency, good for densely used tables.
+ */
+typedef enum power2_allocator_engine_e {
+  POWER2_ALLOCATOR_ENGINE_JUDY = 0,
+  POWER2_ALLOCATOR_ENGINE_BITMAP
+} power2_allocator_engine_t;
+
+/* Number of sizes log2 of an allocation can take */
+#define POWER2_ALLOCATOR_LOG2_COUNTS 33
+
 typedef struct power2_allocator_s {
   uint32_t max_size;  // Maximum size of a block
   uint32_t total_size;
   uint32_t no_free_lists;  // log2(max_size) + 1
+  power2_allocator_engine_t engine;
   /* Free list is an array indexed by the log2 of the free size.
    * Each array element is a Judy list of free indexes which align to that
    * log2 size. The key is the index and value stores the free size starting
@@ -34,12 +52,76 @@ typedef struct power2_allocator_s {
    *   index 128 and size 3
    */
   void **free_lists;
+  /* Size index for each of the free lists, indexed by the same log2.
+   * Each array element is a Judy list keyed by the free size whose value is
+   * a Judy1 set of the free indexes of that size. Lets the allocator find
+   * the smallest free chunk that fits a request without walking all the
+   * undersized fragments in a free list.
+   */
+  void **size_lists;
   /* Inuse list stores the size in use for a given index.
    * Used in release path to figure out the size to free
    */
   void *inuse_list;
+  /* Index of the large free runs. A free run is a maximal range of free
+   * indexes, which the free lists hold split in aligned chunks. Only the
+   * runs longer than max_size are indexed.
+   * free_runs is a Judy list keyed by the start of each run whose value is
+   * the size of the run. run_sizes is a Judy list keyed by run size whose
+   * value is a Judy1 set of the starts of the runs of that size. Used to
+   * find room for blocks smaller than max_size spanning more than max_size
+   * in power2_allocator_alloc_multiple.
+   */
+  void *free_runs;
+  void *run_sizes;
+  /* State of the bitmap engine, the Judy lists above are unused with it */
+  struct power2_bitmap_s *bitmap;
+  /* Number of allocators sharing the state above after a make_copy, NULL
+   * when the state is private. A shared state is copied before it's changed.
+   */
+  uint32_t *ref_count;
+  /* Usage counters, updated with every allocation and release */
+  uint32_t used_indexes;  // Number of indexes in use
+  uint32_t used_blocks;   // Number of allocations
+  /* Number of allocations by the log2 of their size */
+  uint32_t log2_counts[POWER2_ALLOCATOR_LOG2_COUNTS];
+  /* Judy list keyed by size whose value is the number of allocations of
+   * that size
+   */
+  void *size_counts;
 } power2_allocator_t;
 
+typedef struct power2_allocator_stats_s {
+  uint32_t total_size;
+  uint32_t max_size;
+  uint32_t used_indexes;
+  uint32_t free_indexes;
+  uint32_t alloc_count;
+  /* Number of allocations by the log2 of their size */
+  uint32_t alloc_count_by_log2[POWER2_ALLOCATOR_LOG2_COUNTS];
+} power2_allocator_stats_t;
+
+typedef struct power2_allocator_frag_stats_s {
+  uint32_t free_indexes;
+  /* Largest size power2_allocator_alloc can currently serve */
+  uint32_t largest_alloc_size;
+  /* Number of free blocks of max_size */
+  uint32_t free_max_blocks;
+  /* 0 to 100, share of the free indexes outside of free blocks of max_size */
+  uint32_t frag_score;
+  /* Number of free chunks by log2. Free ranges are split in chunks aligned
+   * to their size, a chunk of log2 l has a size in (2^(l-1), 2^l].
+   */
+  uint32_t free_chunks_by_log2[POWER2_ALLOCATOR_LOG2_COUNTS];
+} power2_allocator_frag_stats_t;
+
+/* Relocation of an allocation returned by power2_allocator_plan_compaction */
+typedef struct power2_allocator_move_s {
+  uint32_t old_index;
+  uint32_t new_index;
+  uint32_t size;
+} power2_allocator_move_t;
+
 /** \brief power2_allocator_create
   *        Create a power2 allocator and initialize count number of
   *        size entries
@@ -53,6 +135,19 @@ typedef struct power2_allocator_s {
   */
 power2_allocator_t *power2_allocator_create(uint32_t size, uint32_t count);
 
+/** \brief power2_allocator_create_engine
+  *        Create a power2 allocator backed by the given engine and initialize
+  *        count number of size entries
+  *
+  * \param size Default size of the resource. This should be a power of 2.
+  * \param count The number of "size" resources available.
+  * \param engine The engine keeping the allocator state
+  * \return Returns the pointer to an allocator to use for future calls.
+  *         Null in case of failure
+  */
+power2_allocator_t *power2_allocator_create_engine(
+    uint32_t size, uint32_t count, power2_allocator_engine_t engine);
+
 /** \brief power2_allocator_destroy
   *        Destroy the state allocated for power2_allocator
   *
@@ -113,6 +208,9 @@ int power2_allocator_reserve(power2_allocator_t *allocator,
 /** \brief power2_allocator_make_copy
   *         Make a copy of the allocator and return the copy
   *
+  * The copy is taken in constant time. It shares the state of src until
+  * either of them is changed, the first change on a shared state copies it.
+  *
   * \param src The pointer to the power2 allocator that needs to be copied
   * \return Returns pointer to an allocator that has same state has the passed
   *in
@@ -121,15 +219,75 @@ int power2_allocator_reserve(power2_allocator_t *allocator,
   */
 power2_allocator_t *power2_allocator_make_copy(power2_allocator_t *src);
 
+/** \brief power2_allocator_restore
+  *         Restore the state of the allocator from a copy of it, in constant
+  *         time
+  *
+  * \param allocator The power2 allocator to restore
+  * \param snapshot The copy returned by power2_allocator_make_copy. It stays
+  *        valid and can be restored from again.
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if the snapshot is not a copy of the allocator
+  */
+int power2_allocator_restore(power2_allocator_t *allocator,
+                             power2_allocator_t *snapshot);
+
+/* Serialization for warm restart.
+ * The state is written as a header (magic, version, engine, max_size,
+ * total_size and number of allocations, each a uint32_t) followed by the
+ * index and size of every allocation, by increasing index, as uint32_t
+ * pairs. The free lists are rebuilt from the gaps between the allocations.
+ * Values are in host byte order, so the buffer can be written to and
+ * mapped back from a file on the same system.
+ */
+
+/** \brief power2_allocator_serialize_size
+  *        Number of bytes power2_allocator_serialize needs for the allocator
+  */
+size_t power2_allocator_serialize_size(power2_allocator_t *allocator);
+
+/** \brief power2_allocator_serialize
+  *        Write the state of the allocator to buf
+  *
+  * \param allocator The power2 allocator
+  * \param buf The buffer to write to, suitably aligned for uint32_t
+  * \param buf_size The size of buf, at least
+  *        power2_allocator_serialize_size(allocator)
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_serialize(power2_allocator_t *allocator,
+                               void *buf,
+                               size_t buf_size);
+
+/** \brief power2_allocator_deserialize
+  *        Create an allocator from the state written by
+  *        power2_allocator_serialize, in a single pass over the allocations
+  *
+  * \param buf The buffer written by power2_allocator_serialize
+  * \param buf_size The size of buf
+  * \return Returns the pointer to the allocator.
+  *         Null in case of failure or if buf doesn't hold a valid state
+  */
+power2_allocator_t *power2_allocator_deserialize(const void *buf,
+                                                 size_t buf_size);
+
 /** \brief power2_allocator_alloc_multiple
-  *        Allocate size resource such that the start index has at least
-  *         log2(size) trailing zeroes.
+  *        Allocate count blocks of size resource, one every 2^log2(size)
+  *         indexes, such that the start index has at least
+  *         log2(count * 2^log2(size)) trailing zeroes.
   *
-  * Example: If the request is for size = 5, the return index will have at least
-  * 3 lsb bits set to zero. (0, 8, 16, 24 ....)
+  * Example: If the request is for size = 5 and count 2, the blocks will be
+  * at index and index + 8, with index a multiple of 16.
+  *
+  * Blocks of the largest size only need the blocks themselves to be free.
+  * Smaller blocks are carved out of a single free run, so the space between
+  * them must be free as well: with index 3 in use, size 3 and count 2 is not
+  * placed at 0 (blocks 0-2 and 4-6) but at 8. That space stays free.
   *
   * \param allocator The power2 allocator
   * \param size The size to allocate
+  * \param count The number of blocks
   * \return Index of the allocated space. -1 if there are any errors
   */
 int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
@@ -137,17 +295,94 @@ int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
                                     uint32_t count);
 
 /** \brief power2_allocator_release_multiple
-  *        Release the resource that was allocated at given index
+  *        Release the count blocks allocated by power2_allocator_alloc_multiple
+  *        at given index
   *
   * \param allocator The power2 allocator
   * \param index Index to release
+  * \param count The number of blocks
   * \return Status of the operation. 0 for SUCCESS.
-  *         non-zero in case of errors
+  *         non-zero in case of errors, no block is released then
   */
 int power2_allocator_release_multiple(power2_allocator_t *allocator,
                                       uint32_t index,
                                       uint32_t count);
 
+/** \brief power2_allocator_alloc_batch
+  *        Allocate n blocks of the given sizes, each aligned like
+  *        power2_allocator_alloc does. Either all of the blocks are allocated
+  *        or none.
+  *
+  * The free list searches and the splitting of free chunks are shared by
+  * the blocks of a batch, making this cheaper than n calls to
+  * power2_allocator_alloc.
+  *
+  * \param allocator The power2 allocator
+  * \param sizes The sizes to allocate
+  * \param n The number of sizes
+  * \param out_indexes Filled with the index allocated for each size
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors, the allocator is left unchanged
+  */
+int power2_allocator_alloc_batch(power2_allocator_t *allocator,
+                                 const uint32_t *sizes,
+                                 uint32_t n,
+                                 uint32_t *out_indexes);
+
+/** \brief power2_allocator_release_batch
+  *        Release the n allocations at the given indexes. Either all of them
+  *        are released or none.
+  *
+  * Neighbouring allocations of a batch are coalesced into a free run once.
+  *
+  * \param allocator The power2 allocator
+  * \param indexes The indexes to release
+  * \param n The number of indexes
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if any of the indexes is not allocated or is repeated, the
+  *         allocator is left unchanged
+  */
+int power2_allocator_release_batch(power2_allocator_t *allocator,
+                                   const uint32_t *indexes,
+                                   uint32_t n);
+
+/** \brief power2_allocator_set
+  *        This is used to handle the backup/restore operations where
+  *         the client may need to set a particular index for use with certain
+  *         size. The library however does some sanity checks to ensure that
+  *         it's internal state is not harmed and returns error
+  *
+  * \param allocator The power2 allocator
+  * \param alloc_index Index to set
+  * \param size The size that was allocated for this index
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if the block is out of range or not free
+  */
+int power2_allocator_set(power2_allocator_t *allocator,
+                         uint32_t alloc_index,
+                         uint32_t size);
+
+/** \brief power2_allocator_set_batch
+  *        Set n indexes for use with the given sizes in one pass. Either all
+  *         of the indexes are set or none.
+  *
+  * The blocks are claimed in index order a free run at a time, the free
+  * chunks of each run are removed and the gaps re-split once however many
+  * blocks land in it.
+  *
+  * \param allocator The power2 allocator
+  * \param indexes The indexes to set
+  * \param sizes The size that was allocated for each index
+  * \param n The number of indexes
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if any of the blocks is out of range, not free or overlaps
+  *         another one of the batch, the allocator is left unchanged
+  */
+int power2_allocator_set_batch(power2_allocator_t *allocator,
+                               const uint32_t *indexes,
+                               const uint32_t *sizes,
+                               uint32_t n);
+
 /** \brief power2_allocator_alloc_count_by_size
   *        Get the number of allocated elements of a given size.
   *
@@ -162,6 +397,54 @@ int power2_allocator_usage(power2_allocator_t *allocator);
 
 uint32_t power2_allocator_alloc_count(power2_allocator_t *allocator);
 
+/** \brief power2_allocator_get_stats
+  *        Get the usage counters of the allocator. The counters are kept up
+  *        to date by every allocation and release, this doesn't walk the
+  *        allocations.
+  *
+  * \param allocator The power2 allocator
+  * \param stats Filled with the counters
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_get_stats(power2_allocator_t *allocator,
+                               power2_allocator_stats_t *stats);
+
+/** \brief power2_allocator_get_frag_stats
+  *        Get the fragmentation of the free space of the allocator
+  *
+  * \param allocator The power2 allocator
+  * \param stats Filled with the fragmentation metrics
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_get_frag_stats(power2_allocator_t *allocator,
+                                    power2_allocator_frag_stats_t *stats);
+
+/** \brief power2_allocator_plan_compaction
+  *        Find the fewest allocations to move so that size can be allocated
+  *
+  * The planner looks for the aligned window of size overlapped by the fewest
+  * allocations which can all be placed elsewhere. Every new_index is free
+  * when the plan is made and outside of the window and of the other moved
+  * allocations, so the moves can be applied one at a time in any order with
+  * power2_allocator_reserve(new_index, size) followed by
+  * power2_allocator_release(old_index).
+  *
+  * \param allocator The power2 allocator, which is not changed
+  * \param size The size which should fit
+  * \param moves Filled with the moves
+  * \param max_moves The most moves which can be returned
+  * \param num_moves Set to the number of moves, 0 if size already fits
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if no plan with at most max_moves moves was found
+  */
+int power2_allocator_plan_compaction(power2_allocator_t *allocator,
+                                     uint32_t size,
+                                     power2_allocator_move_t *moves,
+                                     uint32_t max_moves,
+                                     uint32_t *num_moves);
+
 int power2_allocator_first_alloc(power2_allocator_t *allocator);
 int power2_allocator_next_alloc(power2_allocator_t *allocator, int idx);
 
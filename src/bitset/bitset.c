@@ -19,11 +19,304 @@
 #include <Judy.h>
 #include <target-sys/bf_sal/bf_sys_intf.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define BF_BS_X86 1
+#include <immintrin.h>
+#endif
+
 /* Number of uint64_t elements in the BitSet. */
 static inline size_t length(bf_bitset_t *bs) {
   return BF_BITSET_ARRAY_SIZE(bs->width);
 }
 
+/* Whole set kernels, working on n words. The variant matching the CPU is
+ * picked on first use, the scalar one being the fallback.
+ */
+typedef enum bf_bs_op_e {
+  BF_BS_OP_AND,
+  BF_BS_OP_OR,
+  BF_BS_OP_XOR,
+  BF_BS_OP_ANDNOT
+} bf_bs_op_t;
+
+typedef void (*bf_bs_op_fn)(uint64_t *dst,
+                            const uint64_t *x,
+                            const uint64_t *y,
+                            size_t n,
+                            bf_bs_op_t op);
+/* Bits set in x, or in x & y when y is not NULL */
+typedef uint64_t (*bf_bs_count_fn)(const uint64_t *x,
+                                   const uint64_t *y,
+                                   size_t n);
+
+static void bs_op_scalar(uint64_t *dst,
+                         const uint64_t *x,
+                         const uint64_t *y,
+                         size_t n,
+                         bf_bs_op_t op) {
+  size_t i;
+
+  switch (op) {
+    case BF_BS_OP_AND:
+      for (i = 0; i < n; i++) dst[i] = x[i] & y[i];
+      break;
+    case BF_BS_OP_OR:
+      for (i = 0; i < n; i++) dst[i] = x[i] | y[i];
+      break;
+    case BF_BS_OP_XOR:
+      for (i = 0; i < n; i++) dst[i] = x[i] ^ y[i];
+      break;
+    case BF_BS_OP_ANDNOT:
+      for (i = 0; i < n; i++) dst[i] = x[i] & ~y[i];
+      break;
+  }
+}
+
+static uint64_t bs_count_scalar(const uint64_t *x,
+                                const uint64_t *y,
+                                size_t n) {
+  uint64_t cnt = 0;
+  size_t i;
+
+  if (y) {
+    for (i = 0; i < n; i++) cnt += __builtin_popcountll(x[i] & y[i]);
+  } else {
+    for (i = 0; i < n; i++) cnt += __builtin_popcountll(x[i]);
+  }
+  return cnt;
+}
+
+#ifdef BF_BS_X86
+
+/* Runs expr over the operands a and b loaded "width" words at a time */
+#define BF_BS_VEC_LOOP(width, vec, load, store, expr) \
+  for (; i + (width) <= n; i += (width)) {            \
+    vec a = load((const vec *)(x + i));               \
+    vec b = load((const vec *)(y + i));               \
+    store((vec *)(dst + i), expr);                    \
+  }
+
+static void bs_op_sse2(uint64_t *dst,
+                       const uint64_t *x,
+                       const uint64_t *y,
+                       size_t n,
+                       bf_bs_op_t op) {
+  size_t i = 0;
+
+  switch (op) {
+    case BF_BS_OP_AND:
+      BF_BS_VEC_LOOP(
+          2, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_and_si128(a, b));
+      break;
+    case BF_BS_OP_OR:
+      BF_BS_VEC_LOOP(
+          2, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_or_si128(a, b));
+      break;
+    case BF_BS_OP_XOR:
+      BF_BS_VEC_LOOP(
+          2, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_xor_si128(a, b));
+      break;
+    case BF_BS_OP_ANDNOT:
+      BF_BS_VEC_LOOP(2,
+                     __m128i,
+                     _mm_loadu_si128,
+                     _mm_storeu_si128,
+                     _mm_andnot_si128(b, a));
+      break;
+  }
+  bs_op_scalar(dst + i, x + i, y + i, n - i, op);
+}
+
+__attribute__((target("avx2"))) static void bs_op_avx2(uint64_t *dst,
+                                                       const uint64_t *x,
+                                                       const uint64_t *y,
+                                                       size_t n,
+                                                       bf_bs_op_t op) {
+  size_t i = 0;
+
+  switch (op) {
+    case BF_BS_OP_AND:
+      BF_BS_VEC_LOOP(4,
+                     __m256i,
+                     _mm256_loadu_si256,
+                     _mm256_storeu_si256,
+                     _mm256_and_si256(a, b));
+      break;
+    case BF_BS_OP_OR:
+      BF_BS_VEC_LOOP(4,
+                     __m256i,
+                     _mm256_loadu_si256,
+                     _mm256_storeu_si256,
+                     _mm256_or_si256(a, b));
+      break;
+    case BF_BS_OP_XOR:
+      BF_BS_VEC_LOOP(4,
+                     __m256i,
+                     _mm256_loadu_si256,
+                     _mm256_storeu_si256,
+                     _mm256_xor_si256(a, b));
+      break;
+    case BF_BS_OP_ANDNOT:
+      BF_BS_VEC_LOOP(4,
+                     __m256i,
+                     _mm256_loadu_si256,
+                     _mm256_storeu_si256,
+                     _mm256_andnot_si256(b, a));
+      break;
+  }
+  bs_op_sse2(dst + i, x + i, y + i, n - i, op);
+}
+
+__attribute__((target("avx512f"))) static void bs_op_avx512(
+    uint64_t *dst,
+    const uint64_t *x,
+    const uint64_t *y,
+    size_t n,
+    bf_bs_op_t op) {
+  __m512i xv, yv, r;
+  __mmask8 m;
+  size_t i = 0;
+
+  switch (op) {
+    case BF_BS_OP_AND:
+      BF_BS_VEC_LOOP(8,
+                     __m512i,
+                     _mm512_loadu_si512,
+                     _mm512_storeu_si512,
+                     _mm512_and_si512(a, b));
+      break;
+    case BF_BS_OP_OR:
+      BF_BS_VEC_LOOP(8,
+                     __m512i,
+                     _mm512_loadu_si512,
+                     _mm512_storeu_si512,
+                     _mm512_or_si512(a, b));
+      break;
+    case BF_BS_OP_XOR:
+      BF_BS_VEC_LOOP(8,
+                     __m512i,
+                     _mm512_loadu_si512,
+                     _mm512_storeu_si512,
+                     _mm512_xor_si512(a, b));
+      break;
+    case BF_BS_OP_ANDNOT:
+      BF_BS_VEC_LOOP(8,
+                     __m512i,
+                     _mm512_loadu_si512,
+                     _mm512_storeu_si512,
+                     _mm512_andnot_si512(b, a));
+      break;
+  }
+  if (i == n) {
+    return;
+  }
+  /* The last partial vector goes through masked loads and stores */
+  m = (__mmask8)((1u << (n - i)) - 1);
+  xv = _mm512_maskz_loadu_epi64(m, x + i);
+  yv = _mm512_maskz_loadu_epi64(m, y + i);
+  switch (op) {
+    case BF_BS_OP_AND:
+      r = _mm512_and_si512(xv, yv);
+      break;
+    case BF_BS_OP_OR:
+      r = _mm512_or_si512(xv, yv);
+      break;
+    case BF_BS_OP_XOR:
+      r = _mm512_xor_si512(xv, yv);
+      break;
+    default:
+      r = _mm512_andnot_si512(yv, xv);
+      break;
+  }
+  _mm512_mask_storeu_epi64(dst + i, m, r);
+}
+
+/* Same as the scalar one, built for the popcnt instruction rather than the
+ * generic bit twiddling fallback of the compiler.
+ */
+__attribute__((target("popcnt"))) static uint64_t bs_count_popcnt(
+    const uint64_t *x, const uint64_t *y, size_t n) {
+  uint64_t cnt = 0;
+  size_t i;
+
+  if (y) {
+    for (i = 0; i < n; i++) cnt += __builtin_popcountll(x[i] & y[i]);
+  } else {
+    for (i = 0; i < n; i++) cnt += __builtin_popcountll(x[i]);
+  }
+  return cnt;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static uint64_t
+bs_count_avx512(const uint64_t *x, const uint64_t *y, size_t n) {
+  __m512i a, sum = _mm512_setzero_si512();
+  __mmask8 m;
+  size_t i;
+
+  for (i = 0; i < n; i += 8) {
+    m = (n - i >= 8) ? 0xFF : (__mmask8)((1u << (n - i)) - 1);
+    a = _mm512_maskz_loadu_epi64(m, x + i);
+    if (y) {
+      a = _mm512_and_si512(a, _mm512_maskz_loadu_epi64(m, y + i));
+    }
+    sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(a));
+  }
+  return _mm512_reduce_add_epi64(sum);
+}
+
+#endif
+
+static struct {
+  bf_bs_op_fn op;
+  bf_bs_count_fn count;
+} bs_kernels = {NULL, NULL};
+
+static void bs_kernels_init(void) {
+  bf_bs_op_fn op = bs_op_scalar;
+  bf_bs_count_fn count = bs_count_scalar;
+
+#ifdef BF_BS_X86
+  __builtin_cpu_init();
+  op = bs_op_sse2;
+  if (__builtin_cpu_supports("popcnt")) {
+    count = bs_count_popcnt;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    op = bs_op_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    op = bs_op_avx512;
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+      count = bs_count_avx512;
+    }
+  }
+#endif
+  /* Threads racing through the first call all store the same pointers, the
+   * atomics make those racing stores and loads well defined. */
+  __atomic_store_n(&bs_kernels.count, count, __ATOMIC_RELEASE);
+  __atomic_store_n(&bs_kernels.op, op, __ATOMIC_RELEASE);
+}
+
+static inline bf_bs_op_fn bs_op_kernel(void) {
+  bf_bs_op_fn op = __atomic_load_n(&bs_kernels.op, __ATOMIC_ACQUIRE);
+
+  if (!op) {
+    bs_kernels_init();
+    op = __atomic_load_n(&bs_kernels.op, __ATOMIC_ACQUIRE);
+  }
+  return op;
+}
+
+static inline bf_bs_count_fn bs_count_kernel(void) {
+  bf_bs_count_fn count = __atomic_load_n(&bs_kernels.count, __ATOMIC_ACQUIRE);
+
+  if (!count) {
+    bs_kernels_init();
+    count = __atomic_load_n(&bs_kernels.count, __ATOMIC_ACQUIRE);
+  }
+  return count;
+}
+
 void bf_bs_init(bf_bitset_t *bs, int width, uint64_t *mem) {
   /* Expect 64-bit unsigned long */
   bf_sys_assert(sizeof(unsigned long long) == sizeof(uint64_t));
@@ -75,6 +368,54 @@ static inline uint64_t top_word_mask(bf_bitset_t *bs) {
   return x ? (UINT64_C(1) << x) - 1 : UINT64_C(0xFFFFFFFFFFFFFFFF);
 }
 
+/* Mask of the bits from "pos" % 64 up to "end" within one word, "end" being
+ * at most 64 bits above the word start. */
+static inline uint64_t bs_word_mask(size_t pos, size_t end) {
+  unsigned lo = pos % 64;
+  unsigned hi = end - (pos - lo);
+  uint64_t mask = hi < 64 ? (UINT64_C(1) << hi) - 1 : ~UINT64_C(0);
+  return mask & (~UINT64_C(0) << lo);
+}
+
+/* Sets or clears the bits in [pos, end) a whole word at a time. */
+static void bs_fill(uint64_t *w, size_t pos, size_t end, bool val) {
+  size_t first = pos / 64;
+  size_t last = (end - 1) / 64;
+  uint64_t head, tail;
+
+  if (first == last) {
+    head = bs_word_mask(pos, end);
+    w[first] = val ? w[first] | head : w[first] & ~head;
+    return;
+  }
+  head = ~UINT64_C(0) << (pos % 64);
+  tail = bs_word_mask(last * 64, end);
+  w[first] = val ? w[first] | head : w[first] & ~head;
+  memset(w + first + 1, val ? 0xFF : 0, (last - first - 1) * sizeof(uint64_t));
+  w[last] = val ? w[last] | tail : w[last] & ~tail;
+}
+
+/* Returns the first bit in [pos, end) which is set, or clear when "flip" is
+ * all ones. Returns end if there is none. */
+static size_t bs_find(const uint64_t *w,
+                      size_t pos,
+                      size_t end,
+                      uint64_t flip) {
+  size_t i = pos / 64;
+  size_t last;
+  uint64_t x;
+
+  if (pos >= end) return end;
+  last = (end - 1) / 64;
+  x = (w[i] ^ flip) & (~UINT64_C(0) << (pos % 64));
+  while (!x) {
+    if (++i > last) return end;
+    x = w[i] ^ flip;
+  }
+  pos = 64 * i + __builtin_ctzll(x);
+  return pos < end ? pos : end;
+}
+
 void bf_bs_set_all(bf_bitset_t *bs, int val) {
   bf_sys_assert(bs);
   size_t len = length(bs);
@@ -97,32 +438,8 @@ int bf_bs_first_set(bf_bitset_t *bs, int position) {
     return -1;
   }
 
-  size_t len = length(bs);
-  size_t i = position / 64;
-  int shift = position % 64;
-  int x;
-
-  bs->bs[len - 1] &= top_word_mask(bs);
-  x = __builtin_ffsll(bs->bs[i] >> shift);
-  if (x) {
-    return 64 * i + x - 1 + shift;
-  }
-
-  if (i == (len - 1)) {
-    return -1;
-  }
-
-  for (i = i + 1; i < len - 1; ++i) {
-    x = __builtin_ffsll(bs->bs[i]);
-    if (x) {
-      return 64 * i + x - 1;
-    }
-  }
-  x = __builtin_ffsll(bs->bs[i]);
-  if (x && ((64 * i + x - 1) < bs->width)) {
-    return 64 * i + x - 1;
-  }
-  return -1;
+  size_t x = bs_find(bs->bs, position, bs->width, 0);
+  return x < bs->width ? (int)x : -1;
 }
 
 int bf_bs_first_clr(bf_bitset_t *bs, int position) {
@@ -134,32 +451,8 @@ int bf_bs_first_clr(bf_bitset_t *bs, int position) {
     return -1;
   }
 
-  size_t len = length(bs);
-  size_t i = position / 64;
-  int shift = position % 64;
-  int x;
-
-  bs->bs[len - 1] &= top_word_mask(bs);
-  x = __builtin_ffsll((~bs->bs[i]) >> shift);
-  if (x) {
-    return 64 * i + x - 1 + shift;
-  }
-
-  if (i == (len - 1)) {
-    return -1;
-  }
-
-  for (i = i + 1; i < len - 1; ++i) {
-    x = __builtin_ffsll(~bs->bs[i]);
-    if (x) {
-      return 64 * i + x - 1;
-    }
-  }
-  x = __builtin_ffsll(~bs->bs[i]);
-  if (x && ((64 * i + x - 1) < bs->width)) {
-    return 64 * i + x - 1;
-  }
-  return -1;
+  size_t x = bs_find(bs->bs, position, bs->width, ~UINT64_C(0));
+  return x < bs->width ? (int)x : -1;
 }
 
 bool bf_bs_all_1s(bf_bitset_t *bs) {
@@ -202,13 +495,8 @@ bool bf_bs_equal(bf_bitset_t *x, bf_bitset_t *y) {
 
   x->bs[length(x) - 1] &= top_word_mask(x);
   y->bs[length(y) - 1] &= top_word_mask(y);
-  unsigned int i;
-  for (i = 0; i < length(x); ++i) {
-    uint64_t xx = bf_bs_get_word(x, i * 64, 64);
-    uint64_t yy = bf_bs_get_word(y, i * 64, 64);
-    if (xx != yy) return false;
-  }
-  return true;
+  /* The libc memcmp is already vectorized for the running CPU */
+  return memcmp(x->bs, y->bs, length(x) * sizeof(uint64_t)) == 0;
 }
 void bf_bs_set_word(bf_bitset_t *bs, int position, int size, uint64_t val) {
   bf_sys_assert(bs);
@@ -269,9 +557,56 @@ void bf_bs_copy(bf_bitset_t *dst, bf_bitset_t *src) {
   bf_sys_assert(src);
   bf_sys_assert(dst);
   bf_sys_assert(src->width == dst->width);
+  size_t len = length(src);
+  memmove(dst->bs, src->bs, (len - 1) * sizeof(uint64_t));
+  dst->bs[len - 1] = src->bs[len - 1] & top_word_mask(src);
+}
+
+/* Reads n (1 to 64) bits from bit "pos", touching only the words holding
+ * them. */
+static inline uint64_t bs_read(const uint64_t *w, size_t pos, unsigned n) {
+  size_t i = pos / 64;
+  unsigned shift = pos % 64;
+  uint64_t x = w[i] >> shift;
+  if (shift && shift + n > 64) x |= w[i + 1] << (64 - shift);
+  return n < 64 ? x & ((UINT64_C(1) << n) - 1) : x;
+}
+
+/* Writes n (1 to 64) bits at bit "pos", which must all be in one word. */
+static inline void bs_write(uint64_t *w, size_t pos, unsigned n, uint64_t x) {
+  uint64_t mask = n < 64 ? (UINT64_C(1) << n) - 1 : ~UINT64_C(0);
+  mask <<= pos % 64;
+  w[pos / 64] = (w[pos / 64] & ~mask) | ((x << (pos % 64)) & mask);
+}
+
+/* Copies whole words to the word aligned "dst_pos". The source words are
+ * moved with memmove when "src_pos" is aligned as well and put together from
+ * two source words with a funnel shift otherwise. Going up or down keeps
+ * overlapping copies within a set correct, as with memmove. */
+static void bs_copy_words(uint64_t *dst,
+                          size_t dst_pos,
+                          const uint64_t *src,
+                          size_t src_pos,
+                          size_t n_words,
+                          bool down) {
+  const uint64_t *s = src + src_pos / 64;
+  uint64_t *d = dst + dst_pos / 64;
+  unsigned shift = src_pos % 64;
   size_t i;
-  for (i = 0; i < src->width / 64; ++i) dst->bs[i] = src->bs[i];
-  dst->bs[i] = src->bs[i] & ((UINT64_C(1) << (src->width % 64)) - 1);
+
+  if (!shift) {
+    memmove(d, s, n_words * sizeof(uint64_t));
+    return;
+  }
+  if (down) {
+    for (i = n_words; i-- > 0;) {
+      d[i] = (s[i] >> shift) | (s[i + 1] << (64 - shift));
+    }
+  } else {
+    for (i = 0; i < n_words; ++i) {
+      d[i] = (s[i] >> shift) | (s[i + 1] << (64 - shift));
+    }
+  }
 }
 
 void bf_bs_copy_range(bf_bitset_t *dst,
@@ -281,24 +616,843 @@ void bf_bs_copy_range(bf_bitset_t *dst,
                       unsigned int n_bits) {
   bf_sys_assert(src);
   bf_sys_assert(dst);
+  if (!n_bits) return;
   bf_sys_assert(src->width > (src_offset + n_bits - 1));
   bf_sys_assert(dst->width > (dst_offset + n_bits - 1));
-  size_t i = 0;
+
+  /* The head bits up to the first word boundary of dst, the whole words and
+   * the tail bits in the last word. */
+  unsigned head = (64 - dst_offset % 64) % 64;
+  if (head > n_bits) head = n_bits;
+  size_t n_words = (n_bits - head) / 64;
+  unsigned tail = (n_bits - head) % 64;
+  size_t mid = head + n_words * 64;
+  /* Copy from the top down when dst overlaps the source further up */
+  bool down = dst->bs == src->bs && dst_offset > src_offset;
   uint64_t x;
-  for (i = 0; i < src->width / 64; ++i) {
-    x = bf_bs_get_word(src, src_offset + i * 64, 64);
-    bf_bs_set_word(dst, dst_offset + i * 64, 64, x);
+
+  if (down) {
+    if (tail) {
+      x = bs_read(src->bs, src_offset + mid, tail);
+      bs_write(dst->bs, dst_offset + mid, tail, x);
+    }
+    bs_copy_words(
+        dst->bs, dst_offset + head, src->bs, src_offset + head, n_words, true);
+    if (head) {
+      x = bs_read(src->bs, src_offset, head);
+      bs_write(dst->bs, dst_offset, head, x);
+    }
+  } else {
+    if (head) {
+      x = bs_read(src->bs, src_offset, head);
+      bs_write(dst->bs, dst_offset, head, x);
+    }
+    bs_copy_words(
+        dst->bs, dst_offset + head, src->bs, src_offset + head, n_words, false);
+    if (tail) {
+      x = bs_read(src->bs, src_offset + mid, tail);
+      bs_write(dst->bs, dst_offset + mid, tail, x);
+    }
   }
-  x = bf_bs_get_word(src, src_offset + i * 64, n_bits % 64);
-  bf_bs_set_word(dst, dst_offset + i * 64, n_bits % 64, x);
+}
+
+void bf_bs_set_range(bf_bitset_t *bs, int position, int n_bits) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert(n_bits >= 0);
+  bf_sys_assert((unsigned)position + (unsigned)n_bits <= bs->width);
+  if (n_bits <= 0) return;
+  bs_fill(bs->bs, position, (size_t)position + n_bits, true);
+}
+
+void bf_bs_clr_range(bf_bitset_t *bs, int position, int n_bits) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert(n_bits >= 0);
+  bf_sys_assert((unsigned)position + (unsigned)n_bits <= bs->width);
+  if (n_bits <= 0) return;
+  bs_fill(bs->bs, position, (size_t)position + n_bits, false);
+}
+
+int bf_bs_count_range(bf_bitset_t *bs, int position, int n_bits) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert(n_bits >= 0);
+  bf_sys_assert((unsigned)position + (unsigned)n_bits <= bs->width);
+  if (n_bits <= 0) return 0;
+
+  size_t end = (size_t)position + n_bits;
+  size_t first = position / 64;
+  size_t last = (end - 1) / 64;
+  uint64_t cnt;
+
+  if (first == last) {
+    return __builtin_popcountll(bs->bs[first] & bs_word_mask(position, end));
+  }
+  cnt = __builtin_popcountll(bs->bs[first] & (~UINT64_C(0) << (position % 64)));
+  cnt += bs_count_kernel()(bs->bs + first + 1, NULL, last - first - 1);
+  cnt += __builtin_popcountll(bs->bs[last] & bs_word_mask(last * 64, end));
+  return cnt;
+}
+
+int bf_bs_first_clr_run(bf_bitset_t *bs, int start, int n) {
+  bf_sys_assert(bs);
+  bf_sys_assert(start >= 0);
+  bf_sys_assert(n > 0);
+  if (start < 0 || n <= 0) return -1;
+
+  size_t width = bs->width;
+  size_t pos = start;
+
+  /* Jump to the next clear bit, then to the next set bit after it. The run
+   * fits if that set bit is at least n bits away. */
+  while (pos + n <= width) {
+    pos = bs_find(bs->bs, pos, width, ~UINT64_C(0));
+    if (pos + n > width) break;
+    size_t set = bs_find(bs->bs, pos, pos + n, 0);
+    if (set == pos + n) return pos;
+    pos = set + 1;
+  }
+  return -1;
+}
+
+int bf_bs_last_set(bf_bitset_t *bs, int position) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position <= bs->width);
+  if (position <= 0) return -1;
+  if ((unsigned)position > bs->width) position = bs->width;
+
+  size_t i = (position - 1) / 64;
+  uint64_t x = bs->bs[i] & bs_word_mask(64 * i, position);
+
+  while (!x) {
+    if (!i--) return -1;
+    x = bs->bs[i];
+  }
+  return 64 * i + 63 - __builtin_clzll(x);
 }
 
 int bf_bs_pop_count(bf_bitset_t *bs) {
   bf_sys_assert(bs);
-  int cnt = 0;
   size_t len = length(bs);
   bs->bs[len - 1] &= top_word_mask(bs);
-  unsigned int i;
-  for (i = 0; i < length(bs); ++i) cnt += __builtin_popcountll(bs->bs[i]);
+  return bs_count_kernel()(bs->bs, NULL, len);
+}
+
+static void bs_apply(bf_bitset_t *dst,
+                     bf_bitset_t *x,
+                     bf_bitset_t *y,
+                     bf_bs_op_t op) {
+  bf_sys_assert(dst);
+  bf_sys_assert(x);
+  bf_sys_assert(y);
+  bf_sys_assert(dst->width == x->width);
+  bf_sys_assert(dst->width == y->width);
+  size_t len = length(dst);
+  bs_op_kernel()(dst->bs, x->bs, y->bs, len, op);
+  dst->bs[len - 1] &= top_word_mask(dst);
+}
+
+void bf_bs_and(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y) {
+  bs_apply(dst, x, y, BF_BS_OP_AND);
+}
+
+void bf_bs_or(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y) {
+  bs_apply(dst, x, y, BF_BS_OP_OR);
+}
+
+void bf_bs_xor(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y) {
+  bs_apply(dst, x, y, BF_BS_OP_XOR);
+}
+
+void bf_bs_andnot(bf_bitset_t *dst, bf_bitset_t *x, bf_bitset_t *y) {
+  bs_apply(dst, x, y, BF_BS_OP_ANDNOT);
+}
+
+int bf_bs_intersect_count(bf_bitset_t *x, bf_bitset_t *y) {
+  bf_sys_assert(x);
+  bf_sys_assert(y);
+  bf_sys_assert(x->width == y->width);
+  size_t len = length(x);
+  x->bs[len - 1] &= top_word_mask(x);
+  y->bs[len - 1] &= top_word_mask(y);
+  return bs_count_kernel()(x->bs, y->bs, len);
+}
+
+/* Summary index of the words with bits set and of those with bits clear */
+#define HBS_SET 0
+#define HBS_CLR 1
+
+/* Valid bits of word i */
+static inline uint64_t hbs_word_mask(bf_hbitset_t *hbs, size_t i) {
+  return i == length(&hbs->bs) - 1 ? top_word_mask(&hbs->bs) : ~UINT64_C(0);
+}
+
+/* Updates the second level bit for first level word j of summary k */
+static inline void hbs_update_l2(bf_hbitset_t *hbs, int k, size_t j) {
+  uint64_t bit = UINT64_C(1) << (j % 64);
+  if (hbs->l1[k][j])
+    hbs->l2[k][j / 64] |= bit;
+  else
+    hbs->l2[k][j / 64] &= ~bit;
+}
+
+/* Updates both summaries for word i of the set */
+static void hbs_update(bf_hbitset_t *hbs, size_t i) {
+  uint64_t w = hbs->bs.bs[i];
+  uint64_t bit = UINT64_C(1) << (i % 64);
+  size_t j = i / 64;
+
+  if (w)
+    hbs->l1[HBS_SET][j] |= bit;
+  else
+    hbs->l1[HBS_SET][j] &= ~bit;
+  if (w != hbs_word_mask(hbs, i))
+    hbs->l1[HBS_CLR][j] |= bit;
+  else
+    hbs->l1[HBS_CLR][j] &= ~bit;
+  hbs_update_l2(hbs, HBS_SET, j);
+  hbs_update_l2(hbs, HBS_CLR, j);
+}
+
+void bf_hbs_init(bf_hbitset_t *hbs, int width, uint64_t *mem) {
+  bf_sys_assert(hbs);
+  bf_bs_init(&hbs->bs, width, mem);
+  hbs->l1_len = BF_HBITSET_L1_SIZE((unsigned)width);
+  hbs->l2_len = BF_HBITSET_L2_SIZE((unsigned)width);
+  hbs->l1[HBS_SET] = mem + length(&hbs->bs);
+  hbs->l1[HBS_CLR] = hbs->l1[HBS_SET] + hbs->l1_len;
+  hbs->l2[HBS_SET] = hbs->l1[HBS_CLR] + hbs->l1_len;
+  hbs->l2[HBS_CLR] = hbs->l2[HBS_SET] + hbs->l2_len;
+  bf_hbs_sync(hbs);
+}
+
+void bf_hbs_sync(bf_hbitset_t *hbs) {
+  bf_sys_assert(hbs);
+  size_t len = length(&hbs->bs);
+  size_t i;
+
+  hbs->bs.bs[len - 1] &= top_word_mask(&hbs->bs);
+  memset(hbs->l1[HBS_SET], 0, 2 * hbs->l1_len * sizeof(uint64_t));
+  memset(hbs->l2[HBS_SET], 0, 2 * hbs->l2_len * sizeof(uint64_t));
+  for (i = 0; i < len; ++i) {
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    if (hbs->bs.bs[i]) hbs->l1[HBS_SET][i / 64] |= bit;
+    if (hbs->bs.bs[i] != hbs_word_mask(hbs, i))
+      hbs->l1[HBS_CLR][i / 64] |= bit;
+  }
+  for (i = 0; i < hbs->l1_len; ++i) {
+    hbs_update_l2(hbs, HBS_SET, i);
+    hbs_update_l2(hbs, HBS_CLR, i);
+  }
+}
+
+bool bf_hbs_set(bf_hbitset_t *hbs, int position, int val) {
+  bf_sys_assert(hbs);
+  bool prev = bf_bs_set(&hbs->bs, position, val);
+  if (prev != !!val && (unsigned)position < hbs->bs.width) {
+    hbs_update(hbs, position / 64);
+  }
+  return prev;
+}
+
+bool bf_hbs_get(bf_hbitset_t *hbs, int position) {
+  bf_sys_assert(hbs);
+  return bf_bs_get(&hbs->bs, position);
+}
+
+void bf_hbs_set_all(bf_hbitset_t *hbs, int val) {
+  bf_sys_assert(hbs);
+  bf_bs_set_all(&hbs->bs, val);
+  bf_hbs_sync(hbs);
+}
+
+/* Sets or clears [pos, end) and updates the summaries: the words entirely in
+ * the range are now all set or all clear, the first and last words are
+ * checked. */
+static void hbs_fill(bf_hbitset_t *hbs, size_t pos, size_t end, bool val) {
+  size_t first = pos / 64;
+  size_t last = (end - 1) / 64;
+  size_t j;
+
+  bs_fill(hbs->bs.bs, pos, end, val);
+  if (last - first > 1) {
+    bs_fill(hbs->l1[HBS_SET], first + 1, last, val);
+    bs_fill(hbs->l1[HBS_CLR], first + 1, last, !val);
+    for (j = (first + 1) / 64; j <= (last - 1) / 64; ++j) {
+      hbs_update_l2(hbs, HBS_SET, j);
+      hbs_update_l2(hbs, HBS_CLR, j);
+    }
+  }
+  hbs_update(hbs, first);
+  hbs_update(hbs, last);
+}
+
+void bf_hbs_set_range(bf_hbitset_t *hbs, int position, int n_bits) {
+  bf_sys_assert(hbs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert(n_bits >= 0);
+  bf_sys_assert((unsigned)position + (unsigned)n_bits <= hbs->bs.width);
+  if (n_bits <= 0) return;
+  hbs_fill(hbs, position, (size_t)position + n_bits, true);
+}
+
+void bf_hbs_clr_range(bf_hbitset_t *hbs, int position, int n_bits) {
+  bf_sys_assert(hbs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert(n_bits >= 0);
+  bf_sys_assert((unsigned)position + (unsigned)n_bits <= hbs->bs.width);
+  if (n_bits <= 0) return;
+  hbs_fill(hbs, position, (size_t)position + n_bits, false);
+}
+
+/* Returns the first word at or after word i which has bits set (k is
+ * HBS_SET) or clear (HBS_CLR), -1 if there is none. */
+static size_t hbs_next_word(bf_hbitset_t *hbs, int k, size_t i) {
+  size_t j = i / 64;
+  uint64_t x;
+
+  if (j >= hbs->l1_len) return -1;
+  x = hbs->l1[k][j] & (~UINT64_C(0) << (i % 64));
+  if (!x) {
+    j = bs_find(hbs->l2[k], j + 1, (size_t)hbs->l2_len * 64, 0);
+    if (j >= hbs->l1_len) return -1;
+    x = hbs->l1[k][j];
+  }
+  return 64 * j + __builtin_ctzll(x);
+}
+
+static int hbs_first(bf_hbitset_t *hbs, int position, int k) {
+  ++position;
+  bf_sys_assert(hbs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position <= hbs->bs.width);
+  if (position < 0 || (unsigned)position >= hbs->bs.width) {
+    return -1;
+  }
+
+  uint64_t flip = k == HBS_SET ? 0 : ~UINT64_C(0);
+  size_t i = position / 64;
+  uint64_t x = (hbs->bs.bs[i] ^ flip) & hbs_word_mask(hbs, i) &
+               (~UINT64_C(0) << (position % 64));
+
+  if (!x) {
+    i = hbs_next_word(hbs, k, i + 1);
+    if (i == (size_t)-1) return -1;
+    x = (hbs->bs.bs[i] ^ flip) & hbs_word_mask(hbs, i);
+  }
+  return 64 * i + __builtin_ctzll(x);
+}
+
+int bf_hbs_first_set(bf_hbitset_t *hbs, int position) {
+  return hbs_first(hbs, position, HBS_SET);
+}
+
+int bf_hbs_first_clr(bf_hbitset_t *hbs, int position) {
+  return hbs_first(hbs, position, HBS_CLR);
+}
+
+/* Atomic bitset. Read-modify-writes are acquire-release so a bit claimed or
+ * released also orders the data it guards, searches use acquire loads. */
+
+static inline uint64_t abs_top_word_mask(bf_atomic_bitset_t *bs) {
+  uint64_t x = bs->width % 64;
+  return x ? (UINT64_C(1) << x) - 1 : UINT64_C(0xFFFFFFFFFFFFFFFF);
+}
+
+void bf_abs_init(bf_atomic_bitset_t *bs, int width, uint64_t *mem) {
+  bf_sys_assert(bs);
+  bf_sys_assert(mem);
+  bf_sys_assert(width > 0);
+  bs->bs = mem;
+  bs->width = width;
+}
+
+bool bf_abs_set(bf_atomic_bitset_t *bs, int position, int val) {
+  return val ? bf_abs_test_and_set(bs, position)
+             : bf_abs_test_and_clr(bs, position);
+}
+
+bool bf_abs_test_and_set(bf_atomic_bitset_t *bs, int position) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position < bs->width);
+  if (position < 0 || (unsigned)position >= bs->width) {
+    return false;
+  }
+
+  uint64_t bit = UINT64_C(1) << (position % 64);
+  return __atomic_fetch_or(&bs->bs[position / 64], bit, __ATOMIC_ACQ_REL) &
+         bit;
+}
+
+bool bf_abs_test_and_clr(bf_atomic_bitset_t *bs, int position) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position < bs->width);
+  if (position < 0 || (unsigned)position >= bs->width) {
+    return false;
+  }
+
+  uint64_t bit = UINT64_C(1) << (position % 64);
+  return __atomic_fetch_and(&bs->bs[position / 64], ~bit, __ATOMIC_ACQ_REL) &
+         bit;
+}
+
+bool bf_abs_get(bf_atomic_bitset_t *bs, int position) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position < bs->width);
+  if (position < 0 || (unsigned)position >= bs->width) {
+    return false;
+  }
+
+  uint64_t w = __atomic_load_n(&bs->bs[position / 64], __ATOMIC_ACQUIRE);
+  return (w >> (position % 64)) & 1;
+}
+
+void bf_abs_set_all(bf_atomic_bitset_t *bs, int val) {
+  bf_sys_assert(bs);
+  bf_sys_assert(1 == val || 0 == val);
+  size_t len = BF_BITSET_ARRAY_SIZE(bs->width);
+  uint64_t w = val ? ~UINT64_C(0) : 0;
+  size_t i;
+
+  for (i = 0; i < len - 1; ++i) {
+    __atomic_store_n(&bs->bs[i], w, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&bs->bs[i], w & abs_top_word_mask(bs), __ATOMIC_RELEASE);
+}
+
+/* Returns the first bit after "position" which is set, or clear when "flip"
+ * is all ones, -1 if there is none. */
+static int abs_first(bf_atomic_bitset_t *bs, int position, uint64_t flip) {
+  ++position;
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position <= bs->width);
+  if (position < 0 || (unsigned)position >= bs->width) {
+    return -1;
+  }
+
+  size_t len = BF_BITSET_ARRAY_SIZE(bs->width);
+  size_t i = position / 64;
+  uint64_t x = ~UINT64_C(0) << (position % 64);
+
+  for (; i < len; ++i, x = ~UINT64_C(0)) {
+    x &= __atomic_load_n(&bs->bs[i], __ATOMIC_ACQUIRE) ^ flip;
+    if (i == len - 1) x &= abs_top_word_mask(bs);
+    if (x) return 64 * i + __builtin_ctzll(x);
+  }
+  return -1;
+}
+
+int bf_abs_first_set(bf_atomic_bitset_t *bs, int position) {
+  return abs_first(bs, position, 0);
+}
+
+int bf_abs_first_clr(bf_atomic_bitset_t *bs, int position) {
+  return abs_first(bs, position, ~UINT64_C(0));
+}
+
+int bf_abs_pop_count(bf_atomic_bitset_t *bs) {
+  bf_sys_assert(bs);
+  size_t len = BF_BITSET_ARRAY_SIZE(bs->width);
+  size_t i;
+  int cnt = 0;
+
+  for (i = 0; i < len; ++i) {
+    cnt += __builtin_popcountll(__atomic_load_n(&bs->bs[i], __ATOMIC_RELAXED));
+  }
   return cnt;
 }
+
+int bf_abs_claim_first_clr(bf_atomic_bitset_t *bs, int position) {
+  ++position;
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position <= bs->width);
+  if (position < 0 || (unsigned)position >= bs->width) {
+    return -1;
+  }
+
+  size_t len = BF_BITSET_ARRAY_SIZE(bs->width);
+  size_t i = position / 64;
+  uint64_t from = ~UINT64_C(0) << (position % 64);
+
+  for (; i < len; ++i, from = ~UINT64_C(0)) {
+    uint64_t valid = i == len - 1 ? from & abs_top_word_mask(bs) : from;
+    uint64_t w = __atomic_load_n(&bs->bs[i], __ATOMIC_RELAXED);
+    uint64_t x;
+
+    /* Setting a bit another thread got first changes nothing, try the
+     * next clear bit of the word as it is now. */
+    while ((x = ~w & valid)) {
+      uint64_t bit = x & -x;
+      w = __atomic_fetch_or(&bs->bs[i], bit, __ATOMIC_ACQ_REL);
+      if (!(w & bit)) return 64 * i + __builtin_ctzll(bit);
+    }
+  }
+  return -1;
+}
+
+void bf_abs_snapshot(bf_atomic_bitset_t *bs, bf_bitset_t *dst, bool clear) {
+  bf_sys_assert(bs);
+  bf_sys_assert(dst);
+  bf_sys_assert(bs->width == dst->width);
+  size_t len = BF_BITSET_ARRAY_SIZE(bs->width);
+  size_t i;
+
+  if (clear) {
+    for (i = 0; i < len; ++i) {
+      dst->bs[i] = __atomic_exchange_n(&bs->bs[i], 0, __ATOMIC_ACQ_REL);
+    }
+  } else {
+    for (i = 0; i < len; ++i) {
+      dst->bs[i] = __atomic_load_n(&bs->bs[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+#ifdef BF_BITSET_BENCH
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_WIDTH (64 * 1024)
+
+static double bench_copy_range(bf_bitset_t *dst,
+                               unsigned dst_offset,
+                               bf_bitset_t *src,
+                               unsigned src_offset,
+                               unsigned n_bits) {
+  struct timespec start, end;
+  unsigned reps = (1u << 26) / (n_bits + 64);
+  unsigned i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < reps; i++) {
+    bf_bs_copy_range(dst, dst_offset, src, src_offset, n_bits);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         reps;
+}
+
+/* Time of bf_bs_copy_range for aligned, unaligned and overlapping copies of
+ * a few lengths. */
+int bf_bs_bench_main(void) {
+  static uint64_t x_[BF_BITSET_ARRAY_SIZE(BENCH_WIDTH)];
+  static uint64_t y_[BF_BITSET_ARRAY_SIZE(BENCH_WIDTH)];
+  unsigned lengths[] = {40, 500, 60000};
+  bf_bitset_t x, y;
+  unsigned i;
+
+  bf_bs_init(&x, BENCH_WIDTH, x_);
+  bf_bs_init(&y, BENCH_WIDTH, y_);
+  for (i = 0; i < BF_BITSET_ARRAY_SIZE(BENCH_WIDTH); i++) {
+    x_[i] = i * UINT64_C(0x9E3779B97F4A7C15);
+  }
+  printf("n_bits  aligned ns  same shift ns  unaligned ns  overlap ns\n");
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    printf("%6u  %10.1f  %13.1f  %12.1f  %10.1f\n",
+           lengths[i],
+           bench_copy_range(&y, 128, &x, 64, lengths[i]),
+           bench_copy_range(&y, 131, &x, 67, lengths[i]),
+           bench_copy_range(&y, 131, &x, 5, lengths[i]),
+           bench_copy_range(&x, 137, &x, 5, lengths[i]));
+  }
+  return 0;
+}
+
+#endif
+
+#ifdef BF_BITSET_TEST
+
+#include <pthread.h>
+
+#define TEST_THREADS 4
+/* Odd so that the top word is partial */
+#define TEST_ABS_WIDTH (64 * 1563 + 37)
+
+#define TEST_MAX_WORDS 17
+/* Not a multiple of 64 */
+#define TEST_COPY_WIDTH 701
+/* Spans two words of the second summary level */
+#define TEST_HBS_WIDTH (64 * 64 * 64 + 77)
+
+static bf_atomic_bitset_t test_abs;
+static uint64_t test_abs_[BF_BITSET_ARRAY_SIZE(TEST_ABS_WIDTH)];
+static uint32_t test_claims[TEST_ABS_WIDTH];
+static bool test_stop;
+static unsigned long test_sets[TEST_THREADS];
+
+static uint64_t test_rand64(unsigned int *seed) {
+  return (uint64_t)rand_r(seed) << 42 ^ (uint64_t)rand_r(seed) << 21 ^
+         (uint64_t)rand_r(seed);
+}
+
+/* Each kernel the CPU supports gives the result of the scalar one, for 1 to
+ * TEST_MAX_WORDS words at any alignment, without writing past n words. */
+static void test_kernels(void) {
+  uint64_t x[TEST_MAX_WORDS + 1], y[TEST_MAX_WORDS + 1];
+  uint64_t want[TEST_MAX_WORDS + 2], got[TEST_MAX_WORDS + 2];
+  bf_bs_op_fn ops[4];
+  bf_bs_count_fn counts[3];
+  unsigned int n_ops = 0, n_counts = 0;
+  unsigned int seed = 1;
+  unsigned int k, op, off, rep;
+  size_t i, n;
+
+  ops[n_ops++] = bs_op_scalar;
+  counts[n_counts++] = bs_count_scalar;
+#ifdef BF_BS_X86
+  ops[n_ops++] = bs_op_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    ops[n_ops++] = bs_op_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    ops[n_ops++] = bs_op_avx512;
+  }
+  if (__builtin_cpu_supports("popcnt")) {
+    counts[n_counts++] = bs_count_popcnt;
+  }
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512vpopcntdq")) {
+    counts[n_counts++] = bs_count_avx512;
+  }
+#endif
+
+  for (rep = 0; rep < 20; rep++) {
+    for (n = 1; n <= TEST_MAX_WORDS; n++) {
+      for (i = 0; i <= TEST_MAX_WORDS; i++) {
+        x[i] = test_rand64(&seed);
+        y[i] = rep % 4 ? test_rand64(&seed) : ~x[i];
+      }
+      for (off = 0; off < 2; off++) {
+        for (op = BF_BS_OP_AND; op <= BF_BS_OP_ANDNOT; op++) {
+          memset(want, 0xa5, sizeof(want));
+          bs_op_scalar(want + off, x + off, y + off, n, op);
+          for (k = 1; k < n_ops; k++) {
+            memset(got, 0xa5, sizeof(got));
+            ops[k](got + off, x + off, y + off, n, op);
+            bf_sys_assert(!memcmp(got, want, sizeof(want)));
+            /* In place, as bf_bs_or(x, x, y) does */
+            memcpy(got, x, sizeof(x));
+            ops[k](got + off, got + off, y + off, n, op);
+            bf_sys_assert(!memcmp(got + off, want + off, n * sizeof(*got)));
+          }
+        }
+        for (k = 1; k < n_counts; k++) {
+          bf_sys_assert(counts[k](x + off, NULL, n) ==
+                        bs_count_scalar(x + off, NULL, n));
+          bf_sys_assert(counts[k](x + off, y + off, n) ==
+                        bs_count_scalar(x + off, y + off, n));
+        }
+      }
+    }
+  }
+}
+
+/* Copies n_bits from src to dst bit by bit into want, then with
+ * bf_bs_copy_range, which must give the same words. */
+static void test_copy_one(bf_bitset_t *dst,
+                          unsigned int dst_offset,
+                          bf_bitset_t *src,
+                          unsigned int src_offset,
+                          unsigned int n_bits) {
+  static uint64_t want_[BF_BITSET_ARRAY_SIZE(TEST_COPY_WIDTH)];
+  static bool bits[TEST_COPY_WIDTH];
+  bf_bitset_t want;
+  unsigned int i;
+
+  bf_bs_init(&want, TEST_COPY_WIDTH, want_);
+  bf_bs_copy(&want, dst);
+  for (i = 0; i < n_bits; i++) {
+    bits[i] = bf_bs_get(src, src_offset + i);
+  }
+  for (i = 0; i < n_bits; i++) {
+    bf_bs_set(&want, dst_offset + i, bits[i]);
+  }
+  bf_bs_copy_range(dst, dst_offset, src, src_offset, n_bits);
+  bf_sys_assert(!memcmp(dst->bs, want_, sizeof(want_)));
+}
+
+/* bf_bs_copy_range between two sets and within one, dst above and below
+ * src, for lengths from none to several words at any offsets. */
+static void test_copy_range(void) {
+  static const unsigned int lengths[] = {0, 1, 37, 63, 64, 65, 200, 500};
+  static const unsigned int offsets[][2] = {
+      {0, 0}, {0, 64}, {128, 64}, {5, 131}, {67, 131}, {3, 200}, {10, 11}};
+  static uint64_t x_[BF_BITSET_ARRAY_SIZE(TEST_COPY_WIDTH)];
+  static uint64_t y_[BF_BITSET_ARRAY_SIZE(TEST_COPY_WIDTH)];
+  unsigned int seed = 2;
+  unsigned int i, k, d, n, src, dst;
+  bf_bitset_t x, y;
+
+  bf_bs_init(&x, TEST_COPY_WIDTH, x_);
+  bf_bs_init(&y, TEST_COPY_WIDTH, y_);
+  for (i = 0; i < 2000; i++) {
+    for (k = 0; k < BF_BITSET_ARRAY_SIZE(TEST_COPY_WIDTH); k++) {
+      x_[k] = test_rand64(&seed);
+      y_[k] = test_rand64(&seed);
+    }
+    x_[k - 1] &= top_word_mask(&x);
+    y_[k - 1] &= top_word_mask(&y);
+    if (i < sizeof(lengths) / sizeof(lengths[0]) *
+                sizeof(offsets) / sizeof(offsets[0])) {
+      n = lengths[i % (sizeof(lengths) / sizeof(lengths[0]))];
+      k = i / (sizeof(lengths) / sizeof(lengths[0]));
+      src = offsets[k][0];
+      dst = offsets[k][1];
+    } else {
+      n = rand_r(&seed) % (TEST_COPY_WIDTH + 1);
+      src = rand_r(&seed) % (TEST_COPY_WIDTH - n + 1);
+      dst = rand_r(&seed) % (TEST_COPY_WIDTH - n + 1);
+    }
+    /* Both ways between two sets, and within one */
+    for (d = 0; d < 2; d++) {
+      test_copy_one(&y, d ? src : dst, &x, d ? dst : src, n);
+      test_copy_one(&x, d ? src : dst, &x, d ? dst : src, n);
+    }
+  }
+}
+
+/* Searches through the summaries find what a scan of the words finds */
+static void test_hbs_search(bf_hbitset_t *hbs, int position) {
+  bf_sys_assert(bf_hbs_first_set(hbs, position) ==
+                bf_bs_first_set(&hbs->bs, position));
+  bf_sys_assert(bf_hbs_first_clr(hbs, position) ==
+                bf_bs_first_clr(&hbs->bs, position));
+}
+
+/* After random ranges set and cleared the summaries match the words, for
+ * widths with a partial top word at each level. */
+static void test_hbs(void) {
+  static const int widths[] = {1, 63, 64, 65, 64 * 64 + 1, TEST_HBS_WIDTH};
+  static uint64_t mem[BF_HBITSET_ARRAY_SIZE(TEST_HBS_WIDTH)];
+  static uint64_t synced[BF_HBITSET_ARRAY_SIZE(TEST_HBS_WIDTH)];
+  unsigned int seed = 3;
+  bf_hbitset_t hbs, check;
+  unsigned int k, i;
+  int width, p, n;
+
+  for (k = 0; k < sizeof(widths) / sizeof(widths[0]); k++) {
+    width = widths[k];
+    memset(mem, 0, sizeof(mem));
+    bf_hbs_init(&hbs, width, mem);
+    for (i = 0; i < 300; i++) {
+      p = rand_r(&seed) % width;
+      n = rand_r(&seed) % (width - p + 1);
+      if (i % 3) {
+        n %= 200;
+      }
+      if (i % 50 == 49) {
+        bf_hbs_set_all(&hbs, i % 100 == 49);
+      } else if (rand_r(&seed) % 2) {
+        bf_hbs_set_range(&hbs, p, n);
+      } else {
+        bf_hbs_clr_range(&hbs, p, n);
+      }
+      test_hbs_search(&hbs, -1);
+      test_hbs_search(&hbs, p - 1);
+      test_hbs_search(&hbs, p + n - 1);
+      test_hbs_search(&hbs, rand_r(&seed) % width);
+      test_hbs_search(&hbs, width - 1);
+      test_hbs_search(&hbs, width > 65 ? width - 65 : 0);
+    }
+    /* Summaries built from scratch by init are the ones kept up to date */
+    memcpy(synced, mem, sizeof(synced));
+    bf_hbs_init(&check, width, synced);
+    bf_sys_assert(!memcmp(synced,
+                          mem,
+                          BF_HBITSET_ARRAY_SIZE(width) * sizeof(uint64_t)));
+  }
+}
+
+/* Claims bits after the last one claimed, from the start once none are
+ * left above it, until none are left at all. */
+static void *test_claimer(void *arg) {
+  int p = (int)(uintptr_t)arg * (TEST_ABS_WIDTH / TEST_THREADS);
+
+  while ((p = bf_abs_claim_first_clr(&test_abs, p)) >= 0 ||
+         (p = bf_abs_claim_first_clr(&test_abs, -1)) >= 0) {
+    bf_sys_assert(p < TEST_ABS_WIDTH);
+    __atomic_fetch_add(&test_claims[p], 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* Sets random bits, counting the ones it found clear */
+static void *test_setter(void *arg) {
+  uintptr_t t = (uintptr_t)arg;
+  unsigned int seed = t + 1;
+
+  while (!__atomic_load_n(&test_stop, __ATOMIC_RELAXED)) {
+    if (!bf_abs_test_and_set(&test_abs, rand_r(&seed) % TEST_ABS_WIDTH)) {
+      test_sets[t]++;
+    }
+  }
+  return NULL;
+}
+
+/* Threads claiming the bits get each exactly once, a bit set while the set
+ * is drained by snapshots is seen by exactly one of them. */
+static void test_abs_threads(void) {
+  static uint64_t snap_[BF_BITSET_ARRAY_SIZE(TEST_ABS_WIDTH)];
+  pthread_t threads[TEST_THREADS];
+  unsigned long sets = 0, drained = 0;
+  bf_bitset_t snap;
+  uintptr_t t;
+  int i;
+
+  bf_abs_init(&test_abs, TEST_ABS_WIDTH, test_abs_);
+  bf_bs_init(&snap, TEST_ABS_WIDTH, snap_);
+  for (t = 0; t < TEST_THREADS; t++) {
+    bf_sys_assert(!pthread_create(&threads[t], NULL, test_claimer, (void *)t));
+  }
+  for (t = 0; t < TEST_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  for (i = 0; i < TEST_ABS_WIDTH; i++) {
+    bf_sys_assert(test_claims[i] == 1);
+  }
+  bf_sys_assert(bf_abs_pop_count(&test_abs) == TEST_ABS_WIDTH);
+  bf_sys_assert(bf_abs_claim_first_clr(&test_abs, -1) == -1);
+  bf_abs_set(&test_abs, TEST_ABS_WIDTH - 1, 0);
+  bf_abs_set(&test_abs, 5, 0);
+  bf_sys_assert(bf_abs_claim_first_clr(&test_abs, 5) == TEST_ABS_WIDTH - 1);
+  bf_sys_assert(bf_abs_claim_first_clr(&test_abs, -1) == 5);
+  bf_sys_assert(bf_abs_claim_first_clr(&test_abs, -1) == -1);
+
+  bf_abs_set_all(&test_abs, 0);
+  for (t = 0; t < TEST_THREADS; t++) {
+    bf_sys_assert(!pthread_create(&threads[t], NULL, test_setter, (void *)t));
+  }
+  for (i = 0; i < 200; i++) {
+    bf_abs_snapshot(&test_abs, &snap, true);
+    drained += bf_bs_pop_count(&snap);
+  }
+  __atomic_store_n(&test_stop, true, __ATOMIC_RELAXED);
+  for (t = 0; t < TEST_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    sets += test_sets[t];
+  }
+  bf_abs_snapshot(&test_abs, &snap, false);
+  bf_sys_assert(bf_bs_pop_count(&snap) == bf_abs_pop_count(&test_abs));
+  bf_abs_snapshot(&test_abs, &snap, true);
+  drained += bf_bs_pop_count(&snap);
+  bf_sys_assert(sets == drained);
+  bf_sys_assert(bf_abs_pop_count(&test_abs) == 0);
+}
+
+int bf_bs_test_main(void) {
+  test_kernels();
+  test_copy_range();
+  test_hbs();
+  test_abs_threads();
+  return 0;
+}
+
+#endif
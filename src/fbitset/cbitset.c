@@ -0,0 +1,1199 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include <target-utils/fbitset/cbitset.h>
+#include <target-utils/bitset/bitset.h>
+#include <Judy.h>
+#include <target-sys/bf_sal/bf_sys_intf.h>
+
+#define CBS_CHUNK_SHIFT 16
+#define CBS_CHUNK_BITS (1u << CBS_CHUNK_SHIFT)
+#define CBS_CHUNK_MASK (CBS_CHUNK_BITS - 1)
+#define CBS_CHUNK_WORDS (CBS_CHUNK_BITS / 64)
+#define CBS_BITMAP_BYTES (CBS_CHUNK_WORDS * sizeof(uint64_t))
+/* An array with more entries becomes a bitmap, a bitmap with fewer bits set
+ * than half of that becomes an array again so that a chunk around the limit
+ * is not converted back and forth. */
+#define CBS_ARRAY_MAX 4096
+#define CBS_BITMAP_MIN (CBS_ARRAY_MAX / 2)
+/* A run list longer than this is as large as the bitmap */
+#define CBS_RUN_MAX (CBS_BITMAP_BYTES / sizeof(cbs_run_t))
+
+typedef enum cbs_type_e { CBS_ARRAY, CBS_BITMAP, CBS_RUN } cbs_type_t;
+
+/* Bits start to last, both included, are set */
+typedef struct cbs_run_s {
+  uint16_t start;
+  uint16_t last;
+} cbs_run_t;
+
+typedef struct cbs_container_s {
+  cbs_type_t type;
+  uint32_t card;  // Number of bits set
+  uint32_t n;     // Number of array entries or runs
+  uint32_t cap;   // Number of array entries or runs allocated
+  union {
+    uint16_t *array;
+    uint64_t *bitmap;
+    cbs_run_t *runs;
+  } d;
+} cbs_container_t;
+
+static size_t cbs_elem_size(cbs_type_t type) {
+  return type == CBS_ARRAY ? sizeof(uint16_t) : sizeof(cbs_run_t);
+}
+
+static cbs_container_t *cbs_new(cbs_type_t type, uint32_t cap) {
+  cbs_container_t *c = bf_sys_calloc(1, sizeof(cbs_container_t));
+  if (!c) return NULL;
+  c->type = type;
+  if (type == CBS_BITMAP) {
+    c->d.bitmap = bf_sys_calloc(CBS_CHUNK_WORDS, sizeof(uint64_t));
+  } else {
+    c->cap = cap;
+    c->d.array = bf_sys_malloc(cap * cbs_elem_size(type));
+  }
+  if (!c->d.array) {
+    bf_sys_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static void cbs_free(cbs_container_t *c) {
+  bf_sys_free(c->d.array);
+  bf_sys_free(c);
+}
+
+/* Replaces the contents of "c" with those of "src", freeing "src" */
+static void cbs_replace(cbs_container_t *c, cbs_container_t *src) {
+  bf_sys_free(c->d.array);
+  *c = *src;
+  bf_sys_free(src);
+}
+
+static cbs_container_t *cbs_clone(cbs_container_t *c) {
+  cbs_container_t *copy = cbs_new(c->type, c->n ? c->n : 1);
+  if (!copy) return NULL;
+  if (c->type == CBS_BITMAP) {
+    memcpy(copy->d.bitmap, c->d.bitmap, CBS_BITMAP_BYTES);
+  } else {
+    memcpy(copy->d.array, c->d.array, c->n * cbs_elem_size(c->type));
+  }
+  copy->card = c->card;
+  copy->n = c->n;
+  return copy;
+}
+
+/* Makes room for "need" array entries or runs */
+static bool cbs_reserve(cbs_container_t *c, uint32_t need) {
+  if (need <= c->cap) return true;
+  uint32_t cap = c->cap * 2 > need ? c->cap * 2 : need;
+  void *mem = bf_sys_malloc(cap * cbs_elem_size(c->type));
+  if (!mem) return false;
+  memcpy(mem, c->d.array, c->n * cbs_elem_size(c->type));
+  bf_sys_free(c->d.array);
+  c->d.array = mem;
+  c->cap = cap;
+  return true;
+}
+
+static inline void cbs_bitset(cbs_container_t *c, bf_bitset_t *b) {
+  bf_bs_init(b, CBS_CHUNK_BITS, c->d.bitmap);
+}
+
+/* Index of the first array entry not below x */
+static uint32_t cbs_array_lb(cbs_container_t *c, uint32_t x) {
+  uint32_t lo = 0, hi = c->n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (c->d.array[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Index of the first run not ending below x */
+static uint32_t cbs_run_lb(cbs_container_t *c, uint32_t x) {
+  uint32_t lo = 0, hi = c->n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (c->d.runs[mid].last < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static uint32_t cbs_count_runs(cbs_container_t *c) {
+  uint32_t runs = 0, i;
+  uint64_t carry = 0;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      for (i = 0; i < c->n; ++i) {
+        runs += !i || c->d.array[i] != c->d.array[i - 1] + 1;
+      }
+      return runs;
+    case CBS_BITMAP:
+      /* A run starts at every bit set whose lower neighbour is clear */
+      for (i = 0; i < CBS_CHUNK_WORDS; ++i) {
+        uint64_t w = c->d.bitmap[i];
+        runs += __builtin_popcountll(w & ~((w << 1) | carry));
+        carry = w >> 63;
+      }
+      return runs;
+    case CBS_RUN:
+      return c->n;
+  }
+  return 0;
+}
+
+/* Conversions between containers. On an allocation failure the container
+ * is left as it was and false is returned. */
+
+static bool cbs_to_bitmap(cbs_container_t *c) {
+  cbs_container_t *b;
+  bf_bitset_t bs;
+  uint32_t i;
+
+  if (c->type == CBS_BITMAP) return true;
+  b = cbs_new(CBS_BITMAP, 0);
+  if (!b) return false;
+  cbs_bitset(b, &bs);
+  if (c->type == CBS_ARRAY) {
+    for (i = 0; i < c->n; ++i) {
+      b->d.bitmap[c->d.array[i] / 64] |= UINT64_C(1) << (c->d.array[i] % 64);
+    }
+  } else {
+    for (i = 0; i < c->n; ++i) {
+      cbs_run_t r = c->d.runs[i];
+      bf_bs_set_range(&bs, r.start, r.last - r.start + 1);
+    }
+  }
+  b->card = c->card;
+  cbs_replace(c, b);
+  return true;
+}
+
+static bool cbs_to_array(cbs_container_t *c) {
+  cbs_container_t *a;
+  uint32_t i, x;
+
+  if (c->type == CBS_ARRAY) return true;
+  a = cbs_new(CBS_ARRAY, c->card ? c->card : 1);
+  if (!a) return false;
+  if (c->type == CBS_BITMAP) {
+    for (i = 0; i < CBS_CHUNK_WORDS; ++i) {
+      uint64_t w = c->d.bitmap[i];
+      while (w) {
+        a->d.array[a->n++] = 64 * i + __builtin_ctzll(w);
+        w &= w - 1;
+      }
+    }
+  } else {
+    for (i = 0; i < c->n; ++i) {
+      for (x = c->d.runs[i].start; x <= c->d.runs[i].last; ++x) {
+        a->d.array[a->n++] = x;
+      }
+    }
+  }
+  a->card = c->card;
+  cbs_replace(c, a);
+  return true;
+}
+
+static bool cbs_to_run(cbs_container_t *c) {
+  cbs_container_t *r;
+  uint32_t runs, i;
+
+  if (c->type == CBS_RUN) return true;
+  runs = cbs_count_runs(c);
+  r = cbs_new(CBS_RUN, runs ? runs : 1);
+  if (!r) return false;
+  if (c->type == CBS_ARRAY) {
+    for (i = 0; i < c->n; ++i) {
+      uint16_t x = c->d.array[i];
+      if (r->n && r->d.runs[r->n - 1].last + 1 == x) {
+        r->d.runs[r->n - 1].last = x;
+      } else {
+        r->d.runs[r->n].start = x;
+        r->d.runs[r->n++].last = x;
+      }
+    }
+  } else {
+    bf_bitset_t bs;
+    int start = -1, last;
+    cbs_bitset(c, &bs);
+    while ((start = bf_bs_first_set(&bs, start)) >= 0) {
+      last = bf_bs_first_clr(&bs, start);
+      last = last < 0 ? (int)CBS_CHUNK_MASK : last - 1;
+      r->d.runs[r->n].start = start;
+      r->d.runs[r->n++].last = last;
+      start = last;
+    }
+  }
+  r->card = c->card;
+  cbs_replace(c, r);
+  return true;
+}
+
+/* Sets bit x, returns its previous value or -1 if memory ran out */
+static int cbs_c_set(cbs_container_t *c, uint32_t x) {
+  uint32_t i;
+
+  if (c->type == CBS_ARRAY) {
+    i = cbs_array_lb(c, x);
+    if (i < c->n && c->d.array[i] == x) return 1;
+    if (c->n == CBS_ARRAY_MAX) {
+      if (!cbs_to_bitmap(c)) return -1;
+    } else {
+      if (!cbs_reserve(c, c->n + 1)) return -1;
+      memmove(c->d.array + i + 1,
+              c->d.array + i,
+              (c->n - i) * sizeof(uint16_t));
+      c->d.array[i] = x;
+      c->n++;
+      c->card++;
+      return 0;
+    }
+  }
+  if (c->type == CBS_RUN) {
+    i = cbs_run_lb(c, x);
+    if (i < c->n && c->d.runs[i].start <= x) return 1;
+    bool join_lo = i > 0 && c->d.runs[i - 1].last + 1u == x;
+    bool join_hi = i < c->n && c->d.runs[i].start == x + 1;
+    if (join_lo && join_hi) {
+      c->d.runs[i - 1].last = c->d.runs[i].last;
+      memmove(c->d.runs + i,
+              c->d.runs + i + 1,
+              (c->n - i - 1) * sizeof(cbs_run_t));
+      c->n--;
+    } else if (join_lo) {
+      c->d.runs[i - 1].last = x;
+    } else if (join_hi) {
+      c->d.runs[i].start = x;
+    } else if (c->n >= CBS_RUN_MAX) {
+      if (!cbs_to_bitmap(c)) return -1;
+      return cbs_c_set(c, x);
+    } else {
+      if (!cbs_reserve(c, c->n + 1)) return -1;
+      memmove(c->d.runs + i + 1,
+              c->d.runs + i,
+              (c->n - i) * sizeof(cbs_run_t));
+      c->d.runs[i].start = x;
+      c->d.runs[i].last = x;
+      c->n++;
+    }
+    c->card++;
+    return 0;
+  }
+  uint64_t bit = UINT64_C(1) << (x % 64);
+  if (c->d.bitmap[x / 64] & bit) return 1;
+  c->d.bitmap[x / 64] |= bit;
+  c->card++;
+  return 0;
+}
+
+/* Clears bit x, returns its previous value or -1 if memory ran out */
+static int cbs_c_clr(cbs_container_t *c, uint32_t x) {
+  uint32_t i;
+
+  if (c->type == CBS_ARRAY) {
+    i = cbs_array_lb(c, x);
+    if (i == c->n || c->d.array[i] != x) return 0;
+    memmove(c->d.array + i,
+            c->d.array + i + 1,
+            (c->n - i - 1) * sizeof(uint16_t));
+    c->n--;
+    c->card--;
+    return 1;
+  }
+  if (c->type == CBS_RUN) {
+    i = cbs_run_lb(c, x);
+    if (i == c->n || c->d.runs[i].start > x) return 0;
+    cbs_run_t r = c->d.runs[i];
+    if (r.start == r.last) {
+      memmove(c->d.runs + i,
+              c->d.runs + i + 1,
+              (c->n - i - 1) * sizeof(cbs_run_t));
+      c->n--;
+    } else if (x == r.start) {
+      c->d.runs[i].start++;
+    } else if (x == r.last) {
+      c->d.runs[i].last--;
+    } else if (c->n >= CBS_RUN_MAX) {
+      if (!cbs_to_bitmap(c)) return -1;
+      return cbs_c_clr(c, x);
+    } else {
+      /* Split the run around x */
+      if (!cbs_reserve(c, c->n + 1)) return -1;
+      memmove(c->d.runs + i + 2,
+              c->d.runs + i + 1,
+              (c->n - i - 1) * sizeof(cbs_run_t));
+      c->d.runs[i].last = x - 1;
+      c->d.runs[i + 1].start = x + 1;
+      c->d.runs[i + 1].last = r.last;
+      c->n++;
+    }
+    c->card--;
+    return 1;
+  }
+  uint64_t bit = UINT64_C(1) << (x % 64);
+  if (!(c->d.bitmap[x / 64] & bit)) return 0;
+  c->d.bitmap[x / 64] &= ~bit;
+  c->card--;
+  if (c->card < CBS_BITMAP_MIN) {
+    /* Staying a bitmap is fine if memory is short */
+    cbs_to_array(c);
+  }
+  return 1;
+}
+
+static bool cbs_c_get(cbs_container_t *c, uint32_t x) {
+  uint32_t i;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      i = cbs_array_lb(c, x);
+      return i < c->n && c->d.array[i] == x;
+    case CBS_BITMAP:
+      return (c->d.bitmap[x / 64] >> (x % 64)) & 1;
+    case CBS_RUN:
+      i = cbs_run_lb(c, x);
+      return i < c->n && c->d.runs[i].start <= x;
+  }
+  return false;
+}
+
+/* First bit set at or after x, -1 if none */
+static int cbs_c_next_set(cbs_container_t *c, uint32_t x) {
+  bf_bitset_t bs;
+  uint32_t i;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      i = cbs_array_lb(c, x);
+      return i < c->n ? c->d.array[i] : -1;
+    case CBS_BITMAP:
+      cbs_bitset(c, &bs);
+      return bf_bs_first_set(&bs, (int)x - 1);
+    case CBS_RUN:
+      i = cbs_run_lb(c, x);
+      if (i == c->n) return -1;
+      return c->d.runs[i].start > x ? c->d.runs[i].start : x;
+  }
+  return -1;
+}
+
+/* First bit clear at or after x, CBS_CHUNK_BITS if none */
+static uint32_t cbs_c_next_clr(cbs_container_t *c, uint32_t x) {
+  bf_bitset_t bs;
+  uint32_t i;
+  int r;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      for (i = cbs_array_lb(c, x); i < c->n && c->d.array[i] == x; ++i) {
+        x++;
+      }
+      return x;
+    case CBS_BITMAP:
+      cbs_bitset(c, &bs);
+      r = bf_bs_first_clr(&bs, (int)x - 1);
+      return r < 0 ? CBS_CHUNK_BITS : (uint32_t)r;
+    case CBS_RUN:
+      i = cbs_run_lb(c, x);
+      if (i < c->n && c->d.runs[i].start <= x) return c->d.runs[i].last + 1u;
+      return x;
+  }
+  return x;
+}
+
+/* Last bit set at or before x, -1 if none */
+static int cbs_c_prev_set(cbs_container_t *c, uint32_t x) {
+  bf_bitset_t bs;
+  uint32_t i;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      i = cbs_array_lb(c, x + 1);
+      return i ? c->d.array[i - 1] : -1;
+    case CBS_BITMAP:
+      cbs_bitset(c, &bs);
+      return bf_bs_last_set(&bs, x + 1);
+    case CBS_RUN:
+      i = cbs_run_lb(c, x);
+      if (i < c->n && c->d.runs[i].start <= x) return x;
+      return i ? c->d.runs[i - 1].last : -1;
+  }
+  return -1;
+}
+
+/* Last bit clear at or before x, -1 if none */
+static int cbs_c_prev_clr(cbs_container_t *c, uint32_t x) {
+  int i, y = x;
+  uint64_t w;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      i = cbs_array_lb(c, x);
+      for (; i >= 0 && i < (int)c->n && c->d.array[i] == y; --i) {
+        y--;
+      }
+      return y;
+    case CBS_BITMAP:
+      i = x / 64;
+      w = ~c->d.bitmap[i] & (~UINT64_C(0) >> (63 - x % 64));
+      while (!w) {
+        if (--i < 0) return -1;
+        w = ~c->d.bitmap[i];
+      }
+      return 64 * i + 63 - __builtin_clzll(w);
+    case CBS_RUN:
+      i = cbs_run_lb(c, x);
+      if (i < (int)c->n && c->d.runs[i].start <= x) {
+        return (int)c->d.runs[i].start - 1;
+      }
+      return x;
+  }
+  return x;
+}
+
+/* Writes up to max positions of bits set from x on, returns the count */
+static int cbs_c_get_set_bits(
+    cbs_container_t *c, uint32_t x, uint32_t base, int *out, int max) {
+  int cnt = 0;
+  uint32_t i, y;
+
+  switch (c->type) {
+    case CBS_ARRAY:
+      for (i = cbs_array_lb(c, x); i < c->n && cnt < max; ++i) {
+        out[cnt++] = base + c->d.array[i];
+      }
+      break;
+    case CBS_BITMAP:
+      for (i = x / 64; i < CBS_CHUNK_WORDS && cnt < max; ++i) {
+        uint64_t w = c->d.bitmap[i];
+        if (i == x / 64) w &= ~UINT64_C(0) << (x % 64);
+        while (w && cnt < max) {
+          out[cnt++] = base + 64 * i + __builtin_ctzll(w);
+          w &= w - 1;
+        }
+      }
+      break;
+    case CBS_RUN:
+      for (i = cbs_run_lb(c, x); i < c->n && cnt < max; ++i) {
+        y = c->d.runs[i].start > x ? c->d.runs[i].start : x;
+        for (; y <= c->d.runs[i].last && cnt < max; ++y) {
+          out[cnt++] = base + y;
+        }
+      }
+      break;
+  }
+  return cnt;
+}
+
+void bf_cbs_init(bf_cbitset_t *bs, unsigned int width) {
+  bf_sys_assert(bs);
+  bf_sys_assert(width > 0);
+  bs->width = width;
+  bs->chunks = NULL;
+}
+
+static cbs_container_t *cbs_chunk(bf_cbitset_t *bs, Word_t key) {
+  PWord_t Pvalue;
+  JLG(Pvalue, bs->chunks, key);
+  return Pvalue ? (cbs_container_t *)*Pvalue : NULL;
+}
+
+static void cbs_chunk_del(bf_cbitset_t *bs, Word_t key) {
+  PWord_t Pvalue;
+  int Rc_int;
+  JLG(Pvalue, bs->chunks, key);
+  if (!Pvalue) return;
+  cbs_free((cbs_container_t *)*Pvalue);
+  JLD(Rc_int, bs->chunks, key);
+  (void)Rc_int;
+}
+
+bool bf_cbs_set(bf_cbitset_t *bs, int position, int val) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position < bs->width);
+  bf_sys_assert((val == 1) || (val == 0));
+
+  Word_t key = (unsigned)position >> CBS_CHUNK_SHIFT;
+  uint32_t x = position & CBS_CHUNK_MASK;
+  cbs_container_t *c;
+  PWord_t Pvalue;
+  int rc;
+
+  if (!val) {
+    c = cbs_chunk(bs, key);
+    if (!c) return false;
+    rc = cbs_c_clr(c, x);
+    if (!c->card) cbs_chunk_del(bs, key);
+    bf_sys_dbgchk(rc >= 0);
+    return rc == 1;
+  }
+
+  JLI(Pvalue, bs->chunks, key);
+  if (PJERR == Pvalue) {
+    bf_sys_dbgchk(PJERR != Pvalue);
+    return false;
+  }
+  c = (cbs_container_t *)*Pvalue;
+  if (!c) {
+    c = cbs_new(CBS_ARRAY, 4);
+    if (!c) {
+      JLD(rc, bs->chunks, key);
+      bf_sys_dbgchk(c);
+      return false;
+    }
+    *Pvalue = (Word_t)c;
+  }
+  rc = cbs_c_set(c, x);
+  bf_sys_dbgchk(rc >= 0);
+  return rc == 1;
+}
+
+bool bf_cbs_get(bf_cbitset_t *bs, int position) {
+  bf_sys_assert(bs);
+  bf_sys_assert(position >= 0);
+  bf_sys_assert((unsigned)position < bs->width);
+
+  cbs_container_t *c = cbs_chunk(bs, (unsigned)position >> CBS_CHUNK_SHIFT);
+  return c && cbs_c_get(c, position & CBS_CHUNK_MASK);
+}
+
+/* First bit set at or after pos, -1 if none */
+static int64_t cbs_next_set(bf_cbitset_t *bs, uint32_t pos) {
+  Word_t key = pos >> CBS_CHUNK_SHIFT;
+  Word_t start = key;
+  PWord_t Pvalue;
+  int x;
+
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    x = cbs_c_next_set((cbs_container_t *)*Pvalue,
+                       key == start ? pos & CBS_CHUNK_MASK : 0);
+    if (x >= 0) return ((int64_t)key << CBS_CHUNK_SHIFT) + x;
+    JLN(Pvalue, bs->chunks, key);
+  }
+  return -1;
+}
+
+/* First bit clear at or after pos, may be width or above if none */
+static int64_t cbs_next_clr(bf_cbitset_t *bs, uint32_t pos) {
+  int64_t p = pos;
+  uint32_t x;
+
+  while (p < bs->width) {
+    Word_t key = p >> CBS_CHUNK_SHIFT;
+    cbs_container_t *c = cbs_chunk(bs, key);
+    if (!c) return p;
+    x = cbs_c_next_clr(c, p & CBS_CHUNK_MASK);
+    if (x < CBS_CHUNK_BITS) return ((int64_t)key << CBS_CHUNK_SHIFT) + x;
+    p = (int64_t)(key + 1) << CBS_CHUNK_SHIFT;
+  }
+  return p;
+}
+
+/* Last bit set at or before pos, -1 if none */
+static int64_t cbs_prev_set(bf_cbitset_t *bs, uint32_t pos) {
+  Word_t key = pos >> CBS_CHUNK_SHIFT;
+  Word_t start = key;
+  PWord_t Pvalue;
+  int x;
+
+  JLL(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    x = cbs_c_prev_set((cbs_container_t *)*Pvalue,
+                       key == start ? pos & CBS_CHUNK_MASK : CBS_CHUNK_MASK);
+    if (x >= 0) return ((int64_t)key << CBS_CHUNK_SHIFT) + x;
+    JLP(Pvalue, bs->chunks, key);
+  }
+  return -1;
+}
+
+/* Last bit clear at or before pos, -1 if none */
+static int64_t cbs_prev_clr(bf_cbitset_t *bs, uint32_t pos) {
+  int64_t p = pos;
+  int x;
+
+  while (p >= 0) {
+    Word_t key = p >> CBS_CHUNK_SHIFT;
+    cbs_container_t *c = cbs_chunk(bs, key);
+    if (!c) return p;
+    x = cbs_c_prev_clr(c, p & CBS_CHUNK_MASK);
+    if (x >= 0) return ((int64_t)key << CBS_CHUNK_SHIFT) + x;
+    p = ((int64_t)key << CBS_CHUNK_SHIFT) - 1;
+  }
+  return -1;
+}
+
+/* Position is exclusive */
+int bf_cbs_prev_clr_contiguous(bf_cbitset_t *bs,
+                               int position,
+                               unsigned int count) {
+  if (position <= 0) {
+    return -1;
+  }
+  position--;
+  bf_sys_assert(bs);
+  bf_sys_assert((unsigned)position < bs->width);
+  bf_sys_assert(count);
+
+  if (((unsigned)(position + 1) < count) || ((unsigned)position >= bs->width)) {
+    return -1;
+  }
+
+  /* The clear bits above the previous bit set form a run, try each run
+   * going down. */
+  int64_t pos = position;
+  while (pos >= (int64_t)count - 1) {
+    int64_t free_index = cbs_prev_clr(bs, pos);
+    if (free_index < (int64_t)count - 1) return -1;
+    int64_t set = cbs_prev_set(bs, free_index);
+    if (free_index - set >= count) return free_index + 1 - count;
+    pos = set - 1;
+  }
+  return -1;
+}
+
+/* Position is exclusive */
+int bf_cbs_first_clr_contiguous(bf_cbitset_t *bs,
+                                int position,
+                                unsigned int count) {
+  position++;
+  bf_sys_assert(bs);
+  bf_sys_assert(count);
+  if (position < 0 || ((unsigned)(position + count) > bs->width)) {
+    return -1;
+  }
+
+  /* The clear bits below the next bit set form a run, try each run going
+   * up. */
+  int64_t pos = position;
+  while (pos + count <= bs->width) {
+    int64_t free_index = cbs_next_clr(bs, pos);
+    if (free_index + count > bs->width) return -1;
+    int64_t set = cbs_next_set(bs, free_index);
+    if (set < 0 || set >= free_index + count) return free_index;
+    pos = set + 1;
+  }
+  return -1;
+}
+
+/* Position is exclusive */
+int bf_cbs_first_set(bf_cbitset_t *bs, int position) {
+  position++;
+  bf_sys_assert(bs);
+  if (position < 0 || ((unsigned)position >= bs->width)) {
+    return -1;
+  }
+  return cbs_next_set(bs, position);
+}
+
+/* Position is exclusive */
+int bf_cbs_get_set_bits(bf_cbitset_t *bs, int position, int *out, int max) {
+  position++;
+  bf_sys_assert(bs);
+  bf_sys_assert(out);
+  if (position < 0 || ((unsigned)position >= bs->width)) {
+    return 0;
+  }
+
+  Word_t key = (unsigned)position >> CBS_CHUNK_SHIFT;
+  Word_t start = key;
+  PWord_t Pvalue;
+  int cnt = 0;
+
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue && cnt < max) {
+    cnt += cbs_c_get_set_bits((cbs_container_t *)*Pvalue,
+                              key == start ? position & CBS_CHUNK_MASK : 0,
+                              key << CBS_CHUNK_SHIFT,
+                              out + cnt,
+                              max - cnt);
+    JLN(Pvalue, bs->chunks, key);
+  }
+  return cnt;
+}
+
+unsigned int bf_cbs_pop_count(bf_cbitset_t *bs) {
+  bf_sys_assert(bs);
+  Word_t key = 0;
+  PWord_t Pvalue;
+  unsigned int cnt = 0;
+
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    cnt += ((cbs_container_t *)*Pvalue)->card;
+    JLN(Pvalue, bs->chunks, key);
+  }
+  return cnt;
+}
+
+/* Bitmaps end up as small as their population allows */
+static void cbs_bitmap_done(cbs_container_t *c) {
+  bf_bitset_t bs;
+  cbs_bitset(c, &bs);
+  c->card = bf_bs_pop_count(&bs);
+  if (c->card < CBS_BITMAP_MIN) cbs_to_array(c);
+}
+
+/* Merges two sorted run lists into a new run container */
+static cbs_container_t *cbs_run_merge(cbs_container_t *x,
+                                      cbs_container_t *y,
+                                      bool intersect) {
+  cbs_container_t *r = cbs_new(CBS_RUN, x->n + y->n ? x->n + y->n : 1);
+  uint32_t i = 0, j = 0;
+  if (!r) return NULL;
+
+  if (intersect) {
+    while (i < x->n && j < y->n) {
+      cbs_run_t a = x->d.runs[i], b = y->d.runs[j];
+      uint16_t start = a.start > b.start ? a.start : b.start;
+      uint16_t last = a.last < b.last ? a.last : b.last;
+      if (start <= last) {
+        r->d.runs[r->n].start = start;
+        r->d.runs[r->n++].last = last;
+        r->card += last - start + 1;
+      }
+      if (a.last < b.last)
+        i++;
+      else
+        j++;
+    }
+    return r;
+  }
+  while (i < x->n || j < y->n) {
+    cbs_run_t a;
+    if (j == y->n || (i < x->n && x->d.runs[i].start < y->d.runs[j].start))
+      a = x->d.runs[i++];
+    else
+      a = y->d.runs[j++];
+    if (r->n && r->d.runs[r->n - 1].last + 1u >= a.start) {
+      cbs_run_t *t = &r->d.runs[r->n - 1];
+      if (a.last > t->last) {
+        r->card += a.last - t->last;
+        t->last = a.last;
+      }
+    } else {
+      r->d.runs[r->n++] = a;
+      r->card += a.last - a.start + 1;
+    }
+  }
+  return r;
+}
+
+/* x |= y for one chunk */
+static bool cbs_c_or(cbs_container_t *x, cbs_container_t *y) {
+  bf_bitset_t bs, ys;
+  cbs_container_t *r;
+  uint32_t i, j;
+
+  if (x->type == CBS_ARRAY && y->type == CBS_ARRAY &&
+      x->n + y->n <= CBS_ARRAY_MAX) {
+    r = cbs_new(CBS_ARRAY, x->n + y->n ? x->n + y->n : 1);
+    if (!r) return false;
+    for (i = 0, j = 0; i < x->n || j < y->n;) {
+      uint16_t v;
+      if (j == y->n || (i < x->n && x->d.array[i] < y->d.array[j]))
+        v = x->d.array[i++];
+      else
+        v = y->d.array[j++];
+      if (!r->n || r->d.array[r->n - 1] != v) r->d.array[r->n++] = v;
+    }
+    r->card = r->n;
+    cbs_replace(x, r);
+    return true;
+  }
+  if (x->type == CBS_RUN && y->type == CBS_RUN) {
+    r = cbs_run_merge(x, y, false);
+    if (!r) return false;
+    cbs_replace(x, r);
+    return x->n <= CBS_RUN_MAX || cbs_to_bitmap(x);
+  }
+
+  if (!cbs_to_bitmap(x)) return false;
+  cbs_bitset(x, &bs);
+  switch (y->type) {
+    case CBS_ARRAY:
+      for (i = 0; i < y->n; ++i) {
+        x->d.bitmap[y->d.array[i] / 64] |= UINT64_C(1)
+                                           << (y->d.array[i] % 64);
+      }
+      break;
+    case CBS_BITMAP:
+      cbs_bitset(y, &ys);
+      bf_bs_or(&bs, &bs, &ys);
+      break;
+    case CBS_RUN:
+      for (i = 0; i < y->n; ++i) {
+        cbs_run_t run = y->d.runs[i];
+        bf_bs_set_range(&bs, run.start, run.last - run.start + 1);
+      }
+      break;
+  }
+  cbs_bitmap_done(x);
+  return true;
+}
+
+/* x &= y for one chunk */
+static bool cbs_c_and(cbs_container_t *x, cbs_container_t *y) {
+  bf_bitset_t bs, ys;
+  cbs_container_t *r;
+  uint32_t i, j;
+
+  if (x->type == CBS_ARRAY) {
+    for (i = 0, j = 0; i < x->n; ++i) {
+      if (cbs_c_get(y, x->d.array[i])) x->d.array[j++] = x->d.array[i];
+    }
+    x->n = x->card = j;
+    return true;
+  }
+  if (y->type == CBS_ARRAY) {
+    r = cbs_new(CBS_ARRAY, y->n ? y->n : 1);
+    if (!r) return false;
+    for (i = 0; i < y->n; ++i) {
+      if (cbs_c_get(x, y->d.array[i])) r->d.array[r->n++] = y->d.array[i];
+    }
+    r->card = r->n;
+    cbs_replace(x, r);
+    return true;
+  }
+  if (x->type == CBS_RUN && y->type == CBS_RUN) {
+    r = cbs_run_merge(x, y, true);
+    if (!r) return false;
+    cbs_replace(x, r);
+    return x->n <= CBS_RUN_MAX || cbs_to_bitmap(x);
+  }
+
+  if (!cbs_to_bitmap(x)) return false;
+  cbs_bitset(x, &bs);
+  if (y->type == CBS_BITMAP) {
+    cbs_bitset(y, &ys);
+    bf_bs_and(&bs, &bs, &ys);
+  } else {
+    /* Clear the gaps between the runs of y */
+    uint32_t from = 0;
+    for (i = 0; i < y->n; ++i) {
+      bf_bs_clr_range(&bs, from, y->d.runs[i].start - from);
+      from = y->d.runs[i].last + 1u;
+    }
+    bf_bs_clr_range(&bs, from, CBS_CHUNK_BITS - from);
+  }
+  cbs_bitmap_done(x);
+  return true;
+}
+
+bf_fbitset_sts_t bf_cbs_or(bf_cbitset_t *x, bf_cbitset_t *y) {
+  bf_sys_assert(x);
+  bf_sys_assert(y);
+  bf_sys_assert(x->width == y->width);
+  Word_t key = 0;
+  PWord_t Pvalue, Px;
+
+  JLF(Pvalue, y->chunks, key);
+  while (Pvalue) {
+    cbs_container_t *c = (cbs_container_t *)*Pvalue;
+    JLI(Px, x->chunks, key);
+    if (PJERR == Px) return BF_FBITSET_MALLOC_ERR;
+    if (*Px) {
+      if (!cbs_c_or((cbs_container_t *)*Px, c)) return BF_FBITSET_MALLOC_ERR;
+    } else {
+      *Px = (Word_t)cbs_clone(c);
+      if (!*Px) {
+        int Rc_int;
+        JLD(Rc_int, x->chunks, key);
+        (void)Rc_int;
+        return BF_FBITSET_MALLOC_ERR;
+      }
+    }
+    JLN(Pvalue, y->chunks, key);
+  }
+  return BF_FBITSET_OK;
+}
+
+bf_fbitset_sts_t bf_cbs_and(bf_cbitset_t *x, bf_cbitset_t *y) {
+  bf_sys_assert(x);
+  bf_sys_assert(y);
+  bf_sys_assert(x->width == y->width);
+  bf_fbitset_sts_t sts = BF_FBITSET_OK;
+  Word_t key = 0;
+  PWord_t Pvalue;
+
+  JLF(Pvalue, x->chunks, key);
+  while (Pvalue) {
+    cbs_container_t *c = (cbs_container_t *)*Pvalue;
+    cbs_container_t *yc = cbs_chunk(y, key);
+    if (yc && !cbs_c_and(c, yc)) sts = BF_FBITSET_MALLOC_ERR;
+    if (!yc || !c->card) cbs_chunk_del(x, key);
+    JLN(Pvalue, x->chunks, key);
+  }
+  return sts;
+}
+
+void bf_cbs_optimize(bf_cbitset_t *bs) {
+  bf_sys_assert(bs);
+  Word_t key = 0;
+  PWord_t Pvalue;
+
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    cbs_container_t *c = (cbs_container_t *)*Pvalue;
+    size_t run_bytes = cbs_count_runs(c) * sizeof(cbs_run_t);
+    size_t array_bytes = c->card * sizeof(uint16_t);
+
+    if (run_bytes < array_bytes && run_bytes < CBS_BITMAP_BYTES) {
+      cbs_to_run(c);
+    } else if (c->card <= CBS_ARRAY_MAX) {
+      cbs_to_array(c);
+    } else {
+      cbs_to_bitmap(c);
+    }
+    /* Give back the unused array space */
+    if (c->type != CBS_BITMAP && c->cap > c->n && c->n) {
+      cbs_container_t *copy = cbs_clone(c);
+      if (copy) cbs_replace(c, copy);
+    }
+    JLN(Pvalue, bs->chunks, key);
+  }
+}
+
+size_t bf_cbs_memory_used(bf_cbitset_t *bs) {
+  bf_sys_assert(bs);
+  Word_t key = 0;
+  Word_t bytes;
+  PWord_t Pvalue;
+
+  JLMU(bytes, bs->chunks);
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    cbs_container_t *c = (cbs_container_t *)*Pvalue;
+    bytes += sizeof(cbs_container_t);
+    bytes += c->type == CBS_BITMAP ? CBS_BITMAP_BYTES
+                                   : c->cap * cbs_elem_size(c->type);
+    JLN(Pvalue, bs->chunks, key);
+  }
+  return bytes;
+}
+
+void bf_cbs_destroy(bf_cbitset_t *bs) {
+  Word_t key = 0;
+  Word_t Rc_word;
+  PWord_t Pvalue;
+
+  JLF(Pvalue, bs->chunks, key);
+  while (Pvalue) {
+    cbs_free((cbs_container_t *)*Pvalue);
+    JLN(Pvalue, bs->chunks, key);
+  }
+  JLFA(Rc_word, bs->chunks);
+  (void)Rc_word;
+}
+
+#ifdef BF_CBITSET_TEST
+
+#include <stdlib.h>
+
+/* Three full chunks and part of a fourth */
+#define TEST_WIDTH (3 * (int)CBS_CHUNK_BITS + 1000)
+
+static uint8_t test_model[TEST_WIDTH];
+static uint8_t test_model_y[TEST_WIDTH];
+
+static unsigned test_rand(void) {
+  return ((unsigned)rand() << 15) ^ (unsigned)rand();
+}
+
+static int model_first_set(const uint8_t *m, int position) {
+  int p;
+  for (p = position + 1; p < TEST_WIDTH; p++) {
+    if (m[p]) return p;
+  }
+  return -1;
+}
+
+static int model_first_clr_contiguous(const uint8_t *m,
+                                      int position,
+                                      unsigned int count) {
+  unsigned int run = 0;
+  int p;
+  for (p = position + 1; p < TEST_WIDTH; p++) {
+    run = m[p] ? 0 : run + 1;
+    if (run == count) return p + 1 - count;
+  }
+  return -1;
+}
+
+static int model_prev_clr_contiguous(const uint8_t *m,
+                                     int position,
+                                     unsigned int count) {
+  unsigned int run = 0;
+  int p;
+  for (p = position - 1; p >= 0; p--) {
+    run = m[p] ? 0 : run + 1;
+    if (run == count) return p;
+  }
+  return -1;
+}
+
+/* Set or clear count bits from pos in both the bitset and the model */
+static void test_set_range(bf_cbitset_t *bs,
+                           uint8_t *m,
+                           int pos,
+                           int count,
+                           int step,
+                           int val) {
+  int p;
+  for (p = pos; p < pos + count && p < TEST_WIDTH; p += step) {
+    bf_sys_assert(bf_cbs_set(bs, p, val) == (m[p] != 0));
+    m[p] = val;
+  }
+}
+
+static void test_check(bf_cbitset_t *bs, const uint8_t *m) {
+  static const unsigned int counts[] = {1, 2, 7, 64, 1000, 5000, 70000};
+  static int out[TEST_WIDTH];
+  unsigned int pop = 0;
+  unsigned int i, k;
+  int p, q, n;
+
+  for (p = 0; p < TEST_WIDTH; p++) {
+    bf_sys_assert(bf_cbs_get(bs, p) == (m[p] != 0));
+    pop += m[p];
+  }
+  bf_sys_assert(bf_cbs_pop_count(bs) == pop);
+
+  /* Walk the bits set one at a time and a few at a time */
+  q = -1;
+  for (p = bf_cbs_first_set(bs, -1); p >= 0; p = bf_cbs_first_set(bs, p)) {
+    bf_sys_assert(p == model_first_set(m, q));
+    q = p;
+  }
+  bf_sys_assert(model_first_set(m, q) == -1);
+  q = -1;
+  while ((n = bf_cbs_get_set_bits(bs, q, out, 7)) > 0) {
+    for (k = 0; k < (unsigned)n; k++) {
+      bf_sys_assert(out[k] == model_first_set(m, q));
+      q = out[k];
+    }
+  }
+  bf_sys_assert(model_first_set(m, q) == -1);
+  bf_sys_assert(bf_cbs_get_set_bits(bs, -1, out, TEST_WIDTH) == (int)pop);
+
+  /* Searches from around every chunk boundary and from random places */
+  for (i = 0; i < 40; i++) {
+    if (i < 6) {
+      p = (int)((i / 2 + 1) * CBS_CHUNK_BITS) - (i % 2 ? 1 : 2);
+    } else {
+      p = (int)(test_rand() % TEST_WIDTH);
+    }
+    bf_sys_assert(bf_cbs_first_set(bs, p) == model_first_set(m, p));
+    for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+      bf_sys_assert(bf_cbs_first_clr_contiguous(bs, p, counts[k]) ==
+                    model_first_clr_contiguous(m, p, counts[k]));
+      bf_sys_assert(bf_cbs_prev_clr_contiguous(bs, p + 1, counts[k]) ==
+                    model_prev_clr_contiguous(m, p + 1, counts[k]));
+    }
+  }
+  for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    bf_sys_assert(bf_cbs_first_clr_contiguous(bs, -1, counts[k]) ==
+                  model_first_clr_contiguous(m, -1, counts[k]));
+    bf_sys_assert(bf_cbs_prev_clr_contiguous(bs, TEST_WIDTH, counts[k]) ==
+                  model_prev_clr_contiguous(m, TEST_WIDTH, counts[k]));
+  }
+}
+
+/* Checks the bitset against a byte per bit model, with chunks held as
+ * arrays, bitmaps and run lists and with runs across the chunk boundaries. */
+int bf_cbs_test_main(void) {
+  bf_cbitset_t x, y;
+  unsigned int i;
+  int p;
+
+  srand(1);
+  bf_cbs_init(&x, TEST_WIDTH);
+  bf_cbs_init(&y, TEST_WIDTH);
+  test_check(&x, test_model);
+
+  /* Arrays: a few bits set in every chunk */
+  for (i = 0; i < 3000; i++) {
+    p = (int)(test_rand() % TEST_WIDTH);
+    test_set_range(&x, test_model, p, 1, 1, 1);
+  }
+  test_check(&x, test_model);
+
+  /* Bitmap: the second chunk mostly set, then cleared in places */
+  for (i = 0; i < 40000; i++) {
+    p = CBS_CHUNK_BITS + (int)(test_rand() % CBS_CHUNK_BITS);
+    test_set_range(&x, test_model, p, 1, 1, 1);
+  }
+  test_set_range(&x, test_model, CBS_CHUNK_BITS + 100, 3000, 1, 0);
+  test_check(&x, test_model);
+
+  /* Runs across the chunk boundaries, turned into run lists */
+  test_set_range(&x, test_model, CBS_CHUNK_BITS - 300, 5000, 1, 1);
+  test_set_range(&x, test_model, 2 * CBS_CHUNK_BITS - 4000, 9000, 1, 1);
+  test_set_range(&x, test_model, 3 * CBS_CHUNK_BITS - 10, 1010, 1, 1);
+  bf_cbs_optimize(&x);
+  test_check(&x, test_model);
+
+  /* Change the run lists, splitting and joining runs */
+  test_set_range(&x, test_model, 2 * CBS_CHUNK_BITS - 2, 4, 1, 0);
+  test_set_range(&x, test_model, 2 * CBS_CHUNK_BITS + 3000, 50, 2, 0);
+  test_set_range(&x, test_model, 2 * CBS_CHUNK_BITS + 3010, 20, 1, 1);
+  test_check(&x, test_model);
+  for (i = 0; i < 2000; i++) {
+    p = (int)(test_rand() % TEST_WIDTH);
+    test_set_range(&x, test_model, p, 1 + test_rand() % 300, 1, rand() % 2);
+  }
+  bf_cbs_optimize(&x);
+  test_check(&x, test_model);
+
+  /* Or with a set of stripes and runs, then and with it */
+  for (i = 0; i < 200; i++) {
+    p = (int)(test_rand() % TEST_WIDTH);
+    test_set_range(&y, test_model_y, p, test_rand() % 2000, 1 + i % 3, 1);
+  }
+  test_check(&y, test_model_y);
+  bf_sys_assert(bf_cbs_or(&x, &y) == BF_FBITSET_OK);
+  for (p = 0; p < TEST_WIDTH; p++) test_model[p] |= test_model_y[p];
+  test_check(&x, test_model);
+  test_check(&y, test_model_y);
+
+  test_set_range(&y, test_model_y, 0, CBS_CHUNK_BITS, 1, 0);
+  test_set_range(&y, test_model_y, 2 * CBS_CHUNK_BITS - 500, 1000, 1, 1);
+  bf_cbs_optimize(&y);
+  bf_sys_assert(bf_cbs_and(&x, &y) == BF_FBITSET_OK);
+  for (p = 0; p < TEST_WIDTH; p++) test_model[p] &= test_model_y[p];
+  test_check(&x, test_model);
+  bf_cbs_optimize(&x);
+  test_check(&x, test_model);
+
+  bf_cbs_destroy(&x);
+  bf_cbs_destroy(&y);
+  return 0;
+}
+
+#endif
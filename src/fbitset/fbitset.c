@@ -13,9 +13,13 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <string.h>
 #include <target-utils/fbitset/fbitset.h>
+#include <target-utils/bitset/bitset.h>
 #include <Judy.h>
+#include "../runs_index.h"
 #include <assert.h>
+#include <target-sys/bf_sal/bf_sys_intf.h>
 
 /* Initialize a bitset. */
 void bf_fbs_init(bf_fbitset_t *bs, unsigned int width) {
@@ -23,6 +27,438 @@ void bf_fbs_init(bf_fbitset_t *bs, unsigned int width) {
   assert(width > 0);
   bs->width = width;
   bs->fbs = NULL;
+  bs->free_runs = NULL;
+  bs->run_sizes = NULL;
+  bs->run_index = false;
+  bs->dense = NULL;
+  bs->dense_chunks = NULL;
+  bs->sets = 0;
+  bs->adaptive = false;
+}
+
+void bf_fbs_init_adaptive(bf_fbitset_t *bs, unsigned int width) {
+  bf_fbs_init(bs, width);
+  bs->adaptive = true;
+}
+
+/* Adaptive bitsets keep the chunks with many bits set as plain words in
+ * "dense" and only the other chunks in "fbs". The functions below give the
+ * Judy1 search semantics over both, and are plain Judy1 calls otherwise. */
+
+#define FBS_CHUNK_SHIFT 12
+#define FBS_CHUNK_BITS (1u << FBS_CHUNK_SHIFT)
+#define FBS_CHUNK_WORDS (FBS_CHUNK_BITS / 64)
+/* A chunk moves to words at FBS_DENSE_MIN bits set and back below
+ * FBS_SPARSE_MIN. The population of the chunks in Judy is only checked
+ * every FBS_CHECK_SETS bits set, with J1C. */
+#define FBS_DENSE_MIN (FBS_CHUNK_BITS / 8)
+#define FBS_SPARSE_MIN (FBS_CHUNK_BITS / 32)
+#define FBS_CHECK_SETS 64
+
+typedef struct fbs_dense_s {
+  unsigned int count;
+  uint64_t w[FBS_CHUNK_WORDS];
+} fbs_dense_t;
+
+static inline Word_t fbs_chunk(Word_t index) {
+  return index >> FBS_CHUNK_SHIFT;
+}
+
+static inline Word_t fbs_chunks(bf_fbitset_t *bs) {
+  return fbs_chunk(bs->width + FBS_CHUNK_BITS - 1);
+}
+
+static inline fbs_dense_t *fbs_dense(bf_fbitset_t *bs, Word_t chunk) {
+  if (!bs->dense_chunks || chunk >= fbs_chunks(bs)) {
+    return NULL;
+  }
+  return (fbs_dense_t *)bs->dense[chunk];
+}
+
+static inline void fbs_dense_bitset(fbs_dense_t *d, bf_bitset_t *b) {
+  bf_bs_init(b, FBS_CHUNK_BITS, d->w);
+}
+
+/* Moves the bits of a chunk from fbs to words. Stays in Judy when out of
+ * memory. */
+static void fbs_promote(bf_fbitset_t *bs, Word_t chunk) {
+  Word_t index = chunk << FBS_CHUNK_SHIFT;
+  Word_t end = index + FBS_CHUNK_BITS;
+  fbs_dense_t *d;
+  int Rc_int;
+
+  if (!bs->dense) {
+    bs->dense = bf_sys_calloc(fbs_chunks(bs), sizeof(void *));
+    if (!bs->dense) {
+      return;
+    }
+  }
+  d = bf_sys_calloc(1, sizeof(fbs_dense_t));
+  if (!d) {
+    return;
+  }
+  J1S(Rc_int, bs->dense_chunks, chunk);
+  if (Rc_int == JERR) {
+    bf_sys_free(d);
+    return;
+  }
+  bs->dense[chunk] = d;
+  J1F(Rc_int, bs->fbs, index);
+  while (Rc_int && index < end) {
+    d->w[(index % FBS_CHUNK_BITS) / 64] |= UINT64_C(1) << (index % 64);
+    d->count++;
+    J1U(Rc_int, bs->fbs, index);
+    J1N(Rc_int, bs->fbs, index);
+  }
+}
+
+/* Moves the bits of a chunk from words back to fbs. Stays as words when
+ * out of memory. */
+static void fbs_demote(bf_fbitset_t *bs, Word_t chunk, fbs_dense_t *d) {
+  Word_t base = chunk << FBS_CHUNK_SHIFT;
+  bf_bitset_t b;
+  int Rc_int;
+  int i = -1;
+
+  fbs_dense_bitset(d, &b);
+  while ((i = bf_bs_first_set(&b, i)) >= 0) {
+    J1S(Rc_int, bs->fbs, base + i);
+    if (Rc_int == JERR) {
+      int j;
+      for (j = bf_bs_first_set(&b, -1); j >= 0 && j < i;
+           j = bf_bs_first_set(&b, j)) {
+        J1U(Rc_int, bs->fbs, base + j);
+      }
+      return;
+    }
+  }
+  J1U(Rc_int, bs->dense_chunks, chunk);
+  bs->dense[chunk] = NULL;
+  bf_sys_free(d);
+}
+
+static bool fbs_test(bf_fbitset_t *bs, Word_t index) {
+  fbs_dense_t *d = fbs_dense(bs, fbs_chunk(index));
+  int Rc_int;
+
+  if (d) {
+    return (d->w[(index % FBS_CHUNK_BITS) / 64] >> (index % 64)) & 1;
+  }
+  J1T(Rc_int, bs->fbs, index);
+  return Rc_int;
+}
+
+/* Sets the bit at index to val. Returns 1 if it changed, 0 if not and JERR
+ * if out of memory, as J1S and J1U. */
+static int fbs_put(bf_fbitset_t *bs, Word_t index, bool val) {
+  Word_t chunk = fbs_chunk(index);
+  fbs_dense_t *d = fbs_dense(bs, chunk);
+  int Rc_int;
+
+  if (d) {
+    uint64_t *w = &d->w[(index % FBS_CHUNK_BITS) / 64];
+    uint64_t bit = UINT64_C(1) << (index % 64);
+    if (!(*w & bit) == !val) {
+      return 0;
+    }
+    *w ^= bit;
+    if (val) {
+      d->count++;
+    } else if (--d->count < FBS_SPARSE_MIN) {
+      fbs_demote(bs, chunk, d);
+    }
+    return 1;
+  }
+
+  if (val) {
+    J1S(Rc_int, bs->fbs, index);
+    if (Rc_int == 1 && bs->adaptive && ++bs->sets % FBS_CHECK_SETS == 0) {
+      Word_t count;
+      J1C(count,
+          bs->fbs,
+          chunk << FBS_CHUNK_SHIFT,
+          index | (FBS_CHUNK_BITS - 1));
+      if (count >= FBS_DENSE_MIN) {
+        fbs_promote(bs, chunk);
+      }
+    }
+  } else {
+    J1U(Rc_int, bs->fbs, index);
+  }
+  return Rc_int;
+}
+
+/* First bit set (or clear) at or after index, as J1F (or J1FE) */
+static int fbs_first(bf_fbitset_t *bs, Word_t *index, bool set) {
+  Word_t chunk, found;
+  bf_bitset_t b;
+  int Rc_int, more, i;
+
+  if (set) {
+    found = *index;
+    J1F(Rc_int, bs->fbs, found);
+    if (!bs->dense_chunks) {
+      *index = found;
+      return Rc_int;
+    }
+    /* A dense chunk below the bit found in Judy may have a bit set first */
+    chunk = fbs_chunk(*index);
+    J1F(more, bs->dense_chunks, chunk);
+    while (more && (!Rc_int || chunk < fbs_chunk(found))) {
+      fbs_dense_bitset((fbs_dense_t *)bs->dense[chunk], &b);
+      i = chunk == fbs_chunk(*index) ? (int)(*index % FBS_CHUNK_BITS) : 0;
+      i = bf_bs_first_set(&b, i - 1);
+      if (i >= 0) {
+        *index = (chunk << FBS_CHUNK_SHIFT) + i;
+        return 1;
+      }
+      J1N(more, bs->dense_chunks, chunk);
+    }
+    *index = found;
+    return Rc_int;
+  }
+
+  /* The first bit clear in Judy is clear unless its chunk is dense */
+  while (1) {
+    J1FE(Rc_int, bs->fbs, *index);
+    fbs_dense_t *d = Rc_int ? fbs_dense(bs, fbs_chunk(*index)) : NULL;
+    if (!d) {
+      return Rc_int;
+    }
+    fbs_dense_bitset(d, &b);
+    i = bf_bs_first_clr(&b, (int)(*index % FBS_CHUNK_BITS) - 1);
+    if (i >= 0) {
+      *index = (*index & ~(Word_t)(FBS_CHUNK_BITS - 1)) + i;
+      return 1;
+    }
+    *index = (fbs_chunk(*index) + 1) << FBS_CHUNK_SHIFT;
+  }
+}
+
+/* Last bit clear in the words at or before bit i, -1 if none */
+static int fbs_dense_last_clr(fbs_dense_t *d, int i) {
+  int word = i / 64;
+  uint64_t x = ~d->w[word] & (~UINT64_C(0) >> (63 - i % 64));
+
+  while (!x) {
+    if (--word < 0) {
+      return -1;
+    }
+    x = ~d->w[word];
+  }
+  return 64 * word + 63 - __builtin_clzll(x);
+}
+
+/* Last bit set (or clear) at or before index, as J1L (or J1LE) */
+static int fbs_last(bf_fbitset_t *bs, Word_t *index, bool set) {
+  Word_t chunk, found;
+  bf_bitset_t b;
+  int Rc_int, more, i;
+
+  if (set) {
+    found = *index;
+    J1L(Rc_int, bs->fbs, found);
+    if (!bs->dense_chunks) {
+      *index = found;
+      return Rc_int;
+    }
+    chunk = fbs_chunk(*index);
+    J1L(more, bs->dense_chunks, chunk);
+    while (more && (!Rc_int || chunk > fbs_chunk(found))) {
+      fbs_dense_bitset((fbs_dense_t *)bs->dense[chunk], &b);
+      i = chunk == fbs_chunk(*index) ? (int)(*index % FBS_CHUNK_BITS)
+                                     : (int)FBS_CHUNK_BITS - 1;
+      i = bf_bs_last_set(&b, i + 1);
+      if (i >= 0) {
+        *index = (chunk << FBS_CHUNK_SHIFT) + i;
+        return 1;
+      }
+      J1P(more, bs->dense_chunks, chunk);
+    }
+    *index = found;
+    return Rc_int;
+  }
+
+  while (1) {
+    J1LE(Rc_int, bs->fbs, *index);
+    fbs_dense_t *d = Rc_int ? fbs_dense(bs, fbs_chunk(*index)) : NULL;
+    if (!d) {
+      return Rc_int;
+    }
+    i = fbs_dense_last_clr(d, *index % FBS_CHUNK_BITS);
+    if (i >= 0) {
+      *index = (*index & ~(Word_t)(FBS_CHUNK_BITS - 1)) + i;
+      return 1;
+    }
+    if (fbs_chunk(*index) == 0) {
+      return 0;
+    }
+    *index = (fbs_chunk(*index) << FBS_CHUNK_SHIFT) - 1;
+  }
+}
+
+/* As J1N and J1NE */
+static inline int fbs_next(bf_fbitset_t *bs, Word_t *index, bool set) {
+  if (*index == (Word_t)-1) {
+    return 0;
+  }
+  ++*index;
+  return fbs_first(bs, index, set);
+}
+
+/* As J1P and J1PE */
+static inline int fbs_prev(bf_fbitset_t *bs, Word_t *index, bool set) {
+  if (*index == 0) {
+    return 0;
+  }
+  --*index;
+  return fbs_last(bs, index, set);
+}
+
+/* Bits set from first to last, both included, as J1C */
+static Word_t fbs_count(bf_fbitset_t *bs, Word_t first, Word_t last) {
+  Word_t Rc_word;
+  Word_t chunk = fbs_chunk(first);
+  bf_bitset_t b;
+  int more;
+
+  J1C(Rc_word, bs->fbs, first, last);
+  if (!bs->dense_chunks) {
+    return Rc_word;
+  }
+  J1F(more, bs->dense_chunks, chunk);
+  while (more && chunk <= fbs_chunk(last)) {
+    fbs_dense_t *d = (fbs_dense_t *)bs->dense[chunk];
+    Word_t lo = chunk == fbs_chunk(first) ? first % FBS_CHUNK_BITS : 0;
+    Word_t hi = chunk == fbs_chunk(last) ? last % FBS_CHUNK_BITS
+                                         : FBS_CHUNK_BITS - 1;
+    if (lo == 0 && hi == FBS_CHUNK_BITS - 1) {
+      Rc_word += d->count;
+    } else {
+      fbs_dense_bitset(d, &b);
+      Rc_word += bf_bs_count_range(&b, lo, hi - lo + 1);
+    }
+    J1N(more, bs->dense_chunks, chunk);
+  }
+  return Rc_word;
+}
+
+static void fbs_free_all(bf_fbitset_t *bs) {
+  Word_t Rc_word;
+  Word_t chunk = 0;
+  int Rc_int;
+
+  J1FA(Rc_word, bs->fbs);
+  J1F(Rc_int, bs->dense_chunks, chunk);
+  while (Rc_int) {
+    bf_sys_free(bs->dense[chunk]);
+    bs->dense[chunk] = NULL;
+    J1N(Rc_int, bs->dense_chunks, chunk);
+  }
+  J1FA(Rc_word, bs->dense_chunks);
+  (void)Rc_word;
+}
+
+/* Index of the runs of clear bits, see runs_index.h. It is dropped if Judy
+ * runs out of memory while updating it, the searches then walk the bitset
+ * again. */
+
+static void fbs_runs_clear(bf_fbitset_t *bs) {
+  bf_runs_clear(&bs->free_runs, &bs->run_sizes);
+  bs->run_index = false;
+}
+
+/* Bits [start, end) were set or cleared */
+static void fbs_runs_update(bf_fbitset_t *bs,
+                            Word_t start,
+                            Word_t end,
+                            bool set) {
+  if (bs->run_index &&
+      bf_runs_update(&bs->free_runs, &bs->run_sizes, start, end, set)) {
+    bs->run_index = false;
+  }
+}
+
+bf_fbitset_sts_t bf_fbs_run_index_enable(bf_fbitset_t *bs) {
+  assert(bs);
+  Word_t start = 0, end;
+  int Rc_int;
+
+  if (bs->run_index) {
+    return BF_FBITSET_OK;
+  }
+  while (1) {
+    Rc_int = fbs_first(bs, &start, false);
+    if (!Rc_int || start >= bs->width) {
+      break;
+    }
+    end = start;
+    Rc_int = fbs_next(bs, &end, true);
+    if (!Rc_int || end > bs->width) {
+      end = bs->width;
+    }
+    if (bf_runs_add(&bs->free_runs, &bs->run_sizes, start, end - start)) {
+      fbs_runs_clear(bs);
+      return BF_FBITSET_MALLOC_ERR;
+    }
+    if (end >= bs->width) {
+      break;
+    }
+    start = end;
+  }
+  bs->run_index = true;
+  return BF_FBITSET_OK;
+}
+
+/* Lowest start of count clear bits at or after position, -1 if none. In the
+ * runs of one length the lowest start fitting is the best one, so each
+ * length takes a single search. */
+static int fbs_runs_first(bf_fbitset_t *bs, Word_t position, Word_t count) {
+  PWord_t Pstarts;
+  Word_t len = count;
+  Word_t index, best = -1;
+  int Rc_int;
+
+  JLF(Pstarts, bs->run_sizes, len);
+  while (Pstarts) {
+    /* Runs starting lower still hold count bits from position on */
+    index = position + count > len ? position + count - len : 0;
+    J1F(Rc_int, *(Pvoid_t *)Pstarts, index);
+    if (Rc_int) {
+      if (index < position) {
+        index = position;
+      }
+      if (index < best) {
+        best = index;
+      }
+    }
+    JLN(Pstarts, bs->run_sizes, len);
+  }
+  return best == (Word_t)-1 ? -1 : (int)best;
+}
+
+/* Highest start of count clear bits ending at or before position, -1 if
+ * none. */
+static int fbs_runs_prev(bf_fbitset_t *bs, Word_t position, Word_t count) {
+  PWord_t Pstarts;
+  Word_t len = count;
+  Word_t index, end;
+  int best = -1;
+  int Rc_int;
+
+  JLF(Pstarts, bs->run_sizes, len);
+  while (Pstarts) {
+    index = position - count;
+    J1L(Rc_int, *(Pvoid_t *)Pstarts, index);
+    if (Rc_int) {
+      end = index + len < position ? index + len : position;
+      if ((int)(end - count) > best) {
+        best = end - count;
+      }
+    }
+    JLN(Pstarts, bs->run_sizes, len);
+  }
+  return best;
 }
 
 /* Set the bit at "position" to "val", return it's previous value. */
@@ -34,10 +470,16 @@ bool bf_fbs_set(bf_fbitset_t *bs, int position, int val) {
 
   int Rc_int;
   if (val) {
-    J1S(Rc_int, bs->fbs, (Word_t)position);
+    Rc_int = fbs_put(bs, (Word_t)position, true);
+    if (Rc_int == 1) {
+      fbs_runs_update(bs, position, (Word_t)position + 1, true);
+    }
     return (Rc_int ? false : true);
   } else {
-    J1U(Rc_int, bs->fbs, (Word_t)position);
+    Rc_int = fbs_put(bs, (Word_t)position, false);
+    if (Rc_int) {
+      fbs_runs_update(bs, position, (Word_t)position + 1, false);
+    }
     return (Rc_int ? true : false);
   }
 }
@@ -48,10 +490,153 @@ bool bf_fbs_get(bf_fbitset_t *bs, int position) {
   assert(position >= 0);
   assert((unsigned)position < bs->width);
   int Rc_int;
-  J1T(Rc_int, bs->fbs, (Word_t)position);
+  Rc_int = fbs_test(bs, (Word_t)position);
   return (Rc_int ? true : false);
 }
 
+bf_fbitset_sts_t bf_fbs_set_range(bf_fbitset_t *bs,
+                                  int position,
+                                  unsigned int count,
+                                  int val) {
+  assert(bs);
+  assert(position >= 0);
+  assert((unsigned)position + count <= bs->width);
+  assert((val == 1) || (val == 0));
+
+  Word_t end = (Word_t)position + count;
+  Word_t index = position;
+  int Rc_int;
+
+  if (!count) {
+    return BF_FBITSET_OK;
+  }
+  /* Find each run of bits with the other value with two searches and flip
+   * its bits, Judy has no range insert or delete. */
+  if (val) {
+    Rc_int = fbs_first(bs, &index, false);
+    while (Rc_int && index < end) {
+      Word_t run_end = index;
+      Rc_int = fbs_next(bs, &run_end, true);
+      if (!Rc_int || run_end > end) {
+        run_end = end;
+      }
+      for (; index < run_end; index++) {
+        Rc_int = fbs_put(bs, index, true);
+        if (Rc_int == JERR) {
+          fbs_runs_update(bs, position, index, true);
+          return BF_FBITSET_MALLOC_ERR;
+        }
+      }
+      Rc_int = fbs_next(bs, &index, false);
+    }
+  } else {
+    Word_t Rc_word, total;
+    Rc_word = fbs_count(bs, index, end - 1);
+    total = fbs_count(bs, 0, -1);
+    if (Rc_word == total) {
+      /* Nothing is set outside of the range */
+      fbs_free_all(bs);
+      Rc_int = 0;
+    } else {
+      Rc_int = fbs_first(bs, &index, true);
+    }
+    while (Rc_int && index < end) {
+      Word_t run_end = index;
+      Rc_int = fbs_next(bs, &run_end, false);
+      if (!Rc_int || run_end > end) {
+        run_end = end;
+      }
+      for (; index < run_end; index++) {
+        Rc_int = fbs_put(bs, index, false);
+      }
+      Rc_int = fbs_next(bs, &index, true);
+    }
+  }
+  fbs_runs_update(bs, position, end, val);
+  return BF_FBITSET_OK;
+}
+
+unsigned int bf_fbs_count_range(bf_fbitset_t *bs,
+                                int position,
+                                unsigned int count) {
+  assert(bs);
+  assert(position >= 0);
+  assert((unsigned)position + count <= bs->width);
+
+  Word_t Rc_word;
+  if (!count) {
+    return 0;
+  }
+  Rc_word = fbs_count(bs, (Word_t)position, (Word_t)position + count - 1);
+  return Rc_word;
+}
+
+void bf_fbs_iter_init(bf_fbitset_iter_t *it,
+                      bf_fbitset_t *bs,
+                      int position,
+                      bool set) {
+  assert(it);
+  assert(bs);
+  assert(position >= -1);
+  it->bs = bs;
+  it->pos = position + 1;
+  it->run_end = 0;
+  it->set = set;
+  it->known = false;
+}
+
+int bf_fbs_iter_next(bf_fbitset_iter_t *it, int *out, int max) {
+  assert(it);
+  assert(out);
+  bf_fbitset_t *bs = it->bs;
+  Word_t index, next;
+  int Rc_int;
+  int cnt = 0;
+
+  while (cnt < max && it->pos < bs->width) {
+    if (it->pos < it->run_end) {
+      while (cnt < max && it->pos < it->run_end) {
+        out[cnt++] = it->pos++;
+      }
+      continue;
+    }
+
+    index = it->pos;
+    if (!it->known) {
+      if (it->set) {
+        Rc_int = fbs_first(bs, &index, true);
+      } else {
+        Rc_int = fbs_first(bs, &index, false);
+      }
+      if (!Rc_int || index >= bs->width) {
+        it->pos = bs->width;
+        break;
+      }
+    }
+    it->known = false;
+
+    /* For bits set, the next bit set tells whether index starts a run, most
+     * of the time a sparse set takes one search per bit this way. Bits
+     * clear usually come in runs, look for the end of it directly. */
+    next = index;
+    if (it->set) {
+      Rc_int = fbs_next(bs, &next, true);
+      if (!Rc_int || next != index + 1) {
+        out[cnt++] = index;
+        it->pos = Rc_int ? next : bs->width;
+        it->known = true;
+        continue;
+      }
+      Rc_int = fbs_next(bs, &next, false);
+    } else {
+      Rc_int = fbs_next(bs, &next, true);
+    }
+    it->pos = index;
+    it->run_end = Rc_int && next < bs->width ? next : bs->width;
+  }
+  return cnt;
+}
+
 /* Position is exclusive */
 int bf_fbs_prev_clr_contiguous(bf_fbitset_t *bs,
                                int position,
@@ -68,10 +653,13 @@ int bf_fbs_prev_clr_contiguous(bf_fbitset_t *bs,
   if (((unsigned)(position + 1) < count) || ((unsigned)position >= bs->width)) {
     return -1;
   }
+  if (bs->run_index) {
+    return fbs_runs_prev(bs, (Word_t)position + 1, count);
+  }
 
   int Rc_int;
   Word_t free_index = position;
-  J1LE(Rc_int, bs->fbs, free_index);
+  Rc_int = fbs_last(bs, &free_index, false);
   if (!Rc_int) {
     return -1;
   }
@@ -82,7 +670,7 @@ int bf_fbs_prev_clr_contiguous(bf_fbitset_t *bs,
 
   Word_t last_free = free_index;
   while (true) {
-    J1P(Rc_int, bs->fbs, last_free);
+    Rc_int = fbs_prev(bs, &last_free, true);
     if (!Rc_int) {
       last_free = 0;
     } else {
@@ -92,7 +680,7 @@ int bf_fbs_prev_clr_contiguous(bf_fbitset_t *bs,
     if (((free_index + 1) - last_free) >= count) {
       return ((free_index + 1) - count);
     }
-    J1PE(Rc_int, bs->fbs, last_free);
+    Rc_int = fbs_prev(bs, &last_free, false);
     if (!Rc_int) {
       return -1;
     }
@@ -114,10 +702,13 @@ int bf_fbs_first_clr_contiguous(bf_fbitset_t *bs,
   }
   assert(position >= 0);
   assert((unsigned)(position + count) <= bs->width);
+  if (bs->run_index) {
+    return fbs_runs_first(bs, position, count);
+  }
 
   int Rc_int;
   Word_t free_index = position;
-  J1FE(Rc_int, bs->fbs, free_index);
+  Rc_int = fbs_first(bs, &free_index, false);
   if (!Rc_int) {
     return -1;
   }
@@ -132,7 +723,7 @@ int bf_fbs_first_clr_contiguous(bf_fbitset_t *bs,
 
   Word_t last_free = free_index;
   while (last_free < bs->width) {
-    J1N(Rc_int, bs->fbs, last_free);
+    Rc_int = fbs_next(bs, &last_free, true);
     if (!Rc_int) {
       last_free = bs->width - 1;
     } else {
@@ -142,7 +733,7 @@ int bf_fbs_first_clr_contiguous(bf_fbitset_t *bs,
     if (((last_free + 1) - free_index) >= count) {
       return free_index;
     }
-    J1NE(Rc_int, bs->fbs, last_free);
+    Rc_int = fbs_next(bs, &last_free, false);
     if (!Rc_int) {
       return -1;
     }
@@ -161,15 +752,386 @@ int bf_fbs_first_set(bf_fbitset_t *bs, int position) {
   }
   int Rc_int;
   Word_t set_index = position;
-  J1F(Rc_int, bs->fbs, set_index);
+  Rc_int = fbs_first(bs, &set_index, true);
   if (!Rc_int) {
     return -1;
   }
   return set_index;
 }
 
-void bf_fbs_destroy(bf_fbitset_t *bs) {
+unsigned int bf_fbs_pop_count(bf_fbitset_t *bs) {
+  assert(bs);
+  return fbs_count(bs, 0, -1);
+}
+
+double bf_fbs_density(bf_fbitset_t *bs) {
+  assert(bs);
+  return (double)bf_fbs_pop_count(bs) / bs->width;
+}
+
+size_t bf_fbs_memory_used(bf_fbitset_t *bs) {
+  assert(bs);
   Word_t Rc_word;
-  (void)Rc_word;
-  J1FA(Rc_word, bs->fbs);
+  size_t bytes;
+
+  J1MU(Rc_word, bs->fbs);
+  bytes = Rc_word;
+  if (bs->dense) {
+    bytes += fbs_chunks(bs) * sizeof(void *);
+    J1C(Rc_word, bs->dense_chunks, 0, -1);
+    bytes += Rc_word * sizeof(fbs_dense_t);
+    J1MU(Rc_word, bs->dense_chunks);
+    bytes += Rc_word;
+  }
+  bytes += bf_runs_memory_used(&bs->free_runs, &bs->run_sizes);
+  return bytes;
+}
+
+void bf_fbs_destroy(bf_fbitset_t *bs) {
+  fbs_free_all(bs);
+  if (bs->dense) {
+    bf_sys_free(bs->dense);
+    bs->dense = NULL;
+  }
+  if (bs->run_index) {
+    fbs_runs_clear(bs);
+  }
+}
+
+#ifdef BF_FBITSET_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_WIDTH (1u << 20)
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* ns per set, get and step of a walk over the bits set, for a plain bitset,
+ * a Judy fbitset and an adaptive one, filled at random to "density". */
+static void bench_density(double density, const unsigned *pos) {
+  static uint64_t words[BF_BITSET_ARRAY_SIZE(BENCH_WIDTH)];
+  unsigned n = BENCH_WIDTH * density;
+  bf_fbitset_t fbs[2];
+  bf_bitset_t bs;
+  double t[4];
+  volatile int sink = 0;
+  unsigned i;
+  int p, k;
+
+  bf_bs_init(&bs, BENCH_WIDTH, words);
+  bf_bs_set_all(&bs, 0);
+  bf_fbs_init(&fbs[0], BENCH_WIDTH);
+  bf_fbs_init_adaptive(&fbs[1], BENCH_WIDTH);
+
+  printf("%5.1f%%", density * 100);
+  t[0] = bench_now();
+  for (i = 0; i < n; i++) bf_bs_set(&bs, pos[i], 1);
+  t[1] = bench_now();
+  for (i = 0; i < n; i++) sink += bf_bs_get(&bs, pos[(i * 7919u) % n]);
+  t[2] = bench_now();
+  for (p = bf_bs_first_set(&bs, -1); p >= 0; p = bf_bs_first_set(&bs, p)) {
+    sink++;
+  }
+  t[3] = bench_now();
+  printf("  %6.1f %6.1f %6.1f",
+         (t[1] - t[0]) / n,
+         (t[2] - t[1]) / n,
+         (t[3] - t[2]) / n);
+
+  for (k = 0; k < 2; k++) {
+    t[0] = bench_now();
+    for (i = 0; i < n; i++) bf_fbs_set(&fbs[k], pos[i], 1);
+    t[1] = bench_now();
+    for (i = 0; i < n; i++) sink += bf_fbs_get(&fbs[k], pos[(i * 7919u) % n]);
+    t[2] = bench_now();
+    for (p = bf_fbs_first_set(&fbs[k], -1); p >= 0;
+         p = bf_fbs_first_set(&fbs[k], p)) {
+      sink++;
+    }
+    t[3] = bench_now();
+    printf("  %6.1f %6.1f %6.1f",
+           (t[1] - t[0]) / n,
+           (t[2] - t[1]) / n,
+           (t[3] - t[2]) / n);
+    bf_fbs_destroy(&fbs[k]);
+  }
+  printf("\n");
 }
+
+int bf_fbs_bench_main(void) {
+  double densities[] = {0.001, 0.01, 0.1, 0.5, 0.9};
+  unsigned *pos = malloc(BENCH_WIDTH * sizeof(unsigned));
+  unsigned i;
+
+  if (!pos) {
+    return -1;
+  }
+  for (i = 0; i < BENCH_WIDTH; i++) {
+    pos[i] = (i * 2654435761u) % BENCH_WIDTH;
+  }
+  printf("ns per op   bitset set/get/walk   fbitset set/get/walk   "
+         "adaptive set/get/walk\n");
+  for (i = 0; i < sizeof(densities) / sizeof(densities[0]); i++) {
+    bench_density(densities[i], pos);
+  }
+  free(pos);
+  return 0;
+}
+
+#endif
+
+#ifdef BF_FBITSET_TEST
+
+#include <stdlib.h>
+
+#define TEST_WIDTH (5 * (int)FBS_CHUNK_BITS + 100)
+
+static uint8_t test_model[TEST_WIDTH];
+
+static unsigned test_rand(void) {
+  return ((unsigned)rand() << 15) ^ (unsigned)rand();
+}
+
+static int model_next(int position, bool set) {
+  int p;
+  for (p = position + 1; p < TEST_WIDTH; p++) {
+    if (test_model[p] == set) return p;
+  }
+  return -1;
+}
+
+static int model_first_clr_contiguous(int position, unsigned int count) {
+  unsigned int run = 0;
+  int p;
+  for (p = position + 1; p < TEST_WIDTH; p++) {
+    run = test_model[p] ? 0 : run + 1;
+    if (run == count) return p + 1 - count;
+  }
+  return -1;
+}
+
+static int model_prev_clr_contiguous(int position, unsigned int count) {
+  unsigned int run = 0;
+  int p;
+  for (p = position - 1; p >= 0; p--) {
+    run = test_model[p] ? 0 : run + 1;
+    if (run == count) return p;
+  }
+  return -1;
+}
+
+static void test_set_range(bf_fbitset_t *bs,
+                           int position,
+                           unsigned int count,
+                           int val) {
+  unsigned int n = 0;
+  unsigned int i;
+
+  for (i = position; i < position + count; i++) n += test_model[i];
+  assert(bf_fbs_count_range(bs, position, count) == n);
+  assert(bf_fbs_set_range(bs, position, count, val) == BF_FBITSET_OK);
+  memset(test_model + position, val, count);
+  assert(bf_fbs_count_range(bs, position, count) == (val ? count : 0));
+}
+
+/* Walks the bits with the wanted value from position with the iterator,
+ * "max" at a time. */
+static void test_iter(bf_fbitset_t *bs, int position, bool set, int max) {
+  static int out[TEST_WIDTH];
+  bf_fbitset_iter_t it;
+  int p = position;
+  int i, n;
+
+  bf_fbs_iter_init(&it, bs, position, set);
+  while ((n = bf_fbs_iter_next(&it, out, max)) > 0) {
+    assert(n <= max);
+    for (i = 0; i < n; i++) {
+      p = model_next(p, set);
+      assert(out[i] == p);
+    }
+  }
+  assert(model_next(p, set) == -1);
+  assert(bf_fbs_iter_next(&it, out, max) == 0);
+}
+
+/* Every search from just after position */
+static void test_search(bf_fbitset_t *bs, int position) {
+  static const int maxes[] = {1, 2, 3, 64, TEST_WIDTH};
+  static const unsigned int counts[] = {1, 2, 5, 64, 1000, TEST_WIDTH};
+  unsigned int k, n, pop = 0;
+
+  for (k = 0; k < sizeof(maxes) / sizeof(maxes[0]); k++) {
+    test_iter(bs, position, true, maxes[k]);
+    test_iter(bs, position, false, maxes[k]);
+  }
+  assert(bf_fbs_first_set(bs, position) == model_next(position, true));
+  n = test_rand() % (TEST_WIDTH - position);
+  for (k = position + 1; k < position + 1 + n; k++) pop += test_model[k];
+  assert(bf_fbs_count_range(bs, position + 1, n) == pop);
+  for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    assert(bf_fbs_first_clr_contiguous(bs, position, counts[k]) ==
+           model_first_clr_contiguous(position, counts[k]));
+    assert(bf_fbs_prev_clr_contiguous(bs, position + 1, counts[k]) ==
+           model_prev_clr_contiguous(position + 1, counts[k]));
+  }
+}
+
+static void test_check(bf_fbitset_t *bs) {
+  unsigned int pop = 0;
+  unsigned int i;
+  int p;
+
+  for (p = 0; p < TEST_WIDTH; p++) {
+    assert(bf_fbs_get(bs, p) == test_model[p]);
+    pop += test_model[p];
+  }
+  assert(bf_fbs_pop_count(bs) == pop);
+  assert(bf_fbs_count_range(bs, 0, TEST_WIDTH) == pop);
+  test_search(bs, -1);
+  test_search(bs, TEST_WIDTH - 1);
+  for (i = 0; i < 3; i++) {
+    test_search(bs, (int)(test_rand() % TEST_WIDTH) - 1);
+  }
+}
+
+/* Random bits and ranges set and cleared, short and long. The run index is
+ * enabled before step "index_at", never if past the last step. */
+static void test_ranges(bf_fbitset_t *bs,
+                        unsigned int steps,
+                        unsigned int index_at) {
+  unsigned int i, pos, count;
+  int val;
+
+  for (i = 0; i < steps; i++) {
+    if (i == index_at) {
+      assert(bf_fbs_run_index_enable(bs) == BF_FBITSET_OK);
+    }
+    pos = test_rand() % TEST_WIDTH;
+    count = test_rand() % (TEST_WIDTH - pos + 1);
+    val = test_rand() % 3 != 0;
+    if (i % 4 == 1) {
+      assert(bf_fbs_set(bs, pos, val) == test_model[pos]);
+      test_model[pos] = val;
+    } else {
+      test_set_range(bs, pos, i % 4 ? count % 70 : count, val);
+    }
+    if (i % 50 == 0) test_check(bs);
+  }
+  assert(bs->run_index == (index_at < steps));
+  test_check(bs);
+}
+
+/* Checks the range functions and the iterator against a byte per bit
+ * model. */
+int bf_fbs_test_main(void) {
+  bf_fbitset_t bs;
+  unsigned int i, k;
+  int base, p;
+
+  srand(1);
+  bf_fbs_init(&bs, TEST_WIDTH);
+  test_check(&bs);
+  test_set_range(&bs, 0, 0, 1);
+  test_set_range(&bs, TEST_WIDTH, 0, 1);
+  test_set_range(&bs, 0, TEST_WIDTH, 1);
+  test_check(&bs);
+  test_set_range(&bs, 1, TEST_WIDTH - 2, 0);
+  test_check(&bs);
+  test_ranges(&bs, 400, 400);
+
+  /* A clear of a range holding every bit set frees everything at once, the
+   * bits set outside of a range have to survive its clear. */
+  test_set_range(&bs, 0, TEST_WIDTH, 0);
+  test_set_range(&bs, 100, 5000, 1);
+  test_set_range(&bs, 3 * FBS_CHUNK_BITS, 70, 1);
+  test_set_range(&bs, 50, 4 * FBS_CHUNK_BITS, 0);
+  assert(bf_fbs_pop_count(&bs) == 0);
+  test_check(&bs);
+  test_set_range(&bs, 10, 5, 1);
+  test_set_range(&bs, 2000, 3000, 1);
+  test_set_range(&bs, 0, 20, 0);
+  test_check(&bs);
+  test_set_range(&bs, 1999, 3001, 0);
+  test_check(&bs);
+  test_set_range(&bs, 7, 1, 1);
+  test_set_range(&bs, 3000, 100, 1);
+  test_set_range(&bs, 1000, 3000, 0);
+  test_check(&bs);
+  bf_fbs_destroy(&bs);
+
+  /* The searches with the run index, built on an empty bitset and kept up
+   * to date, or built from the bits set part way through. */
+  memset(test_model, 0, sizeof(test_model));
+  bf_fbs_init(&bs, TEST_WIDTH);
+  test_ranges(&bs, 400, 0);
+  test_set_range(&bs, 0, TEST_WIDTH, 0);
+  test_check(&bs);
+  test_set_range(&bs, TEST_WIDTH / 2, 1, 1);
+  test_set_range(&bs, 0, TEST_WIDTH, 1);
+  test_check(&bs);
+  bf_fbs_destroy(&bs);
+
+  memset(test_model, 0, sizeof(test_model));
+  bf_fbs_init(&bs, TEST_WIDTH);
+  test_ranges(&bs, 400, 200);
+  bf_fbs_destroy(&bs);
+
+  /* Adaptive bitsets. A chunk moves to words at the first check with
+   * FBS_DENSE_MIN bits set in it, and back to Judy below FBS_SPARSE_MIN. */
+  memset(test_model, 0, sizeof(test_model));
+  bf_fbs_init_adaptive(&bs, TEST_WIDTH);
+  base = FBS_CHUNK_BITS;
+  for (i = 0; !fbs_dense(&bs, 1); i++) {
+    assert(i < FBS_DENSE_MIN + FBS_CHECK_SETS);
+    p = base + (i * 7) % FBS_CHUNK_BITS;
+    assert(!bf_fbs_set(&bs, p, 1));
+    test_model[p] = 1;
+  }
+  assert(i >= FBS_DENSE_MIN);
+  test_check(&bs);
+  while (i > FBS_SPARSE_MIN) {
+    i--;
+    p = base + (i * 7) % FBS_CHUNK_BITS;
+    assert(bf_fbs_set(&bs, p, 0));
+    test_model[p] = 0;
+    assert(fbs_dense(&bs, 1));
+  }
+  test_check(&bs);
+  p = base + (--i * 7) % FBS_CHUNK_BITS;
+  assert(bf_fbs_set(&bs, p, 0));
+  test_model[p] = 0;
+  assert(!fbs_dense(&bs, 1));
+  test_check(&bs);
+
+  /* Searches through a dense chunk into the chunks in Judy on either side,
+   * with the dense chunk full and then with a few bits clear. */
+  test_set_range(&bs, 2 * FBS_CHUNK_BITS, FBS_CHUNK_BITS, 1);
+  test_set_range(&bs, 3 * FBS_CHUNK_BITS + 10, 3, 1);
+  assert(fbs_dense(&bs, 2) && !fbs_dense(&bs, 3));
+  for (k = 0; k < 2; k++) {
+    for (p = -1; p < 4; p++) {
+      test_search(&bs, 2 * FBS_CHUNK_BITS + p);
+      test_search(&bs, 3 * FBS_CHUNK_BITS + p);
+    }
+    test_search(&bs, 2 * FBS_CHUNK_BITS + 100);
+    test_search(&bs, 3 * FBS_CHUNK_BITS + 100);
+    test_check(&bs);
+    test_set_range(&bs, 2 * FBS_CHUNK_BITS + 1, 2, 0);
+    test_set_range(&bs, 3 * FBS_CHUNK_BITS - 7, 6, 0);
+  }
+  bf_fbs_destroy(&bs);
+
+  memset(test_model, 0, sizeof(test_model));
+  bf_fbs_init_adaptive(&bs, TEST_WIDTH);
+  test_ranges(&bs, 400, 200);
+  bf_fbs_destroy(&bs);
+  return 0;
+}
+
+#endif
@@ -29,6 +29,7 @@
 #include <target-sys/bf_sal/bf_sys_intf.h>
 #include <target-utils/id/id.h>
 #include <Judy.h>
+#include "../runs_index.h"
 
 //#define BF_ID_ALLOCATOR_TEST 1
 
@@ -40,21 +41,383 @@ typedef struct bf_id_allocator_int {
   Pvoid_t PJ1Array;
   uint32_t size;
   bool zero_based;
+  bf_id_allocator_engine_t engine;
+  /* Dense engine state. One bit per id in words, set when the id is
+   * allocated. The bits past size in the last word are kept set. One bit per
+   * word in full, set when the word has no free id, the bits past num_words
+   * are kept set as well. Both live in a single buffer.
+   */
+  uint64_t *words;
+  uint64_t *full;
+  uint32_t num_words;
+  uint32_t num_full;
+  uint32_t cursor;  // Id the next allocation search starts from
+  uint32_t used;    // Number of ids set, padding excluded
+  /* Free run index, built on the first range allocation and kept up to date
+   * from then on. free_runs maps the first id of every free run below size
+   * to its length, run_sizes maps a length to a Judy1 array of the first ids
+   * of the runs of that length.
+   */
+  Pvoid_t free_runs;
+  Pvoid_t run_sizes;
+  bool runs_valid;
 } bf_id_allocator_int;
 
+static void bf_id_runs_update(bf_id_allocator_int *allocator,
+                              uint32_t start,
+                              uint32_t end,
+                              bool used);
+
+static inline uint64_t bf_id_dense_mask(uint32_t offset, uint32_t count) {
+  return ((count == 64) ? ~0ULL : ((1ULL << count) - 1)) << offset;
+}
+
+/* Sets or clears count bits of the dense words from start, a word at a
+ * time, keeping the full summary in sync.
+ */
+static void bf_id_dense_fill(bf_id_allocator_int *allocator,
+                             uint32_t start,
+                             uint32_t count,
+                             bool set) {
+  uint32_t w, n;
+  uint64_t mask;
+
+  bf_id_runs_update(allocator, start, start + count, set);
+
+  while (count) {
+    w = start >> 6;
+    n = 64 - (start & 63);
+    if (n > count) {
+      n = count;
+    }
+    mask = bf_id_dense_mask(start & 63, n);
+    if (set) {
+      allocator->used += __builtin_popcountll(mask & ~allocator->words[w]);
+      allocator->words[w] |= mask;
+    } else {
+      allocator->used -= __builtin_popcountll(mask & allocator->words[w]);
+      allocator->words[w] &= ~mask;
+    }
+    if (allocator->words[w] == ~0ULL) {
+      allocator->full[w >> 6] |= 1ULL << (w & 63);
+    } else {
+      allocator->full[w >> 6] &= ~(1ULL << (w & 63));
+    }
+    start += n;
+    count -= n;
+  }
+}
+
+/* First free id at or after id, -1 if none */
+static uint32_t bf_id_dense_next_free(bf_id_allocator_int *allocator,
+                                      uint32_t id) {
+  uint32_t w, sw;
+  uint64_t x;
+
+  if (id >= allocator->size) {
+    return -1;
+  }
+  w = id >> 6;
+  x = ~allocator->words[w] & (~0ULL << (id & 63));
+  if (x) {
+    return (w << 6) + __builtin_ctzll(x);
+  }
+  /* Skip the full words through the summary */
+  w++;
+  if (w >= allocator->num_words) {
+    return -1;
+  }
+  sw = w >> 6;
+  x = ~allocator->full[sw] & (~0ULL << (w & 63));
+  while (!x) {
+    if (++sw >= allocator->num_full) {
+      return -1;
+    }
+    x = ~allocator->full[sw];
+  }
+  w = (sw << 6) + __builtin_ctzll(x);
+  return (w << 6) + __builtin_ctzll(~allocator->words[w]);
+}
+
+/* First allocated id in [id, limit), limit if none */
+static uint32_t bf_id_dense_next_used(bf_id_allocator_int *allocator,
+                                      uint32_t id,
+                                      uint32_t limit) {
+  uint32_t w;
+  uint64_t x;
+
+  if (id >= limit) {
+    return limit;
+  }
+  w = id >> 6;
+  x = allocator->words[w] & (~0ULL << (id & 63));
+  while (!x) {
+    w++;
+    if ((w << 6) >= limit) {
+      return limit;
+    }
+    x = allocator->words[w];
+  }
+  id = (w << 6) + __builtin_ctzll(x);
+  return (id < limit) ? id : limit;
+}
+
+/* Lowest id in [from, limit) starting count free ids, -1 if none */
+static uint32_t bf_id_dense_find_run(bf_id_allocator_int *allocator,
+                                     uint32_t from,
+                                     uint32_t limit,
+                                     uint32_t count) {
+  uint32_t id = from, used;
+
+  while (1) {
+    id = bf_id_dense_next_free(allocator, id);
+    if (id == (uint32_t)-1 || id >= limit ||
+        (uint64_t)id + count > allocator->size) {
+      return -1;
+    }
+    used = bf_id_dense_next_used(allocator, id, id + count);
+    if (used == id + count) {
+      return id;
+    }
+    id = used;
+  }
+}
+
+static int bf_id_dense_allocate(bf_id_allocator_int *allocator,
+                                uint32_t count) {
+  uint32_t id;
+
+  if (count == 0 || count > allocator->size) {
+    return -1;
+  }
+  /* Next fit, wrapping around to the ids before the cursor */
+  id = bf_id_dense_find_run(
+      allocator, allocator->cursor, allocator->size, count);
+  if (id == (uint32_t)-1) {
+    id = bf_id_dense_find_run(allocator, 0, allocator->cursor, count);
+    if (id == (uint32_t)-1) {
+      return -1;
+    }
+  }
+  bf_id_dense_fill(allocator, id, count, true);
+  allocator->cursor = id + count;
+  if (allocator->cursor >= allocator->size) {
+    allocator->cursor = 0;
+  }
+
+  if (allocator->zero_based == true) {
+    return id;
+  }
+  return id + 1;
+}
+
+/* Drops the free run index, it is rebuilt on the next range allocation */
+static void bf_id_runs_clear(bf_id_allocator_int *allocator) {
+  bf_runs_clear(&allocator->free_runs, &allocator->run_sizes);
+  allocator->runs_valid = false;
+}
+
+/* Ids [start, end) were set (used) or released */
+static void bf_id_runs_update(bf_id_allocator_int *allocator,
+                              uint32_t start,
+                              uint32_t end,
+                              bool used) {
+  if (!allocator->runs_valid) {
+    return;
+  }
+  if (end > allocator->size) {
+    end = allocator->size;
+  }
+  if (start >= end) {
+    return;
+  }
+  if (bf_runs_update(
+          &allocator->free_runs, &allocator->run_sizes, start, end, used)) {
+    allocator->runs_valid = false;
+  }
+}
+
+static int bf_id_runs_build(bf_id_allocator_int *allocator) {
+  Word_t start = 0, end;
+  int Rc_int;
+
+  while (1) {
+    if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+      start = bf_id_dense_next_free(allocator, start);
+      if (start == (uint32_t)-1) {
+        break;
+      }
+      end = bf_id_dense_next_used(allocator, start, allocator->size);
+    } else {
+      J1FE(Rc_int, allocator->PJ1Array, start);
+      if (!Rc_int || start >= allocator->size) {
+        break;
+      }
+      end = start;
+      J1N(Rc_int, allocator->PJ1Array, end);
+      if (!Rc_int || end > allocator->size) {
+        end = allocator->size;
+      }
+    }
+    if (bf_runs_add(&allocator->free_runs,
+                    &allocator->run_sizes,
+                    start,
+                    end - start)) {
+      bf_id_runs_clear(allocator);
+      return -1;
+    }
+    if (end >= allocator->size) {
+      break;
+    }
+    start = end;
+  }
+  allocator->runs_valid = true;
+  return 0;
+}
+
+/* First id of count free ids aligned to align in the free run picked by fit,
+ * -1 if none. Both visit the runs by length from count up, so runs shorter
+ * than count are never looked at, and skip the runs too short once aligned.
+ */
+static uint32_t bf_id_runs_find(bf_id_allocator_int *allocator,
+                                uint32_t count,
+                                uint32_t align,
+                                bf_id_allocator_fit_t fit) {
+  PWord_t Pstarts;
+  Word_t len = count;
+  Word_t index, aligned;
+  Word_t best = -1;
+  uint32_t best_aligned = -1;
+  int Rc_int;
+
+  if (fit == BF_ID_ALLOCATOR_BEST_FIT) {
+    JLF(Pstarts, allocator->run_sizes, len);
+    while (Pstarts) {
+      index = 0;
+      J1F(Rc_int, *(Pvoid_t *)Pstarts, index);
+      while (Rc_int) {
+        aligned = (index + align - 1) / align * align;
+        if (aligned + count <= index + len) {
+          return aligned;
+        }
+        J1N(Rc_int, *(Pvoid_t *)Pstarts, index);
+      }
+      JLN(Pstarts, allocator->run_sizes, len);
+    }
+    return -1;
+  }
+
+  /* Lowest fitting run of every length, only looking below the best so far */
+  JLF(Pstarts, allocator->run_sizes, len);
+  while (Pstarts) {
+    index = 0;
+    J1F(Rc_int, *(Pvoid_t *)Pstarts, index);
+    while (Rc_int && index < best) {
+      aligned = (index + align - 1) / align * align;
+      if (aligned + count <= index + len) {
+        best = index;
+        best_aligned = aligned;
+        break;
+      }
+      J1N(Rc_int, *(Pvoid_t *)Pstarts, index);
+    }
+    JLN(Pstarts, allocator->run_sizes, len);
+  }
+  return best_aligned;
+}
+
+static int bf_id_allocate_range_int(bf_id_allocator_int *allocator,
+                                    uint32_t count,
+                                    uint32_t align,
+                                    bf_id_allocator_fit_t fit) {
+  uint32_t id;
+  Word_t index;
+  int Rc_int;
+
+  if (count == 0 || count > allocator->size || align == 0) {
+    return -1;
+  }
+  if (!allocator->runs_valid && bf_id_runs_build(allocator)) {
+    return -1;
+  }
+  id = bf_id_runs_find(allocator, count, align, fit);
+  if (id == (uint32_t)-1) {
+    return -1;
+  }
+
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    bf_id_dense_fill(allocator, id, count, true);
+  } else {
+    for (index = id; index < (Word_t)id + count; index++) {
+      J1S(Rc_int, allocator->PJ1Array, index);
+      if (Rc_int == JERR) {
+        while (index-- > id) {
+          J1U(Rc_int, allocator->PJ1Array, index);
+        }
+        return -1;
+      }
+    }
+    bf_id_runs_update(allocator, id, id + count, true);
+  }
+
+  if (allocator->zero_based == true) {
+    return id;
+  }
+  return id + 1;
+}
+
 /**
 Create the ID allocator
 @param initial_size the initial size of allocator
 */
 bf_id_allocator *bf_id_allocator_new(unsigned int initial_size,
                                      bool zero_based) {
+  return bf_id_allocator_new_engine(
+      initial_size, zero_based, BF_ID_ALLOCATOR_ENGINE_JUDY);
+}
+
+/**
+Create the ID allocator backed by the given engine
+@param initial_size the initial size of allocator
+@param zero_based whether the ids start at 0 rather than 1
+@param engine the engine keeping the allocated ids
+*/
+bf_id_allocator *bf_id_allocator_new_engine(unsigned int initial_size,
+                                            bool zero_based,
+                                            bf_id_allocator_engine_t engine) {
   bf_id_allocator_int *allocator =
-      (bf_id_allocator_int *)bf_sys_malloc(sizeof(bf_id_allocator_int) * 1);
+      (bf_id_allocator_int *)bf_sys_calloc(1, sizeof(bf_id_allocator_int));
+  if (allocator == NULL) {
+    return NULL;
+  }
   allocator->zero_based = zero_based;
   allocator->size = initial_size;
+  allocator->engine = engine;
   /* Initialize the Judy array */
   allocator->PJ1Array = (Pvoid_t)NULL;
 
+  if (engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    allocator->num_words = (initial_size + 63) / 64;
+    allocator->num_full = (allocator->num_words + 63) / 64;
+    allocator->words = (uint64_t *)bf_sys_calloc(
+        allocator->num_words + allocator->num_full + 1, sizeof(uint64_t));
+    if (allocator->words == NULL) {
+      bf_sys_free(allocator);
+      return NULL;
+    }
+    allocator->full = allocator->words + allocator->num_words;
+    /* Padding past the last id and the last word is never free */
+    if (initial_size & 63) {
+      bf_id_dense_fill(
+          allocator, initial_size, 64 - (initial_size & 63), true);
+    }
+    if (allocator->num_words & 63) {
+      allocator->full[allocator->num_full - 1] |=
+          ~0ULL << (allocator->num_words & 63);
+    }
+    allocator->used = 0;
+  }
+
   return (bf_id_allocator)allocator;
 }
 /**
@@ -66,110 +429,68 @@ void bf_id_allocator_destroy(bf_id_allocator *allocator) {
   /* Free the Judy array */
   J1FA(Rc_word, ((bf_id_allocator_int *)allocator)->PJ1Array);
   (void)Rc_word;
+  if (((bf_id_allocator_int *)allocator)->words) {
+    bf_sys_free(((bf_id_allocator_int *)allocator)->words);
+  }
+  bf_id_runs_clear((bf_id_allocator_int *)allocator);
   bf_sys_free(allocator);
 }
 
 /**
-Allocate count contiguous ids (max 32)
+Allocate count contiguous ids (max 255)
 @param allocator allocator created with create
 @param count number of contiguous ids to allocate
 */
 int bf_id_allocator_allocate_contiguous(bf_id_allocator *a, uint8_t count) {
   bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
-  unsigned int i;
   int Rc_int;
   Word_t first_empty = 0;
-  Word_t next_set = 0;
-  Word_t Index = 0;
 
   bf_sys_assert(allocator != NULL);
 
-  Index = 0;
-
-  /* Get the first empty slot : Thanks Judy :-) */
-  if (Index == 0) {
-    J1FE(Rc_int, allocator->PJ1Array, Index);
-  } else {
-    J1NE(Rc_int, allocator->PJ1Array, Index);
-  }
-
-  if (Rc_int == 0) {
-    return -1;
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    return bf_id_dense_allocate(allocator, count);
   }
-
-  if (Index >= allocator->size) {
-    /* If free index returned exceeds the size of the allocator,
-     * then need to wrap around.
-     */
-
-    Index = 0;
-    J1FE(Rc_int, allocator->PJ1Array, Index);
+  if (count != 1) {
+    return bf_id_allocate_range_int(
+        allocator, count, 1, BF_ID_ALLOCATOR_FIRST_FIT);
   }
 
-  first_empty = Index;
-
-  if (first_empty >= allocator->size) {
+  /* Get the first empty slot : Thanks Judy :-) */
+  J1FE(Rc_int, allocator->PJ1Array, first_empty);
+  if (Rc_int == 0 || first_empty >= allocator->size) {
     /* Nothing available */
     return -1;
   }
 
-  if (count == 1) {
-    J1S(Rc_int, allocator->PJ1Array, first_empty);
-
-    if (allocator->zero_based == true) {
-      return first_empty;
-    }
-
-    return first_empty + 1;
-  }
-
-  /* Get next bit set */
-  J1N(Rc_int, allocator->PJ1Array, Index);
-
-  if (Rc_int == 0) {
-    /* No set Bits, which means the Judy array is empty from the
-     * "first_empty" position.
-     */
-    next_set = allocator->size;
-  } else {
-    next_set = Index;
-  }
-
-  while (next_set - first_empty < count) {
-    Index = next_set;
-    J1FE(Rc_int, allocator->PJ1Array, Index);
-
-    if (Rc_int == 0) {
-      return -1;
-    }
-    first_empty = Index;
-
-    J1N(Rc_int, allocator->PJ1Array, Index);
-
-    if (Rc_int == 0) {
-      /* Check if there are enough */
-      if (allocator->size - Index < count) {
-        return -1;
-      }
-    } else {
-      next_set = Index;
-    }
-  }
-
-  if (first_empty > allocator->size) {
-    return -1;
-  }
-
-  /* Set the bit(s) now in the Judy array */
-  for (i = 0; i < count; i++) {
-    J1S(Rc_int, allocator->PJ1Array, first_empty + i);
-  }
+  J1S(Rc_int, allocator->PJ1Array, first_empty);
+  bf_id_runs_update(allocator, first_empty, first_empty + 1, true);
 
   if (allocator->zero_based == true) {
     return first_empty;
   }
 
-  return (first_empty + 1);
+  return first_empty + 1;
+}
+
+/**
+Allocate count contiguous ids
+@param allocator allocator created with create
+@param count number of contiguous ids to allocate
+@param align the offset of the first id from the first id of the allocator
+is a multiple of align, 1 for no alignment
+@param fit whether to take the ids from the lowest free run they fit in or
+from the shortest one
+@return the first id, -1 if no free run fits
+*/
+int bf_id_allocator_allocate_range(bf_id_allocator *a,
+                                   uint32_t count,
+                                   uint32_t align,
+                                   bf_id_allocator_fit_t fit) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+
+  bf_sys_assert(allocator != NULL);
+  return bf_id_allocate_range_int(allocator, count, align, fit);
 }
 
 /**
@@ -196,13 +517,19 @@ void bf_id_allocator_release(bf_id_allocator *a, unsigned int id) {
     id = id - 1;
   }
 
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    bf_sys_assert(id < allocator->size);
+    if (id < allocator->size) {
+      bf_id_dense_fill(allocator, id, 1, false);
+    }
+    return;
+  }
+
   /* JUdy Unset */
   J1U(Rc_int, allocator->PJ1Array, id);
 
   if (Rc_int == 1) {
-    /* Get around set but not used compile error :D
-     * CRINGE.
-     */
+    bf_id_runs_update(allocator, id, id + 1, false);
   }
 }
 
@@ -223,14 +550,179 @@ void bf_id_allocator_set(bf_id_allocator *a, unsigned int id) {
     id = id - 1;
   }
 
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    bf_sys_assert(id < allocator->size);
+    if (id < allocator->size) {
+      bf_id_dense_fill(allocator, id, 1, true);
+    }
+    return;
+  }
+
   /* Judy Set */
   J1S(Rc_int, allocator->PJ1Array, id);
 
   if (Rc_int == 1) {
-    /* Get around set but not used compile error :D
-     * CRINGE.
-     */
+    bf_id_runs_update(allocator, id, id + 1, true);
+  }
+}
+
+/**
+Set count allocated ids from id
+@param allocator allocator created with create
+@param id first id to set
+@param count number of ids to set
+@return 0 on success, -1 if the range is invalid
+*/
+int bf_id_allocator_set_range(bf_id_allocator *a,
+                              unsigned int id,
+                              unsigned int count) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+  Word_t index;
+  int Rc_int;
+
+  bf_sys_assert(allocator != NULL);
+
+  if (allocator->zero_based != true) {
+    if (id < 1) {
+      return -1;
+    }
+    id = id - 1;
+  }
+  if ((uint64_t)id + count > UINT32_MAX + 1ULL) {
+    return -1;
+  }
+
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    if ((uint64_t)id + count > allocator->size) {
+      return -1;
+    }
+    bf_id_dense_fill(allocator, id, count, true);
+    return 0;
+  }
+
+  /* Judy1 has no range insert, its leaves pack dense ranges into bitmaps */
+  for (index = id; index < (Word_t)id + count; index++) {
+    J1S(Rc_int, allocator->PJ1Array, index);
+    if (Rc_int == JERR) {
+      bf_id_runs_update(allocator, id, index, true);
+      return -1;
+    }
+  }
+  bf_id_runs_update(allocator, id, index, true);
+  return 0;
+}
+
+/**
+Free count allocated ids from id
+@param allocator allocator created with create
+@param id first id to be freed up
+@param count number of ids to free
+@return 0 on success, -1 if the range is invalid
+*/
+int bf_id_allocator_release_range(bf_id_allocator *a,
+                                  unsigned int id,
+                                  unsigned int count) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+  Word_t index;
+  Word_t end;
+  Word_t pop;
+  int Rc_int;
+
+  bf_sys_assert(allocator != NULL);
+
+  if (allocator->zero_based != true) {
+    if (id < 1) {
+      return -1;
+    }
+    id = id - 1;
+  }
+  if ((uint64_t)id + count > UINT32_MAX + 1ULL) {
+    return -1;
+  }
+
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    if ((uint64_t)id + count > allocator->size) {
+      return -1;
+    }
+    bf_id_dense_fill(allocator, id, count, false);
+    return 0;
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+  /* Unset the whole range when mostly set, only visit the ids that are set
+   * otherwise.
+   */
+  end = (Word_t)id + count;
+  J1C(pop, allocator->PJ1Array, id, end - 1);
+  if (pop >= count / 2) {
+    for (index = id; index < end; index++) {
+      J1U(Rc_int, allocator->PJ1Array, index);
+    }
+  } else {
+    index = id;
+    J1F(Rc_int, allocator->PJ1Array, index);
+    while (Rc_int && index < end) {
+      J1U(Rc_int, allocator->PJ1Array, index);
+      J1N(Rc_int, allocator->PJ1Array, index);
+    }
+  }
+  bf_id_runs_update(allocator, id, end, false);
+  return 0;
+}
+
+/**
+  Number of allocated ids
+  @param allocator allocator created with create
+  */
+unsigned int bf_id_allocator_count(bf_id_allocator *a) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+  Word_t Rc_word;
+
+  bf_sys_assert(allocator != NULL);
+
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    return allocator->used;
+  }
+  /* Judy1 keeps the population of every subtree, this is not a walk */
+  J1C(Rc_word, allocator->PJ1Array, 0, -1);
+  return Rc_word;
+}
+
+/**
+  Allocated ids over the size of the allocator
+  @param allocator allocator created with create
+  */
+double bf_id_allocator_density(bf_id_allocator *a) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+
+  bf_sys_assert(allocator != NULL);
+  if (allocator->size == 0) {
+    return 0;
+  }
+  return (double)bf_id_allocator_count(a) / allocator->size;
+}
+
+/**
+  Bytes of memory allocated by the allocator
+  @param allocator allocator created with create
+  */
+size_t bf_id_allocator_memory_used(bf_id_allocator *a) {
+  bf_id_allocator_int *allocator = (bf_id_allocator_int *)a;
+  Word_t Rc_word;
+  size_t bytes = sizeof(bf_id_allocator_int);
+
+  bf_sys_assert(allocator != NULL);
+
+  if (allocator->words) {
+    bytes += (allocator->num_words + allocator->num_full + 1) *
+             sizeof(uint64_t);
   }
+  J1MU(Rc_word, allocator->PJ1Array);
+  bytes += Rc_word;
+  bytes += bf_runs_memory_used(&allocator->free_runs, &allocator->run_sizes);
+  return bytes;
 }
 
 /**
@@ -249,6 +741,12 @@ int bf_id_allocator_is_set(bf_id_allocator *a, unsigned int id) {
     }
     id = id - 1;
   }
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    if (id >= allocator->size) {
+      return 0;
+    }
+    return (allocator->words[id >> 6] >> (id & 63)) & 1;
+  }
   J1T(Rc_int, allocator->PJ1Array, id);
 
   return (Rc_int == 1 ? 1 : 0);
@@ -267,10 +765,17 @@ int bf_id_allocator_get_first(bf_id_allocator *a) {
     return -1;
   }
   bf_sys_assert(allocator != NULL);
-  J1F(Rc_int, allocator->PJ1Array, wd_id);
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    wd_id = bf_id_dense_next_used(allocator, 0, allocator->size);
+    Rc_int = wd_id < allocator->size;
+  } else {
+    J1F(Rc_int, allocator->PJ1Array, wd_id);
+  }
   if (Rc_int) {
     if (allocator->zero_based != true) {
       id = wd_id + 1;
+    } else {
+      id = wd_id;
     }
   } else {
     id = -1;
@@ -299,7 +804,17 @@ int bf_id_allocator_get_next(bf_id_allocator *a, unsigned int id) {
       return -1;
     }
   }
-  J1N(Rc_int, allocator->PJ1Array, curr_id);
+  if (allocator->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    if (curr_id + 1 < allocator->size) {
+      curr_id =
+          bf_id_dense_next_used(allocator, curr_id + 1, allocator->size);
+    } else {
+      curr_id = allocator->size;
+    }
+    Rc_int = curr_id < allocator->size;
+  } else {
+    J1N(Rc_int, allocator->PJ1Array, curr_id);
+  }
   if (Rc_int) {
     if (allocator->zero_based != true) {
       id_next = curr_id + 1;
@@ -314,15 +829,64 @@ int bf_id_allocator_get_next(bf_id_allocator *a, unsigned int id) {
 }
 
 /**
-Copy an id-allocator from a src allocator to a dst allocator
+Copy an id-allocator from a src allocator to a dst allocator. The dst
+allocator takes the size, base and engine of the src allocator. The dense
+engine state is copied with a memcpy, the Judy1 array is rebuilt in id order.
+dst is left unchanged if memory runs out.
 @param src_allocator Source allocator
 @param dst_allocator Destination allocator
 */
 void bf_id_allocator_copy(bf_id_allocator *dst_allocator,
                           bf_id_allocator *src_allocator) {
-  (void)dst_allocator;
-  (void)src_allocator;
-  return;
+  bf_id_allocator_int *dst = (bf_id_allocator_int *)dst_allocator;
+  bf_id_allocator_int *src = (bf_id_allocator_int *)src_allocator;
+  Pvoid_t PJ1Array = (Pvoid_t)NULL;
+  uint64_t *words = NULL;
+  Word_t Rc_word;
+  Word_t index = 0;
+  size_t len;
+  int Rc_int;
+
+  if (dst == NULL || src == NULL || dst == src) {
+    return;
+  }
+
+  if (src->engine == BF_ID_ALLOCATOR_ENGINE_DENSE) {
+    len = (src->num_words + src->num_full + 1) * sizeof(uint64_t);
+    words = (uint64_t *)bf_sys_malloc(len);
+    if (words == NULL) {
+      return;
+    }
+    memcpy(words, src->words, len);
+  } else {
+    /* Ascending inserts keep the Judy1 walk cache friendly */
+    J1F(Rc_int, src->PJ1Array, index);
+    while (Rc_int) {
+      J1S(Rc_int, PJ1Array, index);
+      if (Rc_int == JERR) {
+        J1FA(Rc_word, PJ1Array);
+        return;
+      }
+      J1N(Rc_int, src->PJ1Array, index);
+    }
+  }
+
+  J1FA(Rc_word, dst->PJ1Array);
+  (void)Rc_word;
+  if (dst->words) {
+    bf_sys_free(dst->words);
+  }
+  bf_id_runs_clear(dst);
+  dst->PJ1Array = PJ1Array;
+  dst->words = words;
+  dst->full = words ? words + src->num_words : NULL;
+  dst->num_words = src->num_words;
+  dst->num_full = src->num_full;
+  dst->cursor = src->cursor;
+  dst->used = src->used;
+  dst->size = src->size;
+  dst->zero_based = src->zero_based;
+  dst->engine = src->engine;
 }
 
 #ifdef BF_ID_ALLOCATOR_TEST
@@ -331,42 +895,181 @@ void bf_id_allocator_copy(bf_id_allocator *dst_allocator,
 #define INITIAL_WORDS 4
 
 int id_main(int argc, char **argv) {
+  const bf_id_allocator_engine_t engines[] = {BF_ID_ALLOCATOR_ENGINE_JUDY,
+                                              BF_ID_ALLOCATOR_ENGINE_DENSE};
   unsigned int i;
   unsigned int iter;
-  bf_id_allocator *allocator = bf_id_allocator_new(INITIAL_WORDS * 32);
-
-  for (i = 0; i < 40; i++) bf_id_allocator_allocate(allocator);
-
-  printf("words are 0x%x, 0x%x\n",
-         (uint32_t)allocator->data[0],
-         (uint32_t)allocator->data[1]);
-
-  for (i = 0; i < 40; i++) bf_id_allocator_release(allocator, i + 1);
-
-  for (i = 0; i < MAX_ID_TEST; i++) {
-    unsigned int id = bf_id_allocator_allocate(allocator);
-    bf_sys_assert(id == i + 1);
-  }
+  size_t e;
+  int id;
+  bf_id_allocator *allocator, *copy;
+  bf_id_allocator_mt *mt;
+
+  (void)argc;
+  (void)argv;
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    allocator = bf_id_allocator_new_engine(MAX_ID_TEST, false, engines[e]);
+    bf_sys_assert(allocator);
+
+    for (i = 0; i < MAX_ID_TEST; i++) {
+      id = bf_id_allocator_allocate(allocator);
+      bf_sys_assert(id == (int)i + 1);
+    }
+    bf_sys_assert(bf_id_allocator_allocate(allocator) == (unsigned int)-1);
+    bf_sys_assert(bf_id_allocator_get_first(allocator) == 1);
+    bf_sys_assert(bf_id_allocator_get_next(allocator, 1) == 2);
+    bf_sys_assert(bf_id_allocator_get_next(allocator, MAX_ID_TEST) == -1);
+
+    for (i = 0; i < 40; i++) bf_id_allocator_release(allocator, i + 100);
+    for (i = 0; i < 40; i++) {
+      id = bf_id_allocator_allocate(allocator);
+      bf_sys_assert(id >= 100 && id < 140);
+    }
 
-  for (i = 0; i < MAX_ID_TEST; i++) bf_id_allocator_release(allocator, i);
+    for (i = 0; i < MAX_ID_TEST; i++)
+      bf_id_allocator_release(allocator, i + 1);
+    bf_sys_assert(bf_id_allocator_get_first(allocator) == -1);
 
-  for (iter = 0; iter < MAX_ID_TEST; iter++) {
-    for (i = 0; i < 1000; i++) bf_id_allocator_allocate(allocator);
+    for (iter = 0; iter < 100; iter++) {
+      for (i = 0; i < 1000; i++)
+        bf_sys_assert(bf_id_allocator_allocate(allocator) != (unsigned int)-1);
 
-    for (i = 0; i < 1000; i++) bf_id_allocator_release(allocator, i);
-  }
+      for (i = 0; i < MAX_ID_TEST; i++)
+        bf_id_allocator_release(allocator, i + 1);
+    }
 
 #define NUM_BLOCKS 20
 #define BLOCK_SIZE 8
-  for (i = 0; i < NUM_BLOCKS; i++) {
-    unsigned int id =
-        bf_id_allocator_allocate_contiguous(allocator, BLOCK_SIZE);
-    printf("id = %d 0x%x\n", id, (uint32_t)allocator->data[i / 4]);
-  }
-  for (i = 1; i <= NUM_BLOCKS * BLOCK_SIZE; i++) {
-    bf_id_allocator_release(allocator, i);
+    for (i = 0; i < NUM_BLOCKS; i++) {
+      id = bf_id_allocator_allocate_contiguous(allocator, BLOCK_SIZE);
+      bf_sys_assert(id > 0);
+      bf_sys_assert(bf_id_allocator_is_set(allocator, id));
+      bf_sys_assert(bf_id_allocator_is_set(allocator, id + BLOCK_SIZE - 1));
+    }
+    bf_id_allocator_destroy(allocator);
+
+    /* Copies are independent of their source */
+    allocator = bf_id_allocator_new_engine(MAX_ID_TEST, true, engines[e]);
+    copy = bf_id_allocator_new_engine(10, false, engines[1 - e]);
+    bf_sys_assert(allocator && copy);
+    bf_id_allocator_set(copy, 3);
+    for (i = 0; i < 1000; i++) bf_id_allocator_set(allocator, i * 7);
+    bf_id_allocator_copy(copy, allocator);
+    bf_id_allocator_release(allocator, 7);
+    bf_sys_assert(bf_id_allocator_is_set(copy, 7));
+    bf_sys_assert(!bf_id_allocator_is_set(copy, 3));
+    bf_sys_assert(bf_id_allocator_get_first(copy) == 0);
+    id = 0;
+    for (i = 1; i < 1000; i++) {
+      id = bf_id_allocator_get_next(copy, id);
+      bf_sys_assert(id == (int)i * 7);
+    }
+    bf_sys_assert(bf_id_allocator_get_next(copy, id) == -1);
+    bf_sys_assert(bf_id_allocator_allocate(copy) != (unsigned int)-1);
+    bf_sys_assert(!bf_id_allocator_is_set(allocator, 7));
+    bf_id_allocator_destroy(allocator);
+    bf_sys_assert(bf_id_allocator_is_set(copy, 14));
+    bf_id_allocator_destroy(copy);
+
+    /* Ranges */
+    allocator = bf_id_allocator_new_engine(1000, false, engines[e]);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 0);
+    bf_sys_assert(bf_id_allocator_set_range(allocator, 0, 1) == -1);
+    bf_sys_assert(bf_id_allocator_set_range(allocator, 10, 200) == 0);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 200);
+    bf_id_allocator_set(allocator, 500);
+    bf_sys_assert(bf_id_allocator_set_range(allocator, 100, 20) == 0);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 201);
+    bf_sys_assert(bf_id_allocator_release_range(allocator, 50, 100) == 0);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 101);
+    bf_sys_assert(bf_id_allocator_is_set(allocator, 49));
+    bf_sys_assert(!bf_id_allocator_is_set(allocator, 50));
+    bf_sys_assert(!bf_id_allocator_is_set(allocator, 149));
+    bf_sys_assert(bf_id_allocator_is_set(allocator, 150));
+    bf_sys_assert(bf_id_allocator_release_range(allocator, 200, 801) == 0);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 90);
+    bf_sys_assert(bf_id_allocator_get_first(allocator) == 10);
+    bf_id_allocator_destroy(allocator);
+
+    /* Aligned ranges from the lowest or the shortest free run */
+    allocator = bf_id_allocator_new_engine(MAX_ID_TEST, true, engines[e]);
+    bf_sys_assert(bf_id_allocator_set_range(allocator, 0, 4096) == 0);
+    bf_id_allocator_release_range(allocator, 100, 3000);
+    bf_id_allocator_release_range(allocator, 3500, 500);
+    id = bf_id_allocator_allocate_range(
+        allocator, 400, 64, BF_ID_ALLOCATOR_BEST_FIT);
+    bf_sys_assert(id == 3520);
+    id = bf_id_allocator_allocate_range(
+        allocator, 400, 64, BF_ID_ALLOCATOR_FIRST_FIT);
+    bf_sys_assert(id == 128);
+    bf_sys_assert(bf_id_allocator_allocate_range(
+                      allocator, 2500, 1, BF_ID_ALLOCATOR_BEST_FIT) == 528);
+    id = bf_id_allocator_allocate_range(
+        allocator, 10000, 1024, BF_ID_ALLOCATOR_BEST_FIT);
+    bf_sys_assert(id == 4096);
+    bf_sys_assert(bf_id_allocator_count(allocator) == 4096 - 3500 + 13300);
+    /* Releases merge back into the runs the ids were taken from */
+    bf_id_allocator_release_range(allocator, 4096, 10000);
+    bf_id_allocator_release(allocator, 4095);
+    id = bf_id_allocator_allocate_range(
+        allocator, MAX_ID_TEST - 4095, 1, BF_ID_ALLOCATOR_BEST_FIT);
+    bf_sys_assert(id == 4095);
+    bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 28) == 100);
+    bf_sys_assert(bf_id_allocator_allocate_range(
+                      allocator, 1, 1, BF_ID_ALLOCATOR_FIRST_FIT) == 3028);
+    bf_id_allocator_destroy(allocator);
   }
 
+  /* Thread caches take and give back ids a magazine at a time */
+  mt = bf_id_allocator_mt_new(100, false, BF_ID_ALLOCATOR_ENGINE_JUDY, 8);
+  bf_sys_assert(mt);
+  for (i = 0; i < 100; i++) {
+    id = bf_id_allocator_mt_allocate(mt);
+    bf_sys_assert(id > 0 && id <= 100);
+    bf_sys_assert(bf_id_allocator_mt_is_set(mt, id));
+  }
+  bf_sys_assert(bf_id_allocator_mt_allocate(mt) == (unsigned int)-1);
+  for (i = 0; i < 20; i++) bf_id_allocator_mt_release(mt, i + 1);
+  /* Beyond two magazines a magazine went back */
+  bf_sys_assert(bf_id_allocator_mt_is_set(mt, 1));
+  bf_sys_assert(!bf_id_allocator_mt_is_set(mt, 9));
+  bf_sys_assert(!bf_id_allocator_mt_is_set(mt, 16));
+  bf_sys_assert(bf_id_allocator_mt_is_set(mt, 20));
+  bf_id_allocator_mt_flush(mt);
+  bf_sys_assert(!bf_id_allocator_mt_is_set(mt, 1));
+  bf_sys_assert(!bf_id_allocator_mt_is_set(mt, 20));
+  bf_id_allocator_mt_destroy(mt);
+
+  /* Double releases and ids out of range do not reach the caches */
+  mt = bf_id_allocator_mt_new(16, true, BF_ID_ALLOCATOR_ENGINE_JUDY, 4);
+  bf_sys_assert(mt);
+  id = bf_id_allocator_mt_allocate(mt);
+  bf_id_allocator_mt_release(mt, id);
+  bf_id_allocator_mt_release(mt, id);
+  bf_sys_assert(bf_id_allocator_mt_allocate(mt) == (unsigned int)id);
+  bf_sys_assert(bf_id_allocator_mt_allocate(mt) != (unsigned int)id);
+  bf_id_allocator_mt_release(mt, 1000);
+  bf_id_allocator_mt_release(mt, 16);
+  for (i = 0; i < 14; i++) {
+    id = bf_id_allocator_mt_allocate(mt);
+    bf_sys_assert(id >= 0 && id < 16);
+  }
+  bf_sys_assert(bf_id_allocator_mt_allocate(mt) == (unsigned int)-1);
+  bf_id_allocator_mt_destroy(mt);
+
+  /* Runs crossing words and the wrap around of the next fit cursor */
+  allocator =
+      bf_id_allocator_new_engine(130, true, BF_ID_ALLOCATOR_ENGINE_DENSE);
+  bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 60) == 0);
+  bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 10) == 60);
+  bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 61) == -1);
+  bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 60) == 70);
+  bf_sys_assert(bf_id_allocator_get_first(allocator) == 0);
+  for (i = 0; i < 60; i++) bf_id_allocator_release(allocator, i);
+  bf_sys_assert(bf_id_allocator_allocate(allocator) == 0);
+  bf_sys_assert(bf_id_allocator_allocate(allocator) == 1);
+  bf_sys_assert(bf_id_allocator_allocate_contiguous(allocator, 58) == 2);
+  bf_sys_assert(bf_id_allocator_allocate(allocator) == (unsigned int)-1);
+  bf_sys_assert(!bf_id_allocator_is_set(allocator, 130));
   bf_id_allocator_destroy(allocator);
   return 0;
 }
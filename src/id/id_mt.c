@@ -0,0 +1,542 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+//
+//  id_mt.c
+//
+//  Thread safe front end of the id allocator. Every thread allocates from
+//  and releases to a cache of its own, the shared allocator is only locked
+//  to move a magazine of ids between a cache and the pool.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <target-sys/bf_sal/bf_sys_intf.h>
+#include <target-utils/id/id.h>
+
+//#define BF_ID_ALLOCATOR_MT_BENCH 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+struct bf_id_allocator_mt_int;
+
+typedef struct bf_id_cache_s {
+  struct bf_id_allocator_mt_int *allocator;
+  struct bf_id_cache_s *prev;
+  struct bf_id_cache_s *next;
+  uint32_t count;
+  unsigned int ids[];  // Up to twice the magazine size
+} bf_id_cache_t;
+
+typedef struct bf_id_allocator_mt_int {
+  bf_id_allocator *pool;
+  bf_sys_mutex_t lock;   // Protects pool and caches
+  pthread_key_t key;     // Cache of the calling thread
+  bf_id_cache_t *caches; // All the caches, to free them on destroy
+  uint32_t magazine_size;
+  uint32_t size;
+  bool zero_based;
+  /* One byte per id, set while the id is held by a caller rather than free
+   * in the pool or in a cache. Changed with atomics, without the lock. Bytes
+   * rather than bits so that taking an id is a plain store and fewer ids of
+   * different threads share a cache line. */
+  uint8_t *held;
+} bf_id_allocator_mt_int;
+
+/* Marks the id as held, or as no longer held. Returns false when it was not
+ * held on release, or when the id is out of range. */
+static bool bf_id_mt_hold(bf_id_allocator_mt_int *allocator,
+                          unsigned int id,
+                          bool hold) {
+  if (allocator->zero_based != true) {
+    if (id < 1) {
+      return false;
+    }
+    id = id - 1;
+  }
+  if (id >= allocator->size) {
+    return false;
+  }
+  if (hold) {
+    /* The id comes from a cache, no other thread can hold it */
+    __atomic_store_n(&allocator->held[id], 1, __ATOMIC_RELAXED);
+    return true;
+  }
+  return __atomic_exchange_n(&allocator->held[id], 0, __ATOMIC_RELAXED);
+}
+
+/* Moves count ids from the top of the cache back to the pool */
+static void bf_id_cache_drain(bf_id_cache_t *cache, uint32_t count) {
+  bf_id_allocator_mt_int *allocator = cache->allocator;
+
+  bf_sys_mutex_lock(&allocator->lock);
+  while (count--) {
+    bf_id_allocator_release(allocator->pool, cache->ids[--cache->count]);
+  }
+  bf_sys_mutex_unlock(&allocator->lock);
+}
+
+/* Runs on thread exit, gives the ids cached by the thread back */
+static void bf_id_cache_exit(void *arg) {
+  bf_id_cache_t *cache = (bf_id_cache_t *)arg;
+  bf_id_allocator_mt_int *allocator = cache->allocator;
+
+  bf_id_cache_drain(cache, cache->count);
+  bf_sys_mutex_lock(&allocator->lock);
+  if (cache->prev) {
+    cache->prev->next = cache->next;
+  } else {
+    allocator->caches = cache->next;
+  }
+  if (cache->next) {
+    cache->next->prev = cache->prev;
+  }
+  bf_sys_mutex_unlock(&allocator->lock);
+  bf_sys_free(cache);
+}
+
+static bf_id_cache_t *bf_id_cache_get(bf_id_allocator_mt_int *allocator) {
+  bf_id_cache_t *cache;
+
+  cache = (bf_id_cache_t *)pthread_getspecific(allocator->key);
+  if (cache) {
+    return cache;
+  }
+  cache = (bf_id_cache_t *)bf_sys_calloc(
+      1,
+      sizeof(bf_id_cache_t) +
+          2 * allocator->magazine_size * sizeof(unsigned int));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->allocator = allocator;
+  if (pthread_setspecific(allocator->key, cache)) {
+    bf_sys_free(cache);
+    return NULL;
+  }
+  bf_sys_mutex_lock(&allocator->lock);
+  cache->next = allocator->caches;
+  if (cache->next) {
+    cache->next->prev = cache;
+  }
+  allocator->caches = cache;
+  bf_sys_mutex_unlock(&allocator->lock);
+  return cache;
+}
+
+/**
+Create a thread safe ID allocator
+@param initial_size the initial size of allocator
+@param zero_based whether the ids start at 0 rather than 1
+@param engine the engine of the shared allocator
+@param magazine_size the number of ids a thread takes from or gives back to
+the shared allocator at once. Every thread caches up to twice as many.
+*/
+bf_id_allocator_mt *bf_id_allocator_mt_new(unsigned int initial_size,
+                                           bool zero_based,
+                                           bf_id_allocator_engine_t engine,
+                                           unsigned int magazine_size) {
+  bf_id_allocator_mt_int *allocator;
+
+  if (magazine_size == 0) {
+    return NULL;
+  }
+  allocator = (bf_id_allocator_mt_int *)bf_sys_calloc(
+      1, sizeof(bf_id_allocator_mt_int));
+  if (allocator == NULL) {
+    return NULL;
+  }
+  allocator->magazine_size = magazine_size;
+  allocator->size = initial_size;
+  allocator->zero_based = zero_based;
+  allocator->held = (uint8_t *)bf_sys_calloc(initial_size + 1, 1);
+  if (allocator->held == NULL) {
+    bf_sys_free(allocator);
+    return NULL;
+  }
+  allocator->pool =
+      bf_id_allocator_new_engine(initial_size, zero_based, engine);
+  if (allocator->pool == NULL) {
+    bf_sys_free(allocator->held);
+    bf_sys_free(allocator);
+    return NULL;
+  }
+  if (pthread_key_create(&allocator->key, bf_id_cache_exit)) {
+    bf_id_allocator_destroy(allocator->pool);
+    bf_sys_free(allocator->held);
+    bf_sys_free(allocator);
+    return NULL;
+  }
+  bf_sys_mutex_init(&allocator->lock);
+  return (bf_id_allocator_mt)allocator;
+}
+
+/**
+Delete the thread safe ID allocator. No thread may use it any more.
+@param allocator allocator allocated with create
+*/
+void bf_id_allocator_mt_destroy(bf_id_allocator_mt *a) {
+  bf_id_allocator_mt_int *allocator = (bf_id_allocator_mt_int *)a;
+  bf_id_cache_t *cache;
+
+  if (allocator == NULL) {
+    return;
+  }
+  /* Once the key is deleted the caches are no longer freed on thread exit */
+  pthread_key_delete(allocator->key);
+  while (allocator->caches) {
+    cache = allocator->caches;
+    allocator->caches = cache->next;
+    bf_sys_free(cache);
+  }
+  bf_sys_mutex_del(&allocator->lock);
+  bf_id_allocator_destroy(allocator->pool);
+  bf_sys_free(allocator->held);
+  bf_sys_free(allocator);
+}
+
+/**
+Allocate an id. The id comes from the cache of the calling thread, which is
+refilled with a magazine of ids from the shared allocator when empty. Ids
+cached by other threads are not handed out, so this can fail while the
+allocator is not full.
+@param allocator allocator created with create
+@return the id, -1 if none is available
+*/
+unsigned int bf_id_allocator_mt_allocate(bf_id_allocator_mt *a) {
+  bf_id_allocator_mt_int *allocator = (bf_id_allocator_mt_int *)a;
+  bf_id_cache_t *cache;
+  unsigned int id;
+
+  bf_sys_assert(allocator != NULL);
+  cache = bf_id_cache_get(allocator);
+  if (cache == NULL) {
+    return -1;
+  }
+  if (cache->count == 0) {
+    bf_sys_mutex_lock(&allocator->lock);
+    while (cache->count < allocator->magazine_size) {
+      id = bf_id_allocator_allocate(allocator->pool);
+      if (id == (unsigned int)-1) {
+        break;
+      }
+      cache->ids[cache->count++] = id;
+    }
+    bf_sys_mutex_unlock(&allocator->lock);
+    if (cache->count == 0) {
+      return -1;
+    }
+  }
+  id = cache->ids[--cache->count];
+  bf_id_mt_hold(allocator, id, true);
+  return id;
+}
+
+/**
+Free an allocated id. The id goes to the cache of the calling thread, a
+magazine of ids is given back to the shared allocator once the cache is
+full. Ids which are not held by a caller, because they were already
+released or were never allocated, are ignored so that they are not handed out
+twice.
+@param allocator allocator created with create
+@param id id to be freed up
+*/
+void bf_id_allocator_mt_release(bf_id_allocator_mt *a, unsigned int id) {
+  bf_id_allocator_mt_int *allocator = (bf_id_allocator_mt_int *)a;
+  bf_id_cache_t *cache;
+
+  bf_sys_assert(allocator != NULL);
+  if (!bf_id_mt_hold(allocator, id, false)) {
+    return;
+  }
+  cache = bf_id_cache_get(allocator);
+  if (cache == NULL) {
+    bf_sys_mutex_lock(&allocator->lock);
+    bf_id_allocator_release(allocator->pool, id);
+    bf_sys_mutex_unlock(&allocator->lock);
+    return;
+  }
+  if (cache->count == 2 * allocator->magazine_size) {
+    bf_id_cache_drain(cache, allocator->magazine_size);
+  }
+  cache->ids[cache->count++] = id;
+}
+
+/**
+Give the ids cached by the calling thread back to the shared allocator
+@param allocator allocator created with create
+*/
+void bf_id_allocator_mt_flush(bf_id_allocator_mt *a) {
+  bf_id_allocator_mt_int *allocator = (bf_id_allocator_mt_int *)a;
+  bf_id_cache_t *cache;
+
+  bf_sys_assert(allocator != NULL);
+  cache = (bf_id_cache_t *)pthread_getspecific(allocator->key);
+  if (cache && cache->count) {
+    bf_id_cache_drain(cache, cache->count);
+  }
+}
+
+/**
+  Checks if an id is allocated or not. Ids sitting in a thread cache count as
+  allocated.
+  @param allocator allocator created with create
+  @param id id to check
+  */
+int bf_id_allocator_mt_is_set(bf_id_allocator_mt *a, unsigned int id) {
+  bf_id_allocator_mt_int *allocator = (bf_id_allocator_mt_int *)a;
+  int rc;
+
+  bf_sys_assert(allocator != NULL);
+  bf_sys_mutex_lock(&allocator->lock);
+  rc = bf_id_allocator_is_set(allocator->pool, id);
+  bf_sys_mutex_unlock(&allocator->lock);
+  return rc;
+}
+
+#ifdef BF_ID_ALLOCATOR_MT_BENCH
+
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_POOL_SIZE (64 * 1024)
+#define BENCH_MAX_THREADS 16
+#define BENCH_OPS (1000 * 1000)
+#define BENCH_LIVE 64
+
+typedef struct bench_arg_s {
+  bf_id_allocator_mt *mt;
+  bf_id_allocator *st;
+  bf_sys_mutex_t *st_lock;
+} bench_arg_t;
+
+static void *bench_thread(void *p) {
+  bench_arg_t *arg = (bench_arg_t *)p;
+  unsigned int live[BENCH_LIVE];
+  unsigned int i;
+
+  for (i = 0; i < BENCH_OPS; i++) {
+    if (i >= BENCH_LIVE) {
+      if (arg->mt) {
+        bf_id_allocator_mt_release(arg->mt, live[i % BENCH_LIVE]);
+      } else {
+        bf_sys_mutex_lock(arg->st_lock);
+        bf_id_allocator_release(arg->st, live[i % BENCH_LIVE]);
+        bf_sys_mutex_unlock(arg->st_lock);
+      }
+    }
+    if (arg->mt) {
+      live[i % BENCH_LIVE] = bf_id_allocator_mt_allocate(arg->mt);
+    } else {
+      bf_sys_mutex_lock(arg->st_lock);
+      live[i % BENCH_LIVE] = bf_id_allocator_allocate(arg->st);
+      bf_sys_mutex_unlock(arg->st_lock);
+    }
+    bf_sys_assert(live[i % BENCH_LIVE] != (unsigned int)-1);
+  }
+  return NULL;
+}
+
+static double bench_run(bench_arg_t *arg, unsigned int threads) {
+  pthread_t tid[BENCH_MAX_THREADS];
+  struct timespec start, end;
+  unsigned int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < threads; i++) {
+    pthread_create(&tid[i], NULL, bench_thread, arg);
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)threads * BENCH_OPS /
+         ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+}
+
+/* Allocation throughput of the per thread caches against a single allocator
+ * behind a mutex, from 1 to max_threads threads, 0 for up to the number of
+ * cpus online. The speedups are over one thread of the same kind, so that
+ * scaling with cores shows on a host with enough of them.
+ */
+int id_mt_bench_main(unsigned int max_threads) {
+  bf_sys_mutex_t st_lock;
+  bench_arg_t arg;
+  unsigned int threads;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double mt_rate, st_rate, mt_base = 0, st_base = 0;
+
+  if (max_threads == 0) {
+    max_threads = cpus > 0 ? (unsigned int)cpus : 1;
+  }
+  if (max_threads > BENCH_MAX_THREADS) {
+    max_threads = BENCH_MAX_THREADS;
+  }
+  bf_sys_mutex_init(&st_lock);
+  printf("%ld cpus online\n", cpus);
+  printf("threads  mutex Mops/s  speedup  cached Mops/s  speedup\n");
+  for (threads = 1; threads <= max_threads; threads *= 2) {
+    memset(&arg, 0, sizeof(arg));
+    arg.st = bf_id_allocator_new(BENCH_POOL_SIZE, false);
+    arg.st_lock = &st_lock;
+    st_rate = bench_run(&arg, threads);
+    bf_id_allocator_destroy(arg.st);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.mt = bf_id_allocator_mt_new(
+        BENCH_POOL_SIZE, false, BF_ID_ALLOCATOR_ENGINE_JUDY, 32);
+    mt_rate = bench_run(&arg, threads);
+    bf_id_allocator_mt_destroy(arg.mt);
+
+    if (threads == 1) {
+      st_base = st_rate;
+      mt_base = mt_rate;
+    }
+    printf("%7u  %12.2f  %7.2f  %13.2f  %7.2f\n",
+           threads,
+           st_rate / 1e6,
+           st_rate / st_base,
+           mt_rate / 1e6,
+           mt_rate / mt_base);
+  }
+  bf_sys_mutex_del(&st_lock);
+  return 0;
+}
+
+#endif
+
+#ifdef BF_ID_ALLOCATOR_MT_TEST
+
+#define TEST_POOL_SIZE 96
+#define TEST_THREADS 4
+#define TEST_OPS (100 * 1000)
+#define TEST_LIVE 128
+
+typedef struct test_arg_s {
+  bf_id_allocator_mt *mt;
+  uint8_t self;
+} test_arg_t;
+
+/* Thread holding each id, 0 if none */
+static uint8_t test_owner[TEST_POOL_SIZE + 1];
+static unsigned int test_dry;  // Allocations that found no free id
+
+/* Allocates and releases ids at random, checking that no other thread holds
+ * an id it gets. Some releases are repeated, or of ids out of range, and
+ * must be ignored. Flushes now and then, and exits with ids still in its
+ * cache. */
+static void *test_thread(void *p) {
+  test_arg_t *arg = (test_arg_t *)p;
+  unsigned int seed = arg->self;
+  unsigned int live[TEST_LIVE];
+  unsigned int n = 0, i, k, id;
+
+  for (i = 0; i < TEST_OPS; i++) {
+    if (n == TEST_LIVE || (n && rand_r(&seed) % 2)) {
+      k = rand_r(&seed) % n;
+      id = live[k];
+      live[k] = live[--n];
+      bf_sys_assert(__atomic_exchange_n(&test_owner[id], 0, __ATOMIC_RELAXED) ==
+                    arg->self);
+      bf_id_allocator_mt_release(arg->mt, id);
+      if (i % 7 == 0) {
+        bf_id_allocator_mt_release(arg->mt, id);
+      }
+      if (i % 11 == 0) {
+        bf_id_allocator_mt_release(arg->mt, TEST_POOL_SIZE + 1 + i % 3);
+        bf_id_allocator_mt_release(arg->mt, 0);
+      }
+    } else {
+      id = bf_id_allocator_mt_allocate(arg->mt);
+      /* The free ids may all be in the caches of other threads */
+      if (id == (unsigned int)-1) {
+        __atomic_fetch_add(&test_dry, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+      bf_sys_assert(id >= 1 && id <= TEST_POOL_SIZE);
+      bf_sys_assert(__atomic_exchange_n(
+                        &test_owner[id], arg->self, __ATOMIC_RELAXED) == 0);
+      live[n++] = id;
+    }
+    if (i % 1000 == 999) {
+      bf_id_allocator_mt_flush(arg->mt);
+    }
+  }
+  while (n) {
+    id = live[--n];
+    __atomic_store_n(&test_owner[id], 0, __ATOMIC_RELAXED);
+    bf_id_allocator_mt_release(arg->mt, id);
+  }
+  return NULL;
+}
+
+/* Every id handed out to the threads is held by one of them at a time, and
+ * once they are gone all the ids are back in the pool. */
+int id_mt_test_main(void) {
+  pthread_t tid[TEST_THREADS];
+  test_arg_t args[TEST_THREADS];
+  bf_id_allocator_mt *mt;
+  unsigned int cached[3];
+  unsigned int i, id;
+
+  mt = bf_id_allocator_mt_new(
+      TEST_POOL_SIZE, false, BF_ID_ALLOCATOR_ENGINE_DENSE, 8);
+  bf_sys_assert(mt);
+  for (i = 0; i < TEST_THREADS; i++) {
+    args[i].mt = mt;
+    args[i].self = i + 1;
+    bf_sys_assert(!pthread_create(&tid[i], NULL, test_thread, &args[i]));
+  }
+  for (i = 0; i < TEST_THREADS; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  bf_sys_assert(test_dry);
+  for (id = 1; id <= TEST_POOL_SIZE; id++) {
+    bf_sys_assert(!bf_id_allocator_mt_is_set(mt, id));
+  }
+  /* Ids released stay in the cache of the thread until it flushes */
+  for (i = 0; i < 3; i++) {
+    cached[i] = bf_id_allocator_mt_allocate(mt);
+  }
+  for (i = 0; i < 3; i++) {
+    bf_id_allocator_mt_release(mt, cached[i]);
+    bf_sys_assert(bf_id_allocator_mt_is_set(mt, cached[i]));
+  }
+  bf_id_allocator_mt_flush(mt);
+  for (i = 0; i < 3; i++) {
+    bf_sys_assert(!bf_id_allocator_mt_is_set(mt, cached[i]));
+  }
+  for (i = 0; i < TEST_POOL_SIZE; i++) {
+    id = bf_id_allocator_mt_allocate(mt);
+    bf_sys_assert(id >= 1 && id <= TEST_POOL_SIZE);
+    bf_sys_assert(!test_owner[id]);
+    test_owner[id] = 1;
+  }
+  bf_sys_assert(bf_id_allocator_mt_allocate(mt) == (unsigned int)-1);
+  bf_id_allocator_mt_destroy(mt);
+  return 0;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,6 +15,8 @@
  */
 #include <target-utils/map/map.h>
 #include "map_log.h"
+#include <stdbool.h>
+#include <string.h>
 #include <Judy.h>
 #include <target-sys/bf_sal/bf_sys_intf.h>
 
@@ -61,6 +63,126 @@ bf_map_sts_t bf_map_get(bf_map_t *map, unsigned long key, void **data) {
   return BF_MAP_OK;
 }
 
+/* Batches smaller than this are not worth sorting */
+#define MAP_BATCH_SORT_MIN 64
+/* Keys are grouped by the bits above that many low bytes and sorted on the
+ * low bytes within each group, in as many radix passes plus one for the
+ * group. Keys further apart share too little of the tree for their order to
+ * pay the sort back, so the order of the groups is left as it comes. */
+#define MAP_BATCH_SORT_BYTES 3
+/* Groups kept apart, the keys of the high parts seen after the first ones
+ * share the last group. */
+#define MAP_BATCH_GROUPS 16
+
+typedef struct map_batch_key_s {
+  unsigned long key;
+  uint32_t index;  // Of the key in the batch
+  uint32_t order;  // Group above the low bytes of the key, sorted on
+} map_batch_key_t;
+
+/* Radix sort of the keys grouped by their high part. Returns the sorted
+ * keys, to be freed through *buf, or NULL when out of memory or when more
+ * than half of the keys are in no group but the last. The order of the
+ * groups is the order they were first seen in. */
+static map_batch_key_t *map_batch_sort(const unsigned long *keys,
+                                       uint32_t n,
+                                       map_batch_key_t **buf) {
+  const unsigned int low_bits = 8 * MAP_BATCH_SORT_BYTES;
+  unsigned long high[MAP_BATCH_GROUPS - 1];
+  map_batch_key_t *from, *to, *tmp;
+  uint32_t count[257];
+  uint32_t diff = 0, others = 0;
+  unsigned int groups = 0, g = 0;
+  unsigned int shift;
+  uint32_t i;
+
+  *buf = bf_sys_malloc(2 * (size_t)n * sizeof(map_batch_key_t));
+  if (!*buf) {
+    return NULL;
+  }
+  from = *buf;
+  to = from + n;
+  for (i = 0; i < n; i++) {
+    unsigned long h = keys[i] >> low_bits;
+    /* Keys of one group tend to come one after the other */
+    if (g == groups || high[g] != h) {
+      for (g = 0; g < groups && high[g] != h; g++) {
+      }
+      if (g == groups && groups < MAP_BATCH_GROUPS - 1) {
+        high[groups++] = h;
+      }
+    }
+    others += g == groups;
+    /* Keys mostly in no group are spread, give up early */
+    if ((i + 1 == MAP_BATCH_SORT_MIN || i + 1 == n) && 2 * others > i + 1) {
+      bf_sys_free(*buf);
+      *buf = NULL;
+      return NULL;
+    }
+    from[i].key = keys[i];
+    from[i].index = i;
+    from[i].order = (uint32_t)g << low_bits |
+                    (uint32_t)(keys[i] & ((1ul << low_bits) - 1));
+    diff |= from[i].order ^ from[0].order;
+  }
+  for (shift = 0; shift < 32; shift += 8) {
+    if (!((diff >> shift) & 0xff)) {
+      continue;
+    }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+      count[((from[i].order >> shift) & 0xff) + 1]++;
+    }
+    for (i = 0; i < 256; i++) {
+      count[i + 1] += count[i];
+    }
+    for (i = 0; i < n; i++) {
+      to[count[(from[i].order >> shift) & 0xff]++] = from[i];
+    }
+    tmp = from;
+    from = to;
+    to = tmp;
+  }
+  return from;
+}
+
+bf_map_sts_t bf_map_get_batch(bf_map_t *map,
+                              const unsigned long *keys,
+                              uint32_t n,
+                              void **data,
+                              bf_map_sts_t *sts) {
+  bf_map_sts_t rc = BF_MAP_OK;
+  bf_map_sts_t key_sts;
+  map_batch_key_t *sorted = NULL;
+  map_batch_key_t *buf = NULL;
+  bool in_order = true;
+  uint32_t i, j;
+
+  for (i = 1; i < n && in_order; i++) {
+    in_order = keys[i] >= keys[i - 1];
+  }
+  if (!in_order && n >= MAP_BATCH_SORT_MIN) {
+    sorted = map_batch_sort(keys, n, &buf);
+  }
+  for (i = 0; i < n; i++) {
+    j = sorted ? sorted[i].index : i;
+    key_sts = bf_map_get(map, sorted ? sorted[i].key : keys[j], &data[j]);
+    if (BF_MAP_OK != key_sts) {
+      data[j] = NULL;
+      if (BF_MAP_ERR != rc) {
+        rc = key_sts;
+      }
+    }
+    if (sts) {
+      sts[j] = key_sts;
+    }
+  }
+  if (buf) {
+    bf_sys_free(buf);
+  }
+  return rc;
+}
+
 bf_map_sts_t bf_map_get_rmv(bf_map_t *map, unsigned long key, void **data) {
   bf_map_sts_t sts = BF_MAP_OK;
 
@@ -144,3 +266,203 @@ uint32_t bf_map_count(bf_map_t *map) {
   JLC(count, (*map), 0, -1);
   return (uint32_t)count;
 }
+
+size_t bf_map_memory_used(bf_map_t *map) {
+  Word_t Rc_word;
+  JLMU(Rc_word, (*map));
+  return Rc_word;
+}
+
+double bf_map_density(bf_map_t *map) {
+  PWord_t Pvalue;
+  Word_t first = 0, last = -1;
+  Word_t count;
+
+  JLF(Pvalue, (*map), first);
+  if (NULL == Pvalue) {
+    return 0;
+  }
+  JLL(Pvalue, (*map), last);
+  JLC(count, (*map), 0, -1);
+  /* The span of a map holding every key does not fit in a Word_t */
+  return (double)count / ((double)(last - first) + 1);
+}
+
+#ifdef BF_MAP_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_KEYS (1u << 21)
+#define BENCH_BATCH (1u << 15)
+#define BENCH_CLUSTER 1000000ul
+/* Clusters in the mixed batch are this far apart */
+#define BENCH_CLUSTER_GAP (1ul << 32)
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Pushes the map out of the cache between runs */
+static void bench_flush(void) {
+  static volatile char junk[64 << 20];
+  size_t i;
+  for (i = 0; i < sizeof(junk); i += 64) {
+    junk[i]++;
+  }
+}
+
+/* Key i of a batch, spread over the whole map, within a cluster of handles,
+ * or within two clusters with one key in 32 spread. */
+static unsigned long bench_key(const unsigned long *all,
+                               unsigned int mode,
+                               unsigned int i) {
+  unsigned long handle = BENCH_CLUSTER + rand() % (4 * BENCH_BATCH);
+  if (mode == 0 || (mode == 2 && i % 32 == 0)) {
+    return all[rand() % BENCH_KEYS];
+  }
+  return mode == 2 && i % 2 ? handle + BENCH_CLUSTER_GAP : handle;
+}
+
+/* ns per key of bf_map_get in a loop and of bf_map_get_batch */
+int bf_map_bench_main(void) {
+  static unsigned long keys[BENCH_BATCH];
+  static void *data[BENCH_BATCH];
+  static bf_map_sts_t sts[BENCH_BATCH];
+  unsigned long *all = malloc(BENCH_KEYS * sizeof(unsigned long));
+  bf_map_t map;
+  double t, loop, batch;
+  unsigned int i, mode, run;
+
+  bf_map_init(&map);
+  srand(1);
+  for (i = 0; i < BENCH_KEYS; i++) {
+    all[i] = ((unsigned long)rand() << 24) ^ rand();
+    bf_map_add(&map, all[i], (void *)(uintptr_t)(i + 1));
+  }
+  for (i = 0; i < 4 * BENCH_BATCH; i++) {
+    bf_map_add(&map, BENCH_CLUSTER + i, (void *)(uintptr_t)(i + 1));
+    bf_map_add(&map,
+               BENCH_CLUSTER + BENCH_CLUSTER_GAP + i,
+               (void *)(uintptr_t)(i + 1));
+  }
+  printf("keys       loop ns  batch ns\n");
+  for (mode = 0; mode < 3; mode++) {
+    for (i = 0; i < BENCH_BATCH; i++) {
+      keys[i] = bench_key(all, mode, i);
+    }
+    loop = batch = 1e18;
+    for (run = 0; run < 5; run++) {
+      bench_flush();
+      t = bench_now();
+      for (i = 0; i < BENCH_BATCH; i++) {
+        sts[i] = bf_map_get(&map, keys[i], &data[i]);
+      }
+      t = bench_now() - t;
+      loop = t < loop ? t : loop;
+      bench_flush();
+      t = bench_now();
+      bf_map_get_batch(&map, keys, BENCH_BATCH, data, sts);
+      t = bench_now() - t;
+      batch = t < batch ? t : batch;
+    }
+    printf("%-9s %8.1f %9.1f\n",
+           mode == 0 ? "spread" : mode == 1 ? "clustered" : "mixed",
+           loop / BENCH_BATCH,
+           batch / BENCH_BATCH);
+  }
+  bf_map_destroy(&map);
+  free(all);
+  return 0;
+}
+
+#endif /* BF_MAP_BENCH */
+
+#ifdef BF_MAP_TEST
+
+#include <stdlib.h>
+
+#define TEST_BATCH 5000
+
+/* Checks one batch against bf_map_get on each key */
+static void test_batch(bf_map_t *map,
+                       const unsigned long *keys,
+                       uint32_t n,
+                       bool with_sts) {
+  static void *data[TEST_BATCH];
+  static bf_map_sts_t sts[TEST_BATCH];
+  bf_map_sts_t rc = BF_MAP_OK;
+  bf_map_sts_t key_sts;
+  void *expected;
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    data[i] = (void *)1;
+  }
+  key_sts = bf_map_get_batch(map, keys, n, data, with_sts ? sts : NULL);
+  for (i = 0; i < n; i++) {
+    if (bf_map_get(map, keys[i], &expected) != BF_MAP_OK) {
+      expected = NULL;
+      rc = BF_MAP_NO_KEY;
+    }
+    bf_sys_assert(data[i] == expected);
+    if (with_sts) {
+      bf_sys_assert(sts[i] == (expected ? BF_MAP_OK : BF_MAP_NO_KEY));
+    }
+  }
+  bf_sys_assert(key_sts == rc);
+}
+
+/* Batches of present and missing keys, in order or not, within a cluster,
+ * within a few clusters, with strays, spread, and spread after a clustered
+ * start. */
+int bf_map_test_main(void) {
+  static const uint32_t sizes[] = {1, 2, 63, 64, 65, 500, TEST_BATCH};
+  static unsigned long keys[TEST_BATCH];
+  unsigned long base[4] = {0, 70000, 1ul << 40, ~0ul - 30000};
+  unsigned long spread;
+  bf_map_t map;
+  unsigned int mode, c, s;
+  unsigned long k;
+  uint32_t i, n;
+
+  srand(1);
+  bf_map_init(&map);
+  for (c = 0; c < 4; c++) {
+    for (k = 0; k < 20000; k += 2) {
+      bf_map_add(&map, base[c] + k, (void *)(uintptr_t)(base[c] + k + 1));
+    }
+  }
+  test_batch(&map, keys, 0, true);
+  for (mode = 0; mode < 6; mode++) {
+    for (i = 0; i < TEST_BATCH; i++) {
+      k = rand() % 20010;
+      c = mode < 2 ? 1 : rand() % 4;
+      spread = ((unsigned long)rand() << 40) ^ rand();
+      if (mode == 0) {
+        keys[i] = base[1] + i * 3;
+      } else if ((mode == 3 && i % 4 == 0) ||
+                 (mode >= 4 && i % 4 && i >= (mode - 4) * MAP_BATCH_SORT_MIN)) {
+        keys[i] = spread;
+      } else {
+        keys[i] = base[c] + k;
+      }
+    }
+    if (mode) {
+      keys[TEST_BATCH - 1] = base[3] + 29999;
+    }
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      n = sizes[s];
+      test_batch(&map, keys, n, true);
+      test_batch(&map, keys, n, false);
+      test_batch(&map, keys + TEST_BATCH - n, n, n % 2);
+    }
+  }
+  bf_map_destroy(&map);
+  return 0;
+}
+
+#endif /* BF_MAP_TEST */
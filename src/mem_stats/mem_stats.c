@@ -0,0 +1,221 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include <pthread.h>
+#include <target-utils/mem_stats/mem_stats.h>
+#include <target-utils/fbitset/fbitset.h>
+#include <target-utils/fbitset/cbitset.h>
+#include <target-utils/map/map.h>
+#include <target-utils/id/id.h>
+#include <Judy.h>
+#include <target-sys/bf_sal/bf_sys_intf.h>
+
+typedef struct mem_stats_entry_s {
+  bf_mem_stats_type_t type;
+  bf_mem_stats_lock_t lock_fn;
+  void *lock_arg;
+  char name[];
+} mem_stats_entry_t;
+
+static pthread_once_t mem_stats_once = PTHREAD_ONCE_INIT;
+static bf_sys_mutex_t mem_stats_lock;  // Protects mem_stats_entries
+static Pvoid_t mem_stats_entries;      // Judy array of container to entry
+static size_t mem_stats_name_max;      // Longest name ever registered
+
+static void mem_stats_init(void) { bf_sys_mutex_init(&mem_stats_lock); }
+
+/* Adds a container to the totals of its name */
+static void mem_stats_add(bf_mem_stats_t *stats,
+                          mem_stats_entry_t *entry,
+                          void *container) {
+  if (entry->lock_fn) {
+    entry->lock_fn(entry->lock_arg, true);
+  }
+  switch (entry->type) {
+    case BF_MEM_STATS_FBITSET: {
+      bf_fbitset_t *bs = container;
+      stats->memory_used += bf_fbs_memory_used(bs);
+      stats->population += bf_fbs_pop_count(bs);
+      stats->density += bf_fbs_density(bs);
+      break;
+    }
+    case BF_MEM_STATS_CBITSET: {
+      bf_cbitset_t *bs = container;
+      unsigned int pop = bf_cbs_pop_count(bs);
+      stats->memory_used += bf_cbs_memory_used(bs);
+      stats->population += pop;
+      stats->density += (double)pop / bs->width;
+      break;
+    }
+    case BF_MEM_STATS_MAP:
+      stats->memory_used += bf_map_memory_used(container);
+      stats->population += bf_map_count(container);
+      stats->density += bf_map_density(container);
+      break;
+    case BF_MEM_STATS_ID_ALLOCATOR:
+      stats->memory_used += bf_id_allocator_memory_used(container);
+      stats->population += bf_id_allocator_count(container);
+      stats->density += bf_id_allocator_density(container);
+      break;
+  }
+  if (entry->lock_fn) {
+    entry->lock_fn(entry->lock_arg, false);
+  }
+  stats->instances++;
+}
+
+bf_mem_stats_sts_t bf_mem_stats_register(const char *name,
+                                         bf_mem_stats_type_t type,
+                                         void *container,
+                                         bf_mem_stats_lock_t lock_fn,
+                                         void *lock_arg) {
+  mem_stats_entry_t *entry;
+  PWord_t Pvalue;
+  size_t len;
+
+  if (!name || !container) {
+    return BF_MEM_STATS_ERR;
+  }
+  pthread_once(&mem_stats_once, mem_stats_init);
+  len = strlen(name);
+  entry = bf_sys_malloc(sizeof(mem_stats_entry_t) + len + 1);
+  if (!entry) {
+    return BF_MEM_STATS_ERR;
+  }
+  entry->type = type;
+  entry->lock_fn = lock_fn;
+  entry->lock_arg = lock_arg;
+  memcpy(entry->name, name, len + 1);
+
+  bf_sys_mutex_lock(&mem_stats_lock);
+  JLI(Pvalue, mem_stats_entries, (Word_t)container);
+  if (PJERR == Pvalue || 0 != *Pvalue) {
+    bf_sys_mutex_unlock(&mem_stats_lock);
+    bf_sys_free(entry);
+    return BF_MEM_STATS_ERR;
+  }
+  *Pvalue = (Word_t)entry;
+  if (len > mem_stats_name_max) {
+    mem_stats_name_max = len;
+  }
+  bf_sys_mutex_unlock(&mem_stats_lock);
+  return BF_MEM_STATS_OK;
+}
+
+bf_mem_stats_sts_t bf_mem_stats_unregister(void *container) {
+  PWord_t Pvalue;
+  int Rc_int;
+
+  pthread_once(&mem_stats_once, mem_stats_init);
+  bf_sys_mutex_lock(&mem_stats_lock);
+  JLG(Pvalue, mem_stats_entries, (Word_t)container);
+  if (NULL == Pvalue) {
+    bf_sys_mutex_unlock(&mem_stats_lock);
+    return BF_MEM_STATS_NOT_FOUND;
+  }
+  bf_sys_free((mem_stats_entry_t *)*Pvalue);
+  JLD(Rc_int, mem_stats_entries, (Word_t)container);
+  (void)Rc_int;
+  bf_sys_mutex_unlock(&mem_stats_lock);
+  return BF_MEM_STATS_OK;
+}
+
+bf_mem_stats_sts_t bf_mem_stats_get(const char *name, bf_mem_stats_t *stats) {
+  PWord_t Pvalue;
+  Word_t container = 0;
+
+  if (!name || !stats) {
+    return BF_MEM_STATS_ERR;
+  }
+  pthread_once(&mem_stats_once, mem_stats_init);
+  memset(stats, 0, sizeof(*stats));
+  stats->name = name;
+
+  bf_sys_mutex_lock(&mem_stats_lock);
+  JLF(Pvalue, mem_stats_entries, container);
+  while (Pvalue) {
+    mem_stats_entry_t *entry = (mem_stats_entry_t *)*Pvalue;
+    if (!strcmp(entry->name, name)) {
+      mem_stats_add(stats, entry, (void *)container);
+    }
+    JLN(Pvalue, mem_stats_entries, container);
+  }
+  bf_sys_mutex_unlock(&mem_stats_lock);
+
+  if (!stats->instances) {
+    return BF_MEM_STATS_NOT_FOUND;
+  }
+  stats->density /= stats->instances;
+  return BF_MEM_STATS_OK;
+}
+
+bf_mem_stats_sts_t bf_mem_stats_walk(bf_mem_stats_cb_t cb, void *cookie) {
+  bf_mem_stats_sts_t sts = BF_MEM_STATS_OK;
+  Pvoid_t totals = NULL;  // JudySL array of name to bf_mem_stats_t
+  PWord_t Pvalue, Ptotal;
+  Word_t container = 0;
+  Word_t Rc_word;
+  uint8_t *name;
+
+  if (!cb) {
+    return BF_MEM_STATS_ERR;
+  }
+  pthread_once(&mem_stats_once, mem_stats_init);
+  bf_sys_mutex_lock(&mem_stats_lock);
+  name = bf_sys_malloc(mem_stats_name_max + 1);
+  if (!name) {
+    bf_sys_mutex_unlock(&mem_stats_lock);
+    return BF_MEM_STATS_ERR;
+  }
+
+  /* Sum the containers up by name, then report the names in order */
+  JLF(Pvalue, mem_stats_entries, container);
+  while (Pvalue) {
+    mem_stats_entry_t *entry = (mem_stats_entry_t *)*Pvalue;
+    JSLI(Ptotal, totals, (uint8_t *)entry->name);
+    if (PJERR == Ptotal) {
+      sts = BF_MEM_STATS_ERR;
+      break;
+    }
+    if (0 == *Ptotal) {
+      *Ptotal = (Word_t)bf_sys_calloc(1, sizeof(bf_mem_stats_t));
+      if (0 == *Ptotal) {
+        sts = BF_MEM_STATS_ERR;
+        break;
+      }
+    }
+    mem_stats_add((bf_mem_stats_t *)*Ptotal, entry, (void *)container);
+    JLN(Pvalue, mem_stats_entries, container);
+  }
+
+  name[0] = '\0';
+  JSLF(Ptotal, totals, name);
+  while (Ptotal) {
+    bf_mem_stats_t *stats = (bf_mem_stats_t *)*Ptotal;
+    if (stats && BF_MEM_STATS_OK == sts) {
+      stats->name = (const char *)name;
+      stats->density /= stats->instances;
+      cb(stats, cookie);
+    }
+    bf_sys_free(stats);
+    JSLN(Ptotal, totals, name);
+  }
+  JSLFA(Rc_word, totals);
+  (void)Rc_word;
+  bf_sys_free(name);
+  bf_sys_mutex_unlock(&mem_stats_lock);
+  return sts;
+}
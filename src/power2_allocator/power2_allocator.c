@@ -29,6 +29,7 @@
 #include <target-utils/bit_utils/bit_utils.h>
 #include <target-utils/power2_allocator/power2_allocator.h>
 #include <target-sys/bf_sal/bf_sys_intf.h>
+#include "power2_allocator_int.h"
 
 #if 0
 #define POWER2_ALLOCATOR_ASSERT(x) power2_allocator_assert(x)
@@ -37,14 +38,73 @@ void power2_allocator_assert (power2_allocator_t *allocator);
 #define POWER2_ALLOCATOR_ASSERT(x)
 #endif
 
+/* Adds a free chunk to the free list of the given log2 and to the size
+ * index of that free list.
+ */
+static int power2_allocator_free_list_add(power2_allocator_t *allocator,
+                                          uint32_t log2,
+                                          uint32_t free_index,
+                                          uint32_t size) {
+  PWord_t Pfree;
+  PWord_t Psize;
+  int Rc_int;
+
+  JLI(Pfree, allocator->free_lists[log2], (Word_t)free_index);
+  if (Pfree == PJERR) {
+    return -1;
+  }
+  bf_sys_assert(*Pfree == 0);
+  *Pfree = size;
+
+  JLI(Psize, allocator->size_lists[log2], (Word_t)size);
+  if (Psize == PJERR) {
+    return -1;
+  }
+  J1S(Rc_int, *(Pvoid_t *)Psize, (Word_t)free_index);
+  if (Rc_int == JERR) {
+    return -1;
+  }
+  bf_sys_assert(Rc_int);
+  return 0;
+}
+
+/* Deletes a free chunk from the free list of the given log2 and from the
+ * size index of that free list. Returns the size of the deleted chunk, 0 if
+ * the chunk was not found.
+ */
+static uint32_t power2_allocator_free_list_del(power2_allocator_t *allocator,
+                                               uint32_t log2,
+                                               uint32_t free_index) {
+  PWord_t Pfree;
+  PWord_t Psize;
+  int Rc_int;
+  uint32_t size;
+
+  JLG(Pfree, allocator->free_lists[log2], (Word_t)free_index);
+  if (!Pfree) {
+    return 0;
+  }
+  size = *Pfree;
+  JLD(Rc_int, allocator->free_lists[log2], (Word_t)free_index);
+  bf_sys_assert(Rc_int);
+
+  JLG(Psize, allocator->size_lists[log2], (Word_t)size);
+  bf_sys_assert(Psize);
+  J1U(Rc_int, *(Pvoid_t *)Psize, (Word_t)free_index);
+  bf_sys_assert(Rc_int);
+  if (*(Pvoid_t *)Psize == NULL) {
+    JLD(Rc_int, allocator->size_lists[log2], (Word_t)size);
+    bf_sys_assert(Rc_int);
+  }
+  return size;
+}
+
 /* Removes a particular free index of given free size. Size is used for
  * sanitization.
  */
 static int power2_allocator_remove_free_index(power2_allocator_t *allocator,
                                               uint32_t free_index,
                                               uint32_t size) {
-  PWord_t Pfree;
-  int Rc_int;
   uint32_t tz = 0;
   uint32_t rem_size = 0, tmp_size = 0;
   uint32_t log2_size = 0, free_log2;
@@ -70,16 +130,12 @@ static int power2_allocator_remove_free_index(power2_allocator_t *allocator,
     bf_sys_assert((cur_index % (1 << free_log2)) == 0);
     bf_sys_assert(ctz(cur_index) >= ctz(1 << free_log2));
 
-    JLG(Pfree, allocator->free_lists[free_log2], (Word_t)cur_index);
-    if (!Pfree) {
+    tmp_size = power2_allocator_free_list_del(allocator, free_log2, cur_index);
+    if (!tmp_size) {
       bf_sys_assert(0);
       return 1;
     }
 
-    tmp_size = *Pfree;
-    JLD(Rc_int, allocator->free_lists[free_log2], (Word_t)cur_index);
-    bf_sys_assert(Rc_int);
-
     if (rem_size < (1u << free_log2)) {
       bf_sys_assert(tmp_size == rem_size);
       cur_index += rem_size;
@@ -94,51 +150,46 @@ static int power2_allocator_remove_free_index(power2_allocator_t *allocator,
   return 0;
 }
 
-/* Removes one free index in the given log2 allocator which is greater
- * than or equal to the size requested and returns it
+/* Removes the smallest free chunk in the given log2 free list which is
+ * greater than or equal to the size requested and returns its index. Ties
+ * are broken by the lowest index. The size index makes this a couple of Judy
+ * lookups no matter how many undersized chunks are in the free list.
  */
 static uint32_t power2_allocator_remove_one_free(power2_allocator_t *allocator,
                                                  uint32_t log2,
                                                  uint32_t size,
                                                  uint32_t *free_size) {
   Word_t index;
-  PWord_t Pfree;
+  Word_t fit_size;
+  PWord_t Psize;
   int Rc_int;
-  uint32_t free_index;
 
   if (log2 >= allocator->no_free_lists) {
     return -1;
   }
   bf_sys_assert(size <= (1u << log2));
 
-  index = 0;
-  JLF(Pfree, allocator->free_lists[log2], index);
-  while (Pfree) {
-    if (*Pfree >= size) {
-      break;
-    }
-    JLN(Pfree, allocator->free_lists[log2], index);
-  }
-
-  if (Pfree == NULL) {
+  fit_size = size;
+  JLF(Psize, allocator->size_lists[log2], fit_size);
+  if (Psize == NULL) {
     return -1;
   }
 
-  free_index = index;
-  *free_size = *Pfree;
-
-  JLD(Rc_int, allocator->free_lists[log2], index);
+  index = 0;
+  J1F(Rc_int, *(Pvoid_t *)Psize, index);
   bf_sys_assert(Rc_int);
 
-  return free_index;
+  *free_size = power2_allocator_free_list_del(allocator, log2, index);
+  bf_sys_assert(*free_size == fit_size);
+
+  return index;
 }
 
 static int power2_allocator_insert_one_free(power2_allocator_t *allocator,
                                             uint32_t free_index,
                                             uint32_t size) {
-  PWord_t Pfree;
   uint32_t tz = 0;
-  uint32_t rem_size = 0;
+  uint32_t rem_size = 0, chunk_size = 0;
   uint32_t log2_size = 0, free_log2;
   uint32_t cur_index = 0;
 
@@ -165,26 +216,210 @@ static int power2_allocator_insert_one_free(power2_allocator_t *allocator,
     bf_sys_assert((cur_index % (1 << free_log2)) == 0);
     bf_sys_assert(ctz(cur_index) >= ctz(1 << free_log2));
 
-    JLI(Pfree, allocator->free_lists[free_log2], (Word_t)cur_index);
-    if (Pfree == PJERR) {
+    if (rem_size < (1u << free_log2)) {
+      bf_sys_assert(rem_size > ((1u << free_log2) >> 1));
+      chunk_size = rem_size;
+    } else {
+      chunk_size = (1u << free_log2);
+    }
+
+    if (power2_allocator_free_list_add(
+            allocator, free_log2, cur_index, chunk_size)) {
       bf_sys_assert(0);
       return -1;
     }
+    cur_index += chunk_size;
+    rem_size -= chunk_size;
+  }
 
-    bf_sys_assert(*Pfree == 0);
+  return 0;
+}
 
-    if (rem_size < (1u << free_log2)) {
-      bf_sys_assert(rem_size > ((1u << free_log2) >> 1));
-      *Pfree = rem_size;
-      cur_index += rem_size;
-      rem_size = 0;
-    } else {
-      *Pfree = (1u << free_log2);
-      cur_index += (1u << free_log2);
-      rem_size -= (1u << free_log2);
+/* Adds a free run to the free run index if it's longer than max_size */
+static int power2_allocator_free_run_add(power2_allocator_t *allocator,
+                                         uint32_t run_index,
+                                         uint32_t run_size) {
+  PWord_t Prun;
+  PWord_t Pstarts;
+  int Rc_int;
+
+  if (run_size <= allocator->max_size) {
+    return 0;
+  }
+  JLI(Prun, allocator->free_runs, (Word_t)run_index);
+  if (Prun == PJERR) {
+    return -1;
+  }
+  bf_sys_assert(*Prun == 0);
+  *Prun = run_size;
+
+  JLI(Pstarts, allocator->run_sizes, (Word_t)run_size);
+  if (Pstarts == PJERR) {
+    return -1;
+  }
+  J1S(Rc_int, *(Pvoid_t *)Pstarts, (Word_t)run_index);
+  if (Rc_int == JERR) {
+    return -1;
+  }
+  bf_sys_assert(Rc_int);
+  return 0;
+}
+
+/* Deletes the free run starting at run_index from the free run index and
+ * returns its size
+ */
+static uint32_t power2_allocator_free_run_del(power2_allocator_t *allocator,
+                                              uint32_t run_index) {
+  PWord_t Prun;
+  PWord_t Pstarts;
+  uint32_t run_size;
+  int Rc_int;
+
+  JLG(Prun, allocator->free_runs, (Word_t)run_index);
+  bf_sys_assert(Prun);
+  run_size = *Prun;
+  JLD(Rc_int, allocator->free_runs, (Word_t)run_index);
+  bf_sys_assert(Rc_int);
+
+  JLG(Pstarts, allocator->run_sizes, (Word_t)run_size);
+  bf_sys_assert(Pstarts);
+  J1U(Rc_int, *(Pvoid_t *)Pstarts, (Word_t)run_index);
+  bf_sys_assert(Rc_int);
+  if (*(Pvoid_t *)Pstarts == NULL) {
+    JLD(Rc_int, allocator->run_sizes, (Word_t)run_size);
+  }
+  return run_size;
+}
+
+/* Splits the free run holding the block at alloc_index, which is about to
+ * be marked in use. The run starts where the previous allocation ends.
+ */
+static int power2_allocator_free_run_split(power2_allocator_t *allocator,
+                                           uint32_t alloc_index,
+                                           uint32_t size) {
+  Word_t index = alloc_index;
+  PWord_t Pinuse;
+  PWord_t Prun;
+  uint32_t run_index, run_size;
+
+  JLP(Pinuse, allocator->inuse_list, index);
+  run_index = Pinuse ? index + *Pinuse : 0;
+  JLG(Prun, allocator->free_runs, (Word_t)run_index);
+  if (Prun == NULL) {
+    /* Not a large run */
+    return 0;
+  }
+  run_size = power2_allocator_free_run_del(allocator, run_index);
+  bf_sys_assert(alloc_index + size <= run_index + run_size);
+
+  if (power2_allocator_free_run_add(
+          allocator, run_index, alloc_index - run_index) ||
+      power2_allocator_free_run_add(
+          allocator,
+          alloc_index + size,
+          run_index + run_size - (alloc_index + size))) {
+    bf_sys_assert(0);
+    return -1;
+  }
+  return 0;
+}
+
+/* Merges the block at alloc_index, which is about to be marked free, with
+ * the free runs around it
+ */
+static void power2_allocator_free_run_merge(power2_allocator_t *allocator,
+                                            uint32_t alloc_index,
+                                            uint32_t size) {
+  Word_t index = alloc_index;
+  PWord_t Pinuse;
+  PWord_t Prun;
+  uint32_t run_index, run_end;
+  int rc;
+
+  JLP(Pinuse, allocator->inuse_list, index);
+  run_index = Pinuse ? index + *Pinuse : 0;
+  index = alloc_index;
+  JLN(Pinuse, allocator->inuse_list, index);
+  run_end = Pinuse ? index : allocator->total_size;
+  if (run_end - run_index <= allocator->max_size) {
+    return;
+  }
+
+  JLG(Prun, allocator->free_runs, (Word_t)run_index);
+  if (Prun && run_index < alloc_index) {
+    power2_allocator_free_run_del(allocator, run_index);
+  }
+  JLG(Prun, allocator->free_runs, (Word_t)(alloc_index + size));
+  if (Prun) {
+    power2_allocator_free_run_del(allocator, alloc_index + size);
+  }
+  rc = power2_allocator_free_run_add(allocator, run_index, run_end - run_index);
+  bf_sys_assert(rc == 0);
+}
+
+/* Returns the lowest index aligned to align in the smallest large free run
+ * which holds size indexes from it, -1 if none. Runs are visited by size,
+ * so only the runs too short once aligned are skipped.
+ */
+static uint32_t power2_allocator_free_run_find(power2_allocator_t *allocator,
+                                               uint32_t size,
+                                               uint32_t align,
+                                               uint32_t *run_index,
+                                               uint32_t *run_size_out) {
+  PWord_t Pstarts;
+  Word_t run_size = size;
+  Word_t index, aligned;
+  int Rc_int;
+
+  JLF(Pstarts, allocator->run_sizes, run_size);
+  while (Pstarts) {
+    index = 0;
+    J1F(Rc_int, *(Pvoid_t *)Pstarts, index);
+    while (Rc_int) {
+      aligned = (index + align - 1) & ~((Word_t)align - 1);
+      if (aligned + size <= index + run_size) {
+        *run_index = index;
+        *run_size_out = run_size;
+        return aligned;
+      }
+      J1N(Rc_int, *(Pvoid_t *)Pstarts, index);
     }
+    JLN(Pstarts, allocator->run_sizes, run_size);
   }
+  return -1;
+}
+
+/* Accounts for an allocation of size being added or removed in the usage
+ * counters
+ */
+static int power2_allocator_count_alloc(power2_allocator_t *allocator,
+                                        uint32_t size,
+                                        bool inuse) {
+  PWord_t Pcount;
+  int Rc_int;
 
+  if (inuse) {
+    JLI(Pcount, allocator->size_counts, (Word_t)size);
+    if (Pcount == PJERR) {
+      bf_sys_assert(0);
+      return -1;
+    }
+    (*Pcount)++;
+    allocator->used_indexes += size;
+    allocator->used_blocks++;
+    allocator->log2_counts[log2_uint32_ceil(size)]++;
+    return 0;
+  }
+
+  JLG(Pcount, allocator->size_counts, (Word_t)size);
+  bf_sys_assert(Pcount && *Pcount);
+  if (--(*Pcount) == 0) {
+    JLD(Rc_int, allocator->size_counts, (Word_t)size);
+    (void)Rc_int;
+  }
+  allocator->used_indexes -= size;
+  allocator->used_blocks--;
+  allocator->log2_counts[log2_uint32_ceil(size)]--;
   return 0;
 }
 
@@ -194,10 +429,24 @@ static int power2_allocator_mark_inuse(power2_allocator_t *allocator,
   Word_t index;
   PWord_t Pinuse;
 
+  if (power2_allocator_count_alloc(allocator, size, true)) {
+    return -1;
+  }
+
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_bitmap_mark_inuse(allocator->bitmap, alloc_index, size);
+    return 0;
+  }
+
+  if (power2_allocator_free_run_split(allocator, alloc_index, size)) {
+    power2_allocator_count_alloc(allocator, size, false);
+    return -1;
+  }
   index = alloc_index;
   JLI(Pinuse, allocator->inuse_list, index);
   if (Pinuse == PJERR) {
     bf_sys_assert(0);
+    power2_allocator_count_alloc(allocator, size, false);
     return -1;
   }
   bf_sys_assert(*Pinuse == 0);
@@ -211,6 +460,10 @@ uint32_t power2_allocator_get_index_size(power2_allocator_t *allocator,
   PWord_t Pinuse;
   uint32_t size;
 
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    return power2_bitmap_get_index_size(allocator->bitmap, alloc_index);
+  }
+
   index = alloc_index;
   JLG(Pinuse, allocator->inuse_list, index);
   if (Pinuse == NULL) {
@@ -226,7 +479,18 @@ static void power2_allocator_mark_free(power2_allocator_t *allocator,
                                        uint32_t alloc_index) {
   Word_t index;
   int Rc_int;
+  uint32_t size;
+
+  size = power2_allocator_get_index_size(allocator, alloc_index);
+  bf_sys_assert(size != (uint32_t)-1);
+  power2_allocator_count_alloc(allocator, size, false);
+
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_bitmap_mark_free(allocator->bitmap, alloc_index, size);
+    return;
+  }
 
+  power2_allocator_free_run_merge(allocator, alloc_index, size);
   index = alloc_index;
   JLD(Rc_int, allocator->inuse_list, index);
   bf_sys_assert(Rc_int == 1);
@@ -265,48 +529,116 @@ static uint32_t power2_allocator_get_prev_inuse_block(
   }
 }
 
-/** \brief power2_allocator_make_copy
-  *         Make a copy of the allocator and return the copy
-  *
-  * \param src The pointer to the power2 allocator that needs to be copied
-  * \return Returns pointer to an allocator that has same state has the passed
-  *in
-  *          allocator.
-  *         Null in case of failure
-  */
-power2_allocator_t *power2_allocator_make_copy(power2_allocator_t *src) {
+/* Frees the Judy arrays or the bitmap holding the state of the allocator */
+static void power2_allocator_free_state(power2_allocator_t *allocator) {
+  Word_t Rc_word;
+  Word_t size;
+  PWord_t Psize;
+  uint32_t i = 0;
+
+  JLFA(Rc_word, allocator->size_counts);
+  (void)Rc_word;
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_bitmap_destroy(allocator->bitmap);
+    return;
+  }
+
+  for (i = 0; allocator->free_lists && i < allocator->no_free_lists; i++) {
+    JLFA(Rc_word, allocator->free_lists[i]);
+    (void)Rc_word;
+    if (allocator->size_lists == NULL) {
+      continue;
+    }
+    size = 0;
+    JLF(Psize, allocator->size_lists[i], size);
+    while (Psize) {
+      J1FA(Rc_word, *(Pvoid_t *)Psize);
+      JLN(Psize, allocator->size_lists[i], size);
+    }
+    JLFA(Rc_word, allocator->size_lists[i]);
+  }
+  JLFA(Rc_word, allocator->inuse_list);
+  JLFA(Rc_word, allocator->free_runs);
+  size = 0;
+  JLF(Psize, allocator->run_sizes, size);
+  while (Psize) {
+    J1FA(Rc_word, *(Pvoid_t *)Psize);
+    JLN(Psize, allocator->run_sizes, size);
+  }
+  JLFA(Rc_word, allocator->run_sizes);
+  (void)Rc_word;
+
+  bf_sys_free(allocator->free_lists);
+  bf_sys_free(allocator->size_lists);
+}
+
+/* Builds a private copy of the state of src into dest.
+ * dest is left untouched on failure.
+ */
+static int power2_allocator_clone_state(power2_allocator_t *dest,
+                                        power2_allocator_t *src) {
   PWord_t Pfree;
   PWord_t Pinuse;
   PWord_t Pfree_dest;
   PWord_t Pinuse_dest;
+  PWord_t Psize;
+  PWord_t Psize_dest;
   Word_t index;
-  power2_allocator_t *dest;
+  Word_t size;
+  power2_allocator_t copy;
   uint32_t i = 0;
+  int Rc_int;
 
-  if (src == NULL) {
-    return NULL;
+  memcpy(&copy, src, sizeof(power2_allocator_t));
+  copy.ref_count = NULL;
+  copy.size_counts = (Pvoid_t)NULL;
+  if (src->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    copy.bitmap = NULL;
+  } else {
+    copy.inuse_list = (Pvoid_t)NULL;
+    copy.free_runs = (Pvoid_t)NULL;
+    copy.run_sizes = (Pvoid_t)NULL;
+    copy.free_lists = NULL;
+    copy.size_lists = NULL;
+  }
+
+  size = 0;
+  JLF(Psize, src->size_counts, size);
+  while (Psize) {
+    JLI(Psize_dest, copy.size_counts, size);
+    if (Psize_dest == PJERR) {
+      bf_sys_assert(0);
+      goto cleanup;
+    }
+    *Psize_dest = *Psize;
+    JLN(Psize, src->size_counts, size);
   }
 
-  dest = (power2_allocator_t *)bf_sys_calloc(sizeof(power2_allocator_t), 1);
-  if (dest == NULL) {
-    return NULL;
+  if (src->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    copy.bitmap = power2_bitmap_copy(src->bitmap);
+    if (copy.bitmap == NULL) {
+      goto cleanup;
+    }
+    memcpy(dest, &copy, sizeof(power2_allocator_t));
+    return 0;
   }
 
-  memcpy(dest, src, sizeof(power2_allocator_t));
-  dest->free_lists =
+  copy.free_lists =
       (Pvoid_t *)bf_sys_calloc(sizeof(Pvoid_t), src->no_free_lists);
-  if (dest->free_lists == NULL) {
-    bf_sys_free(dest);
-    return NULL;
+  if (copy.free_lists == NULL) {
+    goto cleanup;
+  }
+  copy.size_lists =
+      (Pvoid_t *)bf_sys_calloc(sizeof(Pvoid_t), src->no_free_lists);
+  if (copy.size_lists == NULL) {
+    goto cleanup;
   }
 
-  dest->inuse_list = (Pvoid_t)NULL;
-
-  for (i = 0; i < dest->no_free_lists; i++) {
+  for (i = 0; i < copy.no_free_lists; i++) {
     index = 0;
     JLF(Pfree, src->free_lists[i], index);
     while (Pfree) {
-      JLI(Pfree_dest, dest->free_lists[i], index);
+      JLI(Pfree_dest, copy.free_lists[i], index);
       if (Pfree_dest == PJERR) {
         bf_sys_assert(0);
         goto cleanup;
@@ -314,12 +646,33 @@ power2_allocator_t *power2_allocator_make_copy(power2_allocator_t *src) {
       *Pfree_dest = *Pfree;
       JLN(Pfree, src->free_lists[i], index);
     }
+
+    size = 0;
+    JLF(Psize, src->size_lists[i], size);
+    while (Psize) {
+      JLI(Psize_dest, copy.size_lists[i], size);
+      if (Psize_dest == PJERR) {
+        bf_sys_assert(0);
+        goto cleanup;
+      }
+      index = 0;
+      J1F(Rc_int, *(Pvoid_t *)Psize, index);
+      while (Rc_int) {
+        J1S(Rc_int, *(Pvoid_t *)Psize_dest, index);
+        if (Rc_int == JERR) {
+          bf_sys_assert(0);
+          goto cleanup;
+        }
+        J1N(Rc_int, *(Pvoid_t *)Psize, index);
+      }
+      JLN(Psize, src->size_lists[i], size);
+    }
   }
 
   index = 0;
   JLF(Pinuse, src->inuse_list, index);
   while (Pinuse) {
-    JLI(Pinuse_dest, dest->inuse_list, index);
+    JLI(Pinuse_dest, copy.inuse_list, index);
     if (Pinuse_dest == PJERR) {
       bf_sys_assert(0);
       goto cleanup;
@@ -327,41 +680,200 @@ power2_allocator_t *power2_allocator_make_copy(power2_allocator_t *src) {
     *Pinuse_dest = *Pinuse;
     JLN(Pinuse, src->inuse_list, index);
   }
-  return dest;
+
+  index = 0;
+  JLF(Pfree, src->free_runs, index);
+  while (Pfree) {
+    if (power2_allocator_free_run_add(&copy, index, *Pfree)) {
+      bf_sys_assert(0);
+      goto cleanup;
+    }
+    JLN(Pfree, src->free_runs, index);
+  }
+  memcpy(dest, &copy, sizeof(power2_allocator_t));
+  return 0;
 cleanup:
-  power2_allocator_destroy(dest);
-  return NULL;
+  power2_allocator_free_state(&copy);
+  return -1;
 }
 
-/** \brief power2_allocator_create
-  *        Create a power2 allocator and initialize count number of
-  *        size entries
+/* Takes one more reference on the state of the allocator */
+static int power2_allocator_share_state(power2_allocator_t *allocator) {
+  if (allocator->ref_count == NULL) {
+    allocator->ref_count = (uint32_t *)bf_sys_calloc(sizeof(uint32_t), 1);
+    if (allocator->ref_count == NULL) {
+      return -1;
+    }
+    *allocator->ref_count = 1;
+  }
+  __atomic_add_fetch(allocator->ref_count, 1, __ATOMIC_ACQ_REL);
+  return 0;
+}
+
+/* Drops the reference of the allocator on its state, freeing the state with
+ * the last reference.
+ */
+static void power2_allocator_put_state(power2_allocator_t *allocator) {
+  if (allocator->ref_count) {
+    if (__atomic_sub_fetch(allocator->ref_count, 1, __ATOMIC_ACQ_REL)) {
+      return;
+    }
+    bf_sys_free(allocator->ref_count);
+    allocator->ref_count = NULL;
+  }
+  power2_allocator_free_state(allocator);
+}
+
+/* Called before any change to the state of the allocator. If the state is
+ * shared with copies, the allocator gets its own copy of it first.
+ */
+static int power2_allocator_unshare(power2_allocator_t *allocator) {
+  power2_allocator_t shared;
+
+  if (allocator->ref_count == NULL) {
+    return 0;
+  }
+  if (__atomic_load_n(allocator->ref_count, __ATOMIC_ACQUIRE) == 1) {
+    /* All the copies are gone */
+    bf_sys_free(allocator->ref_count);
+    allocator->ref_count = NULL;
+    return 0;
+  }
+  memcpy(&shared, allocator, sizeof(power2_allocator_t));
+  if (power2_allocator_clone_state(allocator, &shared)) {
+    return -1;
+  }
+  power2_allocator_put_state(&shared);
+  return 0;
+}
+
+/** \brief power2_allocator_make_copy
+  *         Make a copy of the allocator and return the copy
   *
-  * \param size Default size of the resource. This should be a power of 2
-  * \param count The number of "size" resources available.
-  * \return Returns the pointer to an allocator to use for future calls.
+  * The copy shares the state of src until either of them is changed, the
+  * first change on a shared state copies it.
+  *
+  * \param src The pointer to the power2 allocator that needs to be copied
+  * \return Returns pointer to an allocator that has same state has the passed
+  *in
+  *          allocator.
   *         Null in case of failure
   */
-power2_allocator_t *power2_allocator_create(uint32_t size, uint32_t count) {
-  uint32_t log2;
-  power2_allocator_t *allocator = NULL;
-  uint32_t free_index = 0;
-  uint32_t i = 0;
+power2_allocator_t *power2_allocator_make_copy(power2_allocator_t *src) {
+  power2_allocator_t *dest;
 
-  if (!is_uint32_power2(size)) {
+  if (src == NULL) {
     return NULL;
   }
-  log2 = log2_uint32_ceil(size);
 
-  allocator =
-      (power2_allocator_t *)bf_sys_calloc(sizeof(power2_allocator_t), 1);
-  if (allocator == NULL) {
+  dest = (power2_allocator_t *)bf_sys_calloc(sizeof(power2_allocator_t), 1);
+  if (dest == NULL) {
     return NULL;
   }
 
-  allocator->free_lists = (Pvoid_t *)bf_sys_calloc(sizeof(Pvoid_t), log2 + 1);
-  if (allocator->free_lists == NULL) {
-    bf_sys_free(allocator);
+  if (power2_allocator_share_state(src)) {
+    bf_sys_free(dest);
+    return NULL;
+  }
+  memcpy(dest, src, sizeof(power2_allocator_t));
+  return dest;
+}
+
+/** \brief power2_allocator_restore
+  *         Restore the state of the allocator from a copy of it
+  *
+  * \param allocator The power2 allocator to restore
+  * \param snapshot The copy returned by power2_allocator_make_copy. It stays
+  *        valid and can be restored from again.
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if the snapshot is not a copy of the allocator
+  */
+int power2_allocator_restore(power2_allocator_t *allocator,
+                             power2_allocator_t *snapshot) {
+  if (!allocator || !snapshot) {
+    return -1;
+  }
+  if (allocator->engine != snapshot->engine ||
+      allocator->max_size != snapshot->max_size ||
+      allocator->total_size != snapshot->total_size) {
+    return -1;
+  }
+  if (allocator == snapshot) {
+    return 0;
+  }
+  if (power2_allocator_share_state(snapshot)) {
+    return -1;
+  }
+  power2_allocator_put_state(allocator);
+  memcpy(allocator, snapshot, sizeof(power2_allocator_t));
+  return 0;
+}
+
+static power2_allocator_t *power2_allocator_create_int(
+    uint32_t size, uint32_t count, power2_allocator_engine_t engine);
+
+/** \brief power2_allocator_create
+  *        Create a power2 allocator and initialize count number of
+  *        size entries
+  *
+  * \param size Default size of the resource. This should be a power of 2
+  * \param count The number of "size" resources available.
+  * \return Returns the pointer to an allocator to use for future calls.
+  *         Null in case of failure
+  */
+power2_allocator_t *power2_allocator_create(uint32_t size, uint32_t count) {
+  return power2_allocator_create_engine(
+      size, count, POWER2_ALLOCATOR_ENGINE_JUDY);
+}
+
+/** \brief power2_allocator_create_engine
+  *        Create a power2 allocator backed by the given engine and initialize
+  *        count number of size entries
+  *
+  * \param size Default size of the resource. This should be a power of 2
+  * \param count The number of "size" resources available.
+  * \param engine The engine keeping the allocator state
+  * \return Returns the pointer to an allocator to use for future calls.
+  *         Null in case of failure
+  */
+power2_allocator_t *power2_allocator_create_engine(
+    uint32_t size, uint32_t count, power2_allocator_engine_t engine) {
+  power2_allocator_t *allocator = NULL;
+  uint32_t free_index = 0;
+  uint32_t i = 0;
+
+  allocator = power2_allocator_create_int(size, count, engine);
+  if (allocator == NULL || engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    return allocator;
+  }
+
+  for (i = 0, free_index = 0; i < count; i++, free_index += size) {
+    power2_allocator_insert_one_free(allocator, free_index, size);
+  }
+  if (power2_allocator_free_run_add(allocator, 0, allocator->total_size)) {
+    power2_allocator_destroy(allocator);
+    return NULL;
+  }
+  return allocator;
+}
+
+/* Allocates an allocator and the state of its engine. The free lists of the
+ * Judy engine are left empty for the caller to fill, the bitmap engine starts
+ * with all of the indexes free.
+ */
+static power2_allocator_t *power2_allocator_create_int(
+    uint32_t size, uint32_t count, power2_allocator_engine_t engine) {
+  uint32_t log2;
+  power2_allocator_t *allocator = NULL;
+
+  if (!is_uint32_power2(size)) {
+    return NULL;
+  }
+  log2 = log2_uint32_ceil(size);
+
+  allocator =
+      (power2_allocator_t *)bf_sys_calloc(sizeof(power2_allocator_t), 1);
+  if (allocator == NULL) {
     return NULL;
   }
 
@@ -369,9 +881,30 @@ power2_allocator_t *power2_allocator_create(uint32_t size, uint32_t count) {
   allocator->max_size = size;
   allocator->total_size = size * count;
   allocator->no_free_lists = log2 + 1;
+  allocator->engine = engine;
 
-  for (i = 0, free_index = 0; i < count; i++, free_index += size) {
-    power2_allocator_insert_one_free(allocator, free_index, size);
+  if (engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    allocator->bitmap = power2_bitmap_create(allocator->total_size);
+    if (allocator->bitmap == NULL) {
+      bf_sys_free(allocator);
+      return NULL;
+    }
+    return allocator;
+  } else if (engine != POWER2_ALLOCATOR_ENGINE_JUDY) {
+    bf_sys_free(allocator);
+    return NULL;
+  }
+
+  allocator->free_lists = (Pvoid_t *)bf_sys_calloc(sizeof(Pvoid_t), log2 + 1);
+  if (allocator->free_lists == NULL) {
+    bf_sys_free(allocator);
+    return NULL;
+  }
+  allocator->size_lists = (Pvoid_t *)bf_sys_calloc(sizeof(Pvoid_t), log2 + 1);
+  if (allocator->size_lists == NULL) {
+    bf_sys_free(allocator->free_lists);
+    bf_sys_free(allocator);
+    return NULL;
   }
   return allocator;
 }
@@ -387,19 +920,160 @@ void power2_allocator_destroy(power2_allocator_t *allocator) {
   if (!allocator) {
     return;
   }
-  Word_t Rc_word;
+  power2_allocator_put_state(allocator);
+  bf_sys_free(allocator);
+}
 
+/* Serialized allocator, see power2_allocator_serialize */
+#define POWER2_ALLOCATOR_IMAGE_MAGIC 0x50325341  // "P2SA"
+#define POWER2_ALLOCATOR_IMAGE_VERSION 1
+
+typedef struct power2_allocator_image_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t engine;
+  uint32_t max_size;
+  uint32_t total_size;
+  uint32_t alloc_count;
+  /* alloc_count pairs of index and size, by increasing index */
+  uint32_t allocs[];
+} power2_allocator_image_t;
+
+/** \brief power2_allocator_serialize_size
+  *        Number of bytes power2_allocator_serialize needs for the allocator
+  */
+size_t power2_allocator_serialize_size(power2_allocator_t *allocator) {
+  if (!allocator) {
+    return 0;
+  }
+  return sizeof(power2_allocator_image_t) +
+         (size_t)allocator->used_blocks * 2 * sizeof(uint32_t);
+}
+
+/** \brief power2_allocator_serialize
+  *        Write the state of the allocator to buf
+  *
+  * \param allocator The power2 allocator
+  * \param buf The buffer to write to, suitably aligned for uint32_t
+  * \param buf_size The size of buf, at least
+  *        power2_allocator_serialize_size(allocator)
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_serialize(power2_allocator_t *allocator,
+                               void *buf,
+                               size_t buf_size) {
+  power2_allocator_image_t *image = buf;
   uint32_t i = 0;
-  for (i = 0; i < allocator->no_free_lists; i++) {
-    JLFA(Rc_word, allocator->free_lists[i]);
-    (void)Rc_word;
+  int index;
+
+  if (!allocator || !buf ||
+      buf_size < power2_allocator_serialize_size(allocator)) {
+    return -1;
   }
-  JLFA(Rc_word, allocator->inuse_list);
-  (void)Rc_word;
 
-  bf_sys_free(allocator->free_lists);
+  image->magic = POWER2_ALLOCATOR_IMAGE_MAGIC;
+  image->version = POWER2_ALLOCATOR_IMAGE_VERSION;
+  image->engine = allocator->engine;
+  image->max_size = allocator->max_size;
+  image->total_size = allocator->total_size;
+  image->alloc_count = allocator->used_blocks;
 
-  bf_sys_free(allocator);
+  index = power2_allocator_first_alloc(allocator);
+  for (i = 0; index != -1; i++) {
+    bf_sys_assert(i < allocator->used_blocks);
+    image->allocs[2 * i] = index;
+    image->allocs[2 * i + 1] =
+        power2_allocator_get_index_size(allocator, index);
+    index = power2_allocator_next_alloc(allocator, index);
+  }
+  bf_sys_assert(i == allocator->used_blocks);
+  return 0;
+}
+
+/* Adds the free range between two allocations of a restored allocator */
+static int power2_allocator_restore_free(power2_allocator_t *allocator,
+                                         uint32_t free_index,
+                                         uint32_t size) {
+  if (size == 0 || allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    return 0;
+  }
+  if (power2_allocator_insert_one_free(allocator, free_index, size) ||
+      power2_allocator_free_run_add(allocator, free_index, size)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** \brief power2_allocator_deserialize
+  *        Create an allocator from the state written by
+  *        power2_allocator_serialize
+  *
+  * \param buf The buffer written by power2_allocator_serialize
+  * \param buf_size The size of buf
+  * \return Returns the pointer to the allocator.
+  *         Null in case of failure or if buf doesn't hold a valid state
+  */
+power2_allocator_t *power2_allocator_deserialize(const void *buf,
+                                                 size_t buf_size) {
+  const power2_allocator_image_t *image = buf;
+  power2_allocator_t *allocator;
+  PWord_t Pinuse;
+  uint64_t end;
+  uint32_t cur = 0;
+  uint32_t index, size;
+  uint32_t i = 0;
+
+  if (!buf || buf_size < sizeof(power2_allocator_image_t) ||
+      image->magic != POWER2_ALLOCATOR_IMAGE_MAGIC ||
+      image->version != POWER2_ALLOCATOR_IMAGE_VERSION ||
+      image->max_size == 0 || image->total_size % image->max_size ||
+      (buf_size - sizeof(power2_allocator_image_t)) / (2 * sizeof(uint32_t)) <
+          image->alloc_count) {
+    return NULL;
+  }
+
+  allocator = power2_allocator_create_int(image->max_size,
+                                          image->total_size / image->max_size,
+                                          image->engine);
+  if (allocator == NULL) {
+    return NULL;
+  }
+
+  /* One pass over the allocations, adding the free ranges between them */
+  for (i = 0; i < image->alloc_count; i++) {
+    index = image->allocs[2 * i];
+    size = image->allocs[2 * i + 1];
+    end = (uint64_t)index + size;
+    if (index < cur || size == 0 || end > allocator->total_size) {
+      goto cleanup;
+    }
+    if (power2_allocator_restore_free(allocator, cur, index - cur) ||
+        power2_allocator_count_alloc(allocator, size, true)) {
+      goto cleanup;
+    }
+    if (allocator->engine == POWER2_ALLOCATOR_ENGINE_JUDY) {
+      JLI(Pinuse, allocator->inuse_list, (Word_t)index);
+      if (Pinuse == PJERR) {
+        goto cleanup;
+      }
+      *Pinuse = size;
+    }
+    cur = end;
+  }
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_bitmap_load(allocator->bitmap, image->allocs, image->alloc_count);
+  }
+  if (power2_allocator_restore_free(
+          allocator, cur, allocator->total_size - cur)) {
+    goto cleanup;
+  }
+
+  POWER2_ALLOCATOR_ASSERT(allocator);
+  return allocator;
+cleanup:
+  power2_allocator_destroy(allocator);
+  return NULL;
 }
 
 /** \brief power2_allocator_alloc
@@ -423,9 +1097,22 @@ int power2_allocator_alloc(power2_allocator_t *allocator, uint32_t size) {
   if (!allocator || (allocator->max_size < size)) {
     return -1;
   }
+  if (power2_allocator_unshare(allocator)) {
+    return -1;
+  }
 
   /* Figure out the log of the size to start checking free lists */
   log2 = log2_uint32_ceil(size);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    alloc_index = power2_bitmap_find(allocator->bitmap, size, 1u << log2);
+    if (alloc_index == (uint32_t)-1) {
+      /* No Space */
+      return -1;
+    }
+    power2_allocator_mark_inuse(allocator, alloc_index, size);
+    POWER2_ALLOCATOR_ASSERT(allocator);
+    return alloc_index;
+  }
   for (i = log2; i < allocator->no_free_lists; i++) {
     free_index =
         power2_allocator_remove_one_free(allocator, i, size, &free_size);
@@ -493,6 +1180,14 @@ int power2_allocator_release(power2_allocator_t *allocator, uint32_t index) {
   if (size == (uint32_t)-1) {
     return -1;
   }
+  if (power2_allocator_unshare(allocator)) {
+    return -1;
+  }
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_allocator_mark_free(allocator, index);
+    POWER2_ALLOCATOR_ASSERT(allocator);
+    return 0;
+  }
   free_size = size;
 
   prev_index =
@@ -566,6 +1261,18 @@ int power2_allocator_reserve(power2_allocator_t *allocator,
     /* This reserve_index is already in use */
     return 1;
   }
+  if (power2_allocator_unshare(allocator)) {
+    return -1;
+  }
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    if (!reserve_size || !power2_bitmap_is_free(
+                             allocator->bitmap, reserve_index, reserve_size)) {
+      return 1;
+    }
+    power2_allocator_mark_inuse(allocator, reserve_index, reserve_size);
+    POWER2_ALLOCATOR_ASSERT(allocator);
+    return 0;
+  }
   prev_index = power2_allocator_get_prev_inuse_block(
       allocator, reserve_index, &prev_size);
   next_index = power2_allocator_get_next_inuse_block(
@@ -633,7 +1340,6 @@ static int power2_allocator_alloc_int_v2(power2_allocator_t *allocator,
                                          uint32_t align) {
   Word_t index;
   PWord_t Pfree;
-  int Rc_int;
   bool found = false;
   uint32_t free_size[count];
   uint32_t free_index[count];
@@ -684,8 +1390,8 @@ static int power2_allocator_alloc_int_v2(power2_allocator_t *allocator,
 
   /* Remove all of the free_indexes */
   for (i = 0; i < count; i++) {
-    JLD(Rc_int, allocator->free_lists[log2], free_index[i]);
-    bf_sys_assert(Rc_int);
+    rc = power2_allocator_free_list_del(allocator, log2, free_index[i]);
+    bf_sys_assert(rc == (int)free_size[i]);
 
     rc = power2_allocator_insert_one_free(
         allocator, free_index[i] + size, (free_size[i] - size));
@@ -704,15 +1410,119 @@ static int power2_allocator_alloc_int_v2(power2_allocator_t *allocator,
   return free_index[0];
 }
 
+/* Allocates count blocks of size, 2^log2 apart, with the first one aligned
+ * to align. When align is no more than max_size, any free chunk of a free
+ * list of log2(align) or more is aligned and the smallest one which holds
+ * all the blocks is used. Otherwise the blocks span more than max_size and
+ * are taken out of the smallest large free run which holds them.
+ */
+static int power2_allocator_alloc_int_run(power2_allocator_t *allocator,
+                                          uint32_t log2,
+                                          uint32_t size,
+                                          uint32_t count,
+                                          uint32_t align) {
+  uint32_t stride = 1u << log2;
+  uint32_t span = (count - 1) * stride + size;
+  uint32_t run_index = -1, run_size = 0;
+  uint32_t alloc_index;
+  uint32_t i = 0;
+  int rc;
+
+  if (align <= allocator->max_size) {
+    for (i = log2_uint32_ceil(align); i < allocator->no_free_lists; i++) {
+      run_index =
+          power2_allocator_remove_one_free(allocator, i, span, &run_size);
+      if (run_index != (uint32_t)-1) {
+        break;
+      }
+    }
+    if (run_index == (uint32_t)-1) {
+      return -1;
+    }
+    /* Pick up the last index which satisfies the span in this free chunk */
+    alloc_index = (run_index + run_size - span) & ~(align - 1);
+    bf_sys_assert(alloc_index >= run_index);
+  } else {
+    alloc_index = power2_allocator_free_run_find(
+        allocator, span, align, &run_index, &run_size);
+    if (alloc_index == (uint32_t)-1) {
+      return -1;
+    }
+    /* Remove the free run from the free lists */
+    rc = power2_allocator_remove_free_index(allocator, run_index, run_size);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+  }
+
+  /* Add back what's left around and between the blocks */
+  rc = power2_allocator_insert_one_free(
+      allocator, run_index, alloc_index - run_index);
+  rc |= power2_allocator_insert_one_free(
+      allocator, alloc_index + span, run_index + run_size - (alloc_index + span));
+  for (i = 0; i + 1 < count; i++) {
+    rc |= power2_allocator_insert_one_free(
+        allocator, alloc_index + i * stride + size, stride - size);
+  }
+  if (rc) {
+    bf_sys_assert(0);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    rc = power2_allocator_mark_inuse(allocator, alloc_index + i * stride, size);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+  }
+  return alloc_index;
+}
+
+/* Lowest start aligned to align of count free blocks of size, stride apart,
+ * -1 if none. The space between the blocks may be in use. */
+static uint32_t power2_allocator_bitmap_find_blocks(
+    power2_allocator_t *allocator,
+    uint32_t stride,
+    uint32_t size,
+    uint32_t count,
+    uint32_t align) {
+  uint64_t start;
+  uint32_t i;
+
+  for (start = 0;
+       start + (uint64_t)(count - 1) * stride + size <= allocator->total_size;
+       start += align) {
+    for (i = 0; i < count; i++) {
+      if (!power2_bitmap_is_free(
+              allocator->bitmap, start + i * stride, size)) {
+        break;
+      }
+    }
+    if (i == count) {
+      return start;
+    }
+  }
+  return -1;
+}
+
 /** \brief power2_allocator_alloc_multiple
-  *        Allocate size resource such that the start index has at least
-  *         log2(size) trailing zeroes.
+  *        Allocate count blocks of size resource, one every 2^log2(size)
+  *         indexes, such that the start index has at least
+  *         log2(count * 2^log2(size)) trailing zeroes.
   *
-  * Example: If the request is for size = 5, the return index will have at least
-  * 3 lsb bits set to zero. (0, 8, 16, 24 ....)
+  * Example: If the request is for size = 5 and count 2, the blocks will be
+  * at index and index + 8, with index a multiple of 16.
+  *
+  * Blocks of the largest size only need the blocks themselves to be free.
+  * Smaller blocks are carved out of a single free run, so the space between
+  * them must be free as well: with index 3 in use, size 3 and count 2 is not
+  * placed at 0 (blocks 0-2 and 4-6) but at 8. That space stays free.
   *
   * \param allocator The power2 allocator
   * \param size The size to allocate
+  * \param count The number of blocks
   * \return Index of the allocated space. -1 if there are any errors
   */
 int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
@@ -722,10 +1532,14 @@ int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
   uint32_t alloc_index;
   uint32_t total_size = 0;
   uint32_t align = 0;
+  uint32_t i = 0;
 
   if (count == 1) {
     return power2_allocator_alloc(allocator, size);
   }
+  if (count == 0 || size == 0) {
+    return -1;
+  }
 
   total_size = (1 << log2_uint32_ceil(size)) * count;
   if (!allocator || (allocator->total_size < total_size)) {
@@ -737,17 +1551,41 @@ int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
   /* Figure out the log of the size to start checking free lists */
   log2 = log2_uint32_ceil(size);
 
-  /* If we need more than 1 blocks, the size to request
-   * should be in this block
-   * Handling other case is as good as first fit, which needs more traversal.
-   * Currently not handled
-   */
-  if (log2 != allocator->no_free_lists - 1) {
+  if (power2_allocator_unshare(allocator)) {
     return -1;
   }
 
-  alloc_index =
-      power2_allocator_alloc_int_v2(allocator, log2, size, count, align);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    if (log2 == allocator->no_free_lists - 1) {
+      /* As in the Judy engine only the blocks themselves need to be free */
+      alloc_index = power2_allocator_bitmap_find_blocks(
+          allocator, 1u << log2, size, count, align);
+    } else {
+      alloc_index = power2_bitmap_find(
+          allocator->bitmap, (count - 1) * (1u << log2) + size, align);
+    }
+    if (alloc_index == (uint32_t)-1) {
+      /* No space */
+      return -1;
+    }
+    for (i = 0; i < count; i++) {
+      power2_allocator_mark_inuse(
+          allocator, alloc_index + i * (1u << log2), size);
+    }
+    POWER2_ALLOCATOR_ASSERT(allocator);
+    return alloc_index;
+  }
+
+  /* Blocks of the largest size are looked up in their free list. Smaller
+   * blocks need a free run spanning all of them and the space in between.
+   */
+  if (log2 == allocator->no_free_lists - 1) {
+    alloc_index =
+        power2_allocator_alloc_int_v2(allocator, log2, size, count, align);
+  } else {
+    alloc_index =
+        power2_allocator_alloc_int_run(allocator, log2, size, count, align);
+  }
   if (alloc_index == (uint32_t)-1) {
     /* No space */
     return -1;
@@ -757,13 +1595,19 @@ int power2_allocator_alloc_multiple(power2_allocator_t *allocator,
   return alloc_index;
 }
 
+static int power2_allocator_release_batch_int(power2_allocator_t *allocator,
+                                              uint32_t *indexes,
+                                              uint32_t n);
+
 /** \brief power2_allocator_release_multiple
-  *        Release the resource that was allocated at given index
+  *        Release the count blocks allocated by power2_allocator_alloc_multiple
+  *        at given index
   *
   * \param allocator The power2 allocator
   * \param index Index to release
+  * \param count The number of blocks
   * \return Status of the operation. 0 for SUCCESS.
-  *         non-zero in case of errors
+  *         non-zero in case of errors, no block is released then
   */
 int power2_allocator_release_multiple(power2_allocator_t *allocator,
                                       uint32_t index,
@@ -773,208 +1617,930 @@ int power2_allocator_release_multiple(power2_allocator_t *allocator,
   uint32_t size = 0;
   uint32_t next_index, next_size;
   uint32_t log2 = 0;
+  uint32_t *indexes;
+  uint32_t i = 0;
+  int rc;
+
+  if (count == 1) {
+    return power2_allocator_release(allocator, index);
+  }
+
+  size = power2_allocator_get_index_size(allocator, index);
+  if (size == (uint32_t)-1) {
+    return -1;
+  }
+
+  log2 = log2_uint32_ceil(size);
+  for (i = 1; i < count; i++) {
+    if (power2_allocator_get_index_size(allocator, index + i * (1u << log2)) !=
+        size) {
+      return -1;
+    }
+  }
+  if (power2_allocator_unshare(allocator)) {
+    return -1;
+  }
+
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP ||
+      log2 != allocator->no_free_lists - 1) {
+    /* Coalesce the blocks and the space between them once */
+    indexes = (uint32_t *)bf_sys_malloc(count * sizeof(uint32_t));
+    if (indexes == NULL) {
+      return -1;
+    }
+    for (i = 0; i < count; i++) {
+      indexes[i] = index + i * (1u << log2);
+    }
+    rc = power2_allocator_release_batch_int(allocator, indexes, count);
+    bf_sys_free(indexes);
+    POWER2_ALLOCATOR_ASSERT(allocator);
+    return rc;
+  }
+
+  /* Blocks of the largest size are aligned at the highest log available.
+   * So we do not have to coalesce the prev-free block
+   */
+  for (i = 0; i < count; i++) {
+    free_size = size;
+    free_index = index;
+
+    next_index =
+        power2_allocator_get_next_inuse_block(allocator, index, &next_size);
+    if (next_index == (uint32_t)-1) {
+      next_index = allocator->total_size;
+    }
+    free_size += next_index - (index + size);
+    /* Remove it from the free list */
+    rc = power2_allocator_remove_free_index(
+        allocator, index + size, next_index - (index + size));
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+
+    rc = power2_allocator_insert_one_free(allocator, free_index, free_size);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+    power2_allocator_mark_free(allocator, index);
+    index += (1 << log2);
+  }
+
+  POWER2_ALLOCATOR_ASSERT(allocator);
+  return 0;
+}
+
+/* Entry of a batch, sorted by size or index */
+typedef struct power2_allocator_batch_s {
+  uint32_t key;
+  uint32_t pos;  // Position of the entry in the caller's array
+} power2_allocator_batch_t;
+
+static int power2_allocator_batch_cmp_desc(const void *a, const void *b) {
+  const power2_allocator_batch_t *x = a;
+  const power2_allocator_batch_t *y = b;
+
+  if (x->key != y->key) {
+    return x->key > y->key ? -1 : 1;
+  }
+  return x->pos < y->pos ? -1 : (x->pos > y->pos);
+}
+
+static int power2_allocator_index_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return x < y ? -1 : (x > y);
+}
+
+/* Releases the allocations at the sorted indexes, which are all known to be
+ * in use. Each free run left behind is rebuilt once no matter how many of
+ * the released allocations it covers.
+ */
+static int power2_allocator_release_batch_int(power2_allocator_t *allocator,
+                                              uint32_t *indexes,
+                                              uint32_t n) {
+  uint32_t run_index, end_index;
+  uint32_t prev_index, prev_size;
+  uint32_t next_index, next_size;
+  uint32_t size;
   uint32_t i = 0;
   int rc;
 
-  if (count == 1) {
-    return power2_allocator_release(allocator, index);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    for (i = 0; i < n; i++) {
+      power2_allocator_mark_free(allocator, indexes[i]);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    prev_index =
+        power2_allocator_get_prev_inuse_block(allocator, indexes[i], &prev_size);
+    run_index = (prev_index == (uint32_t)-1) ? 0 : prev_index + prev_size;
+    rc = power2_allocator_remove_free_index(
+        allocator, run_index, indexes[i] - run_index);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+
+    /* Extend the run over the following allocations of the batch */
+    while (true) {
+      size = power2_allocator_get_index_size(allocator, indexes[i]);
+      end_index = indexes[i] + size;
+      power2_allocator_mark_free(allocator, indexes[i]);
+      next_index =
+          power2_allocator_get_next_inuse_block(allocator, end_index - 1, &next_size);
+      if (next_index == (uint32_t)-1) {
+        next_index = allocator->total_size;
+      }
+      rc = power2_allocator_remove_free_index(
+          allocator, end_index, next_index - end_index);
+      if (rc) {
+        bf_sys_assert(0);
+        return -1;
+      }
+      if (i + 1 == n || indexes[i + 1] != next_index) {
+        break;
+      }
+      i++;
+    }
+
+    rc = power2_allocator_insert_one_free(
+        allocator, run_index, next_index - run_index);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Allocates count blocks of size out of one free chunk, at most as many as
+ * fit in it. The blocks are carved from the end of the chunk like
+ * power2_allocator_alloc does and the leftover pieces are added back to the
+ * free lists once. Returns the number of blocks allocated, 0 if no chunk
+ * fits.
+ */
+static uint32_t power2_allocator_alloc_from_chunk(power2_allocator_t *allocator,
+                                                  uint32_t size,
+                                                  uint32_t count,
+                                                  uint32_t *alloc_indexes) {
+  uint32_t log2 = log2_uint32_ceil(size);
+  uint32_t align = 1u << log2;
+  uint32_t free_index = -1, free_size = 0;
+  uint32_t alloc_index, end_index;
+  uint32_t i = 0, found = 0;
+  int rc;
+
+  for (i = log2; i < allocator->no_free_lists; i++) {
+    free_index =
+        power2_allocator_remove_one_free(allocator, i, size, &free_size);
+    if (free_index != (uint32_t)-1) {
+      break;
+    }
+  }
+  if (free_index == (uint32_t)-1) {
+    return 0;
+  }
+
+  /* Pick up the last indexes which satisfy the size in this free chunk */
+  alloc_index = (free_index + free_size - 1) & ~(align - 1);
+  if ((alloc_index + size) > (free_index + free_size)) {
+    alloc_index -= align;
+  }
+  end_index = free_index + free_size;
+  while (found < count && alloc_index >= free_index) {
+    rc = power2_allocator_insert_one_free(
+        allocator, alloc_index + size, end_index - (alloc_index + size));
+    if (rc) {
+      bf_sys_assert(0);
+      break;
+    }
+    rc = power2_allocator_mark_inuse(allocator, alloc_index, size);
+    if (rc) {
+      bf_sys_assert(0);
+      break;
+    }
+    alloc_indexes[found++] = alloc_index;
+    end_index = alloc_index;
+    if (alloc_index < align) {
+      break;
+    }
+    alloc_index -= align;
+  }
+
+  rc = power2_allocator_insert_one_free(
+      allocator, free_index, end_index - free_index);
+  bf_sys_assert(rc == 0);
+  return found;
+}
+
+/** \brief power2_allocator_alloc_batch
+  *        Allocate n blocks of the given sizes, each aligned like
+  *        power2_allocator_alloc does. Either all of the blocks are allocated
+  *        or none.
+  *
+  * \param allocator The power2 allocator
+  * \param sizes The sizes to allocate
+  * \param n The number of sizes
+  * \param out_indexes Filled with the index allocated for each size
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors, the allocator is left unchanged
+  */
+int power2_allocator_alloc_batch(power2_allocator_t *allocator,
+                                 const uint32_t *sizes,
+                                 uint32_t n,
+                                 uint32_t *out_indexes) {
+  power2_allocator_batch_t *batch;
+  uint32_t *done;
+  uint32_t ndone = 0;
+  uint32_t size, count, found;
+  uint32_t i = 0, j = 0;
+  uint32_t alloc_index;
+
+  if (!allocator || (n && (!sizes || !out_indexes))) {
+    return -1;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (sizes[i] == 0 || sizes[i] > allocator->max_size) {
+      return -1;
+    }
+  }
+  if (power2_allocator_unshare(allocator)) {
+    return -1;
+  }
+
+  batch = (power2_allocator_batch_t *)bf_sys_malloc(
+      n * sizeof(power2_allocator_batch_t));
+  done = (uint32_t *)bf_sys_malloc(n * sizeof(uint32_t));
+  if (batch == NULL || done == NULL) {
+    bf_sys_free(batch);
+    bf_sys_free(done);
+    return -1;
+  }
+
+  /* The largest blocks go first so the small ones don't fragment the space
+   * they need
+   */
+  for (i = 0; i < n; i++) {
+    batch[i].key = sizes[i];
+    batch[i].pos = i;
+  }
+  qsort(batch, n, sizeof(power2_allocator_batch_t),
+        power2_allocator_batch_cmp_desc);
+
+  for (i = 0; i < n; i += count) {
+    size = batch[i].key;
+    for (count = 1; i + count < n && batch[i + count].key == size; count++)
+      ;
+    for (j = 0; j < count; j += found) {
+      if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+        found = 0;
+        alloc_index = power2_bitmap_find(
+            allocator->bitmap, size, 1u << log2_uint32_ceil(size));
+        if (alloc_index != (uint32_t)-1 &&
+            !power2_allocator_mark_inuse(allocator, alloc_index, size)) {
+          done[ndone] = alloc_index;
+          found = 1;
+        }
+      } else {
+        found = power2_allocator_alloc_from_chunk(
+            allocator, size, count - j, &done[ndone]);
+      }
+      if (found == 0) {
+        /* No space, give back what was allocated so far */
+        qsort(done, ndone, sizeof(uint32_t), power2_allocator_index_cmp);
+        power2_allocator_release_batch_int(allocator, done, ndone);
+        POWER2_ALLOCATOR_ASSERT(allocator);
+        bf_sys_free(batch);
+        bf_sys_free(done);
+        return -1;
+      }
+      ndone += found;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    out_indexes[batch[i].pos] = done[i];
+  }
+  bf_sys_free(batch);
+  bf_sys_free(done);
+  POWER2_ALLOCATOR_ASSERT(allocator);
+  return 0;
+}
+
+/** \brief power2_allocator_release_batch
+  *        Release the n allocations at the given indexes. Either all of them
+  *        are released or none.
+  *
+  * \param allocator The power2 allocator
+  * \param indexes The indexes to release
+  * \param n The number of indexes
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if any of the indexes is not allocated or is repeated, the
+  *         allocator is left unchanged
+  */
+int power2_allocator_release_batch(power2_allocator_t *allocator,
+                                   const uint32_t *indexes,
+                                   uint32_t n) {
+  uint32_t *sorted;
+  uint32_t i = 0;
+  int rc;
+
+  if (!allocator || (n && !indexes)) {
+    return -1;
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  sorted = (uint32_t *)bf_sys_malloc(n * sizeof(uint32_t));
+  if (sorted == NULL) {
+    return -1;
+  }
+  memcpy(sorted, indexes, n * sizeof(uint32_t));
+  qsort(sorted, n, sizeof(uint32_t), power2_allocator_index_cmp);
+  for (i = 0; i < n; i++) {
+    if ((i && sorted[i] == sorted[i - 1]) ||
+        power2_allocator_get_index_size(allocator, sorted[i]) ==
+            (uint32_t)-1) {
+      bf_sys_free(sorted);
+      return -1;
+    }
+  }
+  if (power2_allocator_unshare(allocator)) {
+    bf_sys_free(sorted);
+    return -1;
+  }
+
+  rc = power2_allocator_release_batch_int(allocator, sorted, n);
+  bf_sys_free(sorted);
+  POWER2_ALLOCATOR_ASSERT(allocator);
+  return rc;
+}
+
+/** \brief power2_allocator_alloc_count_by_size
+  *        Get the number of allocated elements of a given size.
+  *
+  * \param allocator The power2 allocator.
+  * \param size The size of the element.
+  * \return The number of elements allocated of the specified size.
+  */
+int power2_allocator_alloc_count_by_size(power2_allocator_t *allocator,
+                                         uint32_t size) {
+  PWord_t Pcount;
+
+  if (size > allocator->max_size) return 0;
+
+  JLG(Pcount, allocator->size_counts, (Word_t)size);
+  return Pcount ? (int)*Pcount : 0;
+}
+
+/* power2_allocator_usage basically gives the number of indices in use.
+ * This is different from the power2_allocator_alloc_count and
+ * power2_allocator_alloc_count_by_size which just gives the number of
+ * in_use_lists and not the overall number of indices in use.
+ */
+
+int power2_allocator_usage(power2_allocator_t *allocator) {
+  return allocator->used_indexes;
+}
+
+uint32_t power2_allocator_alloc_count(power2_allocator_t *allocator) {
+  if (!allocator) return 0;
+  return allocator->used_blocks;
+}
+
+/** \brief power2_allocator_get_stats
+  *        Get the usage counters of the allocator
+  *
+  * \param allocator The power2 allocator
+  * \param stats Filled with the counters
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_get_stats(power2_allocator_t *allocator,
+                               power2_allocator_stats_t *stats) {
+  if (!allocator || !stats) {
+    return -1;
+  }
+  memset(stats, 0, sizeof(power2_allocator_stats_t));
+  stats->total_size = allocator->total_size;
+  stats->max_size = allocator->max_size;
+  stats->used_indexes = allocator->used_indexes;
+  stats->free_indexes = allocator->total_size - allocator->used_indexes;
+  stats->alloc_count = allocator->used_blocks;
+  memcpy(stats->alloc_count_by_log2,
+         allocator->log2_counts,
+         sizeof(stats->alloc_count_by_log2));
+  return 0;
+}
+
+/* Accounts for the free chunks a free range of size from index splits in,
+ * the same way the free lists split it
+ */
+static void power2_allocator_frag_count_run(power2_allocator_t *allocator,
+                                            uint32_t index,
+                                            uint32_t size,
+                                            power2_allocator_frag_stats_t *stats) {
+  uint32_t free_log2, chunk_size;
+
+  while (size) {
+    free_log2 = ctz(index);
+    if (free_log2 > log2_uint32_ceil(size)) {
+      free_log2 = log2_uint32_ceil(size);
+    }
+    if (free_log2 >= allocator->no_free_lists) {
+      free_log2 = allocator->no_free_lists - 1;
+    }
+    chunk_size = (size < (1u << free_log2)) ? size : (1u << free_log2);
+    stats->free_chunks_by_log2[free_log2]++;
+    if (chunk_size > stats->largest_alloc_size) {
+      stats->largest_alloc_size = chunk_size;
+    }
+    if (chunk_size == allocator->max_size) {
+      stats->free_max_blocks++;
+    }
+    index += chunk_size;
+    size -= chunk_size;
+  }
+}
+
+/** \brief power2_allocator_get_frag_stats
+  *        Get the fragmentation of the free space of the allocator
+  *
+  * \param allocator The power2 allocator
+  * \param stats Filled with the fragmentation metrics
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 in case of errors
+  */
+int power2_allocator_get_frag_stats(power2_allocator_t *allocator,
+                                    power2_allocator_frag_stats_t *stats) {
+  PWord_t Psize;
+  Word_t size;
+  Word_t Rc_word;
+  uint32_t index, run_size = 0;
+  uint32_t i = 0;
+
+  if (!allocator || !stats) {
+    return -1;
+  }
+  memset(stats, 0, sizeof(power2_allocator_frag_stats_t));
+  stats->free_indexes = allocator->total_size - allocator->used_indexes;
+
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    index = power2_bitmap_next_free_run(allocator->bitmap, 0, &run_size);
+    while (index != (uint32_t)-1) {
+      power2_allocator_frag_count_run(allocator, index, run_size, stats);
+      index = power2_bitmap_next_free_run(
+          allocator->bitmap, index + run_size, &run_size);
+    }
+  } else {
+    for (i = 0; i < allocator->no_free_lists; i++) {
+      JLC(Rc_word, allocator->free_lists[i], 0, -1);
+      stats->free_chunks_by_log2[i] = Rc_word;
+      /* The largest chunk of each free list is the last key of its size
+       * index
+       */
+      size = -1;
+      JLL(Psize, allocator->size_lists[i], size);
+      if (Psize && size > stats->largest_alloc_size) {
+        stats->largest_alloc_size = size;
+      }
+    }
+    size = allocator->max_size;
+    JLG(Psize, allocator->size_lists[allocator->no_free_lists - 1], size);
+    if (Psize) {
+      J1C(Rc_word, *(Pvoid_t *)Psize, 0, -1);
+      stats->free_max_blocks = Rc_word;
+    }
+  }
+
+  if (stats->free_indexes) {
+    stats->frag_score =
+        (uint64_t)(stats->free_indexes -
+                   stats->free_max_blocks * allocator->max_size) *
+        100 / stats->free_indexes;
+  }
+  return 0;
+}
+
+/* Windows tried by the compaction planner, fewest moves first */
+#define POWER2_ALLOCATOR_PLAN_TRIES 16
+
+typedef struct power2_allocator_plan_window_s {
+  uint32_t index;  // Start of the window
+  uint32_t first;  // First allocation overlapping the window
+  uint32_t count;  // Number of allocations overlapping the window
+  uint32_t moved;  // Indexes in those allocations
+} power2_allocator_plan_window_t;
+
+/* Tries to find new places for the allocations overlapping the window on a
+ * copy of the allocator. The allocations stay in place while the free parts
+ * of the window are reserved, so the new places are free now and outside of
+ * both the window and the moved allocations. The copy is left as it was.
+ */
+static int power2_allocator_plan_window(power2_allocator_t *copy,
+                                        power2_allocator_plan_window_t *win,
+                                        uint32_t size,
+                                        uint32_t *starts,
+                                        uint32_t *sizes,
+                                        uint32_t *reserved,
+                                        power2_allocator_move_t *moves) {
+  uint32_t nreserved = 0;
+  uint32_t cur = win->index;
+  uint32_t i, j, k, m;
+  int rc = 0;
+
+  for (i = win->first; i < win->first + win->count; i++) {
+    if (starts[i] > cur) {
+      if (power2_allocator_reserve(copy, cur, starts[i] - cur)) {
+        rc = -1;
+        goto undo;
+      }
+      reserved[nreserved++] = cur;
+    }
+    if (starts[i] + sizes[i] > cur) {
+      cur = starts[i] + sizes[i];
+    }
+  }
+  if (cur < win->index + size) {
+    if (power2_allocator_reserve(copy, cur, win->index + size - cur)) {
+      rc = -1;
+      goto undo;
+    }
+    reserved[nreserved++] = cur;
+  }
+
+  /* Place the largest allocations first */
+  for (i = 0; i < win->count; i++) {
+    moves[i].old_index = starts[win->first + i];
+    moves[i].size = sizes[win->first + i];
+    moves[i].new_index = -1;
+  }
+  for (i = 1; i < win->count; i++) {
+    power2_allocator_move_t move = moves[i];
+    for (j = i; j > 0 && moves[j - 1].size < move.size; j--) {
+      moves[j] = moves[j - 1];
+    }
+    moves[j] = move;
+  }
+  for (m = 0; m < win->count; m++) {
+    moves[m].new_index = power2_allocator_alloc(copy, moves[m].size);
+    if (moves[m].new_index == (uint32_t)-1) {
+      rc = -1;
+      break;
+    }
+  }
+
+  for (k = 0; k < m; k++) {
+    power2_allocator_release(copy, moves[k].new_index);
   }
+undo:
+  for (k = 0; k < nreserved; k++) {
+    power2_allocator_release(copy, reserved[k]);
+  }
+  return rc;
+}
 
-  /* When count > 1, the index will be aligned at the highest log available.
-   * So we do not have to coalesce the prev-free block
-   */
-  size = power2_allocator_get_index_size(allocator, index);
-  if (size == (uint32_t)-1) {
+/** \brief power2_allocator_plan_compaction
+  *        Find the fewest allocations to move so that size can be allocated
+  *
+  * \param allocator The power2 allocator, which is not changed
+  * \param size The size which should fit
+  * \param moves Filled with the moves
+  * \param max_moves The most moves which can be returned
+  * \param num_moves Set to the number of moves, 0 if size already fits
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if no plan with at most max_moves moves was found
+  */
+int power2_allocator_plan_compaction(power2_allocator_t *allocator,
+                                     uint32_t size,
+                                     power2_allocator_move_t *moves,
+                                     uint32_t max_moves,
+                                     uint32_t *num_moves) {
+  power2_allocator_plan_window_t windows[POWER2_ALLOCATOR_PLAN_TRIES];
+  power2_allocator_plan_window_t win;
+  power2_allocator_frag_stats_t frag;
+  power2_allocator_t *copy = NULL;
+  uint32_t *starts = NULL, *sizes = NULL, *reserved = NULL;
+  uint32_t nwindows = 0;
+  uint32_t align, n, lo, hi;
+  uint32_t i, j;
+  int index;
+  int rc = -1;
+
+  if (!allocator || !num_moves || (max_moves && !moves) || size == 0 ||
+      size > allocator->max_size) {
     return -1;
   }
-
-  log2 = log2_uint32_ceil(size);
-  if (log2 != allocator->no_free_lists - 1) {
+  *num_moves = 0;
+  power2_allocator_get_frag_stats(allocator, &frag);
+  if (frag.largest_alloc_size >= size) {
+    return 0;
+  }
+  if (max_moves == 0) {
     return -1;
   }
+  align = 1u << log2_uint32_ceil(size);
 
-  for (i = 0; i < count; i++) {
-    free_size = size;
-    free_index = index;
+  /* Allocations in index order */
+  n = allocator->used_blocks;
+  starts = (uint32_t *)bf_sys_malloc(n * sizeof(uint32_t));
+  sizes = (uint32_t *)bf_sys_malloc(n * sizeof(uint32_t));
+  /* Free parts of a window reserved while planning, one more than moves */
+  reserved = (uint32_t *)bf_sys_malloc(
+      ((max_moves < n ? max_moves : n) + 1) * sizeof(uint32_t));
+  if (starts == NULL || sizes == NULL || reserved == NULL) {
+    goto done;
+  }
+  index = power2_allocator_first_alloc(allocator);
+  for (i = 0; i < n && index != -1; i++) {
+    starts[i] = index;
+    sizes[i] = power2_allocator_get_index_size(allocator, index);
+    index = power2_allocator_next_alloc(allocator, index);
+  }
+  bf_sys_assert(i == n && index == -1);
 
-    next_index =
-        power2_allocator_get_next_inuse_block(allocator, index, &next_size);
-    if (next_index == (uint32_t)-1) {
-      next_index = allocator->total_size;
+  /* Count the allocations overlapping each aligned window and keep the
+   * windows needing the fewest moves, then the fewest indexes moved
+   */
+  for (win.index = 0, lo = 0, hi = 0;
+       (uint64_t)win.index + size <= allocator->total_size;
+       win.index += align) {
+    while (lo < n && starts[lo] + sizes[lo] <= win.index) {
+      lo++;
     }
-    free_size += next_index - (index + size);
-    /* Remove it from the free list */
-    rc = power2_allocator_remove_free_index(
-        allocator, index + size, next_index - (index + size));
-    if (rc) {
-      bf_sys_assert(0);
-      return -1;
+    if (hi < lo) {
+      hi = lo;
+    }
+    while (hi < n && starts[hi] < win.index + size) {
+      hi++;
+    }
+    win.first = lo;
+    win.count = hi - lo;
+    if (win.count == 0 || win.count > max_moves) {
+      continue;
+    }
+    for (win.moved = 0, i = lo; i < hi; i++) {
+      win.moved += sizes[i];
+    }
+    for (i = nwindows; i > 0; i--) {
+      if (windows[i - 1].count < win.count ||
+          (windows[i - 1].count == win.count &&
+           windows[i - 1].moved <= win.moved)) {
+        break;
+      }
+    }
+    if (i == POWER2_ALLOCATOR_PLAN_TRIES) {
+      continue;
     }
+    if (nwindows < POWER2_ALLOCATOR_PLAN_TRIES) {
+      nwindows++;
+    }
+    for (j = nwindows - 1; j > i; j--) {
+      windows[j] = windows[j - 1];
+    }
+    windows[i] = win;
+  }
 
-    rc = power2_allocator_insert_one_free(allocator, free_index, free_size);
-    if (rc) {
-      bf_sys_assert(0);
-      return -1;
+  copy = power2_allocator_make_copy(allocator);
+  if (copy == NULL) {
+    goto done;
+  }
+  for (i = 0; i < nwindows; i++) {
+    if (!power2_allocator_plan_window(
+            copy, &windows[i], size, starts, sizes, reserved, moves)) {
+      *num_moves = windows[i].count;
+      rc = 0;
+      break;
     }
-    power2_allocator_mark_free(allocator, index);
-    index += (1 << log2);
   }
 
-  POWER2_ALLOCATOR_ASSERT(allocator);
-  return 0;
+done:
+  power2_allocator_destroy(copy);
+  bf_sys_free(starts);
+  bf_sys_free(sizes);
+  bf_sys_free(reserved);
+  return rc;
 }
 
-/** \brief power2_allocator_alloc_count_by_size
-  *        Get the number of allocated elements of a given size.
-  *
-  * \param allocator The power2 allocator.
-  * \param size The size of the element.
-  * \return The number of elements allocated of the specified size.
-  */
-int power2_allocator_alloc_count_by_size(power2_allocator_t *allocator,
-                                         uint32_t size) {
-  int count = 0;
-  if (size > allocator->max_size) return 0;
+static int power2_allocator_batch_cmp_asc(const void *a, const void *b) {
+  return -power2_allocator_batch_cmp_desc(a, b);
+}
+
+/* Returns the start of the free chunk holding a free index. size is set to
+ * the size of the chunk.
+ */
+static uint32_t power2_allocator_find_free_chunk(power2_allocator_t *allocator,
+                                                 uint32_t free_index,
+                                                 uint32_t *size) {
+  PWord_t Pfree;
+  Word_t index;
+  uint32_t log2;
 
-  Word_t Index = 0;
-  PWord_t PValue = NULL;
-  JLF(PValue, allocator->inuse_list, Index);
-  while (PValue) {
-    if (*PValue == size) {
-      ++count;
+  for (log2 = 0; log2 < allocator->no_free_lists; log2++) {
+    index = free_index & ~((1u << log2) - 1);
+    JLG(Pfree, allocator->free_lists[log2], index);
+    if (Pfree && index + *Pfree > free_index) {
+      *size = *Pfree;
+      return index;
     }
-    JLN(PValue, allocator->inuse_list, Index);
   }
-  return count;
+  bf_sys_assert(0);
+  *size = 0;
+  return -1;
 }
 
-/* power2_allocator_usage basically gives the number of indices in use.
- * This is different from the power2_allocator_alloc_count and
- * power2_allocator_alloc_count_by_size which just gives the number of
- * in_use_lists and not the overall number of indices in use.
+/* Claims the allocations of a set batch, sorted by index and all known to be
+ * free. The free chunks overlapping a cluster of allocations are removed
+ * together and the gaps between the allocations re-split once. Since the
+ * free chunks of a run are its greedy split, re-splitting from the first to
+ * the last chunk removed gives back the split of the whole run.
  */
+static int power2_allocator_set_int(power2_allocator_t *allocator,
+                                    power2_allocator_batch_t *batch,
+                                    const uint32_t *sizes,
+                                    uint32_t n) {
+  uint32_t chunk_index, chunk_size;
+  uint32_t start, end, cur;
+  uint32_t index, size;
+  uint32_t i = 0, j = 0, k = 0;
+  int rc;
 
-int power2_allocator_usage(power2_allocator_t *allocator) {
-  int count = 0;
-
-  Word_t Index = 0;
-  PWord_t PValue = NULL;
-  JLF(PValue, allocator->inuse_list, Index);
-  while (PValue) {
-    count += (*PValue);
-    JLN(PValue, allocator->inuse_list, Index);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    for (i = 0; i < n; i++) {
+      rc = power2_allocator_mark_inuse(
+          allocator, batch[i].key, sizes[batch[i].pos]);
+      if (rc) {
+        return -1;
+      }
+    }
+    return 0;
   }
-  return count;
-}
 
-uint32_t power2_allocator_alloc_count(power2_allocator_t *allocator) {
-  if (!allocator) return 0;
-  Word_t Rc_word;
-  JLC(Rc_word, allocator->inuse_list, 0, -1);
-  uint32_t r = Rc_word;
-  return r;
+  for (i = 0; i < n; i = j) {
+    start = power2_allocator_find_free_chunk(
+        allocator, batch[i].key, &chunk_size);
+    if (start == (uint32_t)-1) {
+      return -1;
+    }
+    /* Blocks starting in the chunks already covered join the cluster */
+    end = 0;
+    for (j = i; j < n && (j == i || batch[j].key < end); j++) {
+      chunk_index = power2_allocator_find_free_chunk(
+          allocator, batch[j].key + sizes[batch[j].pos] - 1, &chunk_size);
+      if (chunk_index == (uint32_t)-1) {
+        return -1;
+      }
+      if (chunk_index + chunk_size > end) {
+        end = chunk_index + chunk_size;
+      }
+    }
+
+    rc = power2_allocator_remove_free_index(allocator, start, end - start);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+    cur = start;
+    for (k = i; k < j; k++) {
+      index = batch[k].key;
+      size = sizes[batch[k].pos];
+      rc = power2_allocator_insert_one_free(allocator, cur, index - cur);
+      rc |= power2_allocator_mark_inuse(allocator, index, size);
+      if (rc) {
+        bf_sys_assert(0);
+        return -1;
+      }
+      cur = index + size;
+    }
+    rc = power2_allocator_insert_one_free(allocator, cur, end - cur);
+    if (rc) {
+      bf_sys_assert(0);
+      return -1;
+    }
+  }
+  return 0;
 }
 
-/* The power2_allocator_set API is not complete and doesn't work for
- * all cases i.e. for alloc_index = 8 and size 5 if the 13-15 are
- * already in use, it's not working now. For now, instead of trying
- * to handle this (and expose any other issues), going ahead with making a
- * backup copy of the table and then restoring from it
- */
-#ifdef NOT_COMPLETE
-/** \brief power2_allocator_set
+/** \brief power2_allocator_set_batch
   *        This is used to handle the backup/restore operations where
-  *         the client may need to set a particular index for use with certain
-  *         size. The library however does some sanity checks to ensure that
-  *         it's internal state is not harmed and returns error
+  *         the client needs to set particular indexes for use with certain
+  *         sizes. Either all of the indexes are set or none.
   *
   * \param allocator The power2 allocator
-  * \param index Index to set
-  * \param size The size that was allocated for this index
-  * \return Index of the allocated space. -1 if there are any errors
+  * \param indexes The indexes to set
+  * \param sizes The size that was allocated for each index
+  * \param n The number of indexes
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if any of the blocks is out of range, not free or overlaps
+  *         another one of the batch, the allocator is left unchanged
   */
-int power2_allocator_set(power2_allocator_t *allocator,
-                         uint32_t alloc_index,
-                         uint32_t size) {
-  if (!allocator || (allocator->max_size < size)) {
-    return -1;
-  }
+int power2_allocator_set_batch(power2_allocator_t *allocator,
+                               const uint32_t *indexes,
+                               const uint32_t *sizes,
+                               uint32_t n) {
+  power2_allocator_batch_t *batch;
+  uint32_t prev_index, prev_size;
+  uint32_t run_end = 0;
+  uint64_t end;
+  uint32_t index, size;
+  uint32_t i = 0;
+  int rc = -1;
 
-  if ((alloc_index + size) > allocator->total_size) {
+  if (!allocator || (n && (!indexes || !sizes))) {
     return -1;
   }
-
-  if (power2_allocator_get_index_size(allocator, alloc_index) != -1) {
-    return -1;
+  if (n == 0) {
+    return 0;
   }
 
-  /* Make sure that the alloc_index lies in the free range */
-  uint32_t next_index =
-      power2_allocator_get_next_used_index(allocator, alloc_index);
-  if ((next_index != -1) && ((alloc_index + size) >= next_index)) {
+  batch = (power2_allocator_batch_t *)bf_sys_malloc(
+      n * sizeof(power2_allocator_batch_t));
+  if (batch == NULL) {
     return -1;
   }
-
-  uint32_t prev_index =
-      power2_allocator_get_prev_used_index(allocator, alloc_index);
-  if (prev_index != -1) {
-    uint32_t prev_size = power2_allocator_get_index_size(allocator, prev_index);
-    if ((prev_index + prev_size) >= alloc_index) {
-      return -1;
+  for (i = 0; i < n; i++) {
+    batch[i].key = indexes[i];
+    batch[i].pos = i;
+  }
+  qsort(batch, n, sizeof(power2_allocator_batch_t),
+        power2_allocator_batch_cmp_asc);
+
+  /* Check everything before changing anything */
+  for (i = 0; i < n; i++) {
+    index = batch[i].key;
+    size = sizes[batch[i].pos];
+    end = (uint64_t)index + size;
+    if (size == 0 || size > allocator->max_size ||
+        end > allocator->total_size) {
+      goto done;
     }
-  }
-
-  Word_t index;
-  Word_t log2_index;
-  PWord_t Pfree;
-  int Rc_int;
-  uint32_t log2;
-  uint32_t found_index;
-  uint32_t found_log2;
-  bool found = false;
-
-  log2 = log2_uint32_ceil(size);
-
-  log2_index = log2;
-  JLF(Pfree, allocator->free_list, log2_index);
-  while (Pfree) {
-    index = alloc_index;
-    J1L(Rc_int, *(Pvoid_t *)Pfree, index);
-    if (!Rc_int) {
-      JLN(Pfree, allocator->free_list, log2_index);
+    if (i && index < batch[i - 1].key + sizes[batch[i - 1].pos]) {
+      goto done;
+    }
+    if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+      if (!power2_bitmap_is_free(allocator->bitmap, index, size)) {
+        goto done;
+      }
       continue;
     }
-    if (alloc_index < (index + (1 << log2_index))) {
-      found_index = index;
-      found_log2 = log2_index;
-      found = true;
-      break;
+    /* Blocks in the free run of the previous block only need to end in it */
+    if (i == 0 || index >= run_end) {
+      if (power2_allocator_get_index_size(allocator, index) != (uint32_t)-1) {
+        goto done;
+      }
+      prev_index =
+          power2_allocator_get_prev_inuse_block(allocator, index, &prev_size);
+      if (prev_index != (uint32_t)-1 && prev_index + prev_size > index) {
+        goto done;
+      }
+      run_end = power2_allocator_get_next_inuse_block(
+          allocator, index, &prev_size);
+      if (run_end == (uint32_t)-1) {
+        run_end = allocator->total_size;
+      }
+    }
+    if (end > run_end) {
+      goto done;
     }
-    JLN(Pfree, allocator->free_list, log2_index);
-  }
-  if (!found) {
-    return -1;
   }
 
-  bf_sys_assert(found_index <= alloc_index);
-  power2_allocator_remove_one_free(allocator, found_log2, false, found_index);
-  power2_allocator_split_and_free(
-      allocator, found_index, alloc_index - found_index);
-  /* Free up the remaining space */
-  power2_allocator_split_and_free(
-      allocator,
-      alloc_index + size,
-      (found_index + (1 << found_log2)) - (size + alloc_index));
-
-  /* Actually allocate this index by removing in free list */
-  int rc = power2_allocator_mark_inuse(allocator, alloc_index, size);
-  if (rc) {
-    return -1;
+  if (power2_allocator_unshare(allocator)) {
+    goto done;
   }
+  rc = power2_allocator_set_int(allocator, batch, sizes, n);
+  POWER2_ALLOCATOR_ASSERT(allocator);
 
-  return 0;
+done:
+  bf_sys_free(batch);
+  return rc;
+}
+
+/** \brief power2_allocator_set
+  *        This is used to handle the backup/restore operations where
+  *         the client may need to set a particular index for use with certain
+  *         size. The library however does some sanity checks to ensure that
+  *         it's internal state is not harmed and returns error
+  *
+  * \param allocator The power2 allocator
+  * \param alloc_index Index to set
+  * \param size The size that was allocated for this index
+  * \return Status of the operation. 0 for SUCCESS.
+  *         -1 if the block is out of range or not free
+  */
+int power2_allocator_set(power2_allocator_t *allocator,
+                         uint32_t alloc_index,
+                         uint32_t size) {
+  return power2_allocator_set_batch(allocator, &alloc_index, &size, 1);
 }
-#endif
 
 int power2_allocator_first_alloc(power2_allocator_t *allocator) {
   PWord_t Pinuse;
@@ -983,6 +2549,9 @@ int power2_allocator_first_alloc(power2_allocator_t *allocator) {
   if (allocator == NULL) {
     return -1;
   }
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    return power2_bitmap_next_alloc(allocator->bitmap, 0);
+  }
   JLF(Pinuse, allocator->inuse_list, index);
   if (Pinuse) {
     return index;
@@ -997,6 +2566,9 @@ int power2_allocator_next_alloc(power2_allocator_t *allocator, int idx) {
   if (allocator == NULL) {
     return -1;
   }
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    return power2_bitmap_next_alloc(allocator->bitmap, idx + 1);
+  }
   JLN(Pinuse, allocator->inuse_list, index);
   if (Pinuse) {
     return index;
@@ -1014,6 +2586,17 @@ void power2_allocator_print(power2_allocator_t *allocator) {
     return;
   }
 
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    printf("USED\n");
+    index = power2_bitmap_next_alloc(allocator->bitmap, 0);
+    while (index != (uint32_t)-1) {
+      size = power2_bitmap_get_index_size(allocator->bitmap, index);
+      printf("\t\tIndex %-8d: Size %-8d\n", (uint32_t)index, size);
+      index = power2_bitmap_next_alloc(allocator->bitmap, index + 1);
+    }
+    return;
+  }
+
   printf("FREE\n");
   uint32_t log2_index;
   for (log2_index = 0; log2_index < allocator->no_free_lists; log2_index++) {
@@ -1085,10 +2668,59 @@ void power2_allocator_free_list_assert(power2_allocator_t *allocator,
   }
 }
 
+/* Checks the usage counters against the allocations */
+static void power2_allocator_assert_counters(power2_allocator_t *allocator) {
+  Pvoid_t size_counts = NULL;
+  uint32_t log2_counts[POWER2_ALLOCATOR_LOG2_COUNTS];
+  PWord_t Pcount;
+  PWord_t Pcount_exp;
+  Word_t size;
+  Word_t Rc_word;
+  uint32_t used_indexes = 0;
+  uint32_t used_blocks = 0;
+  uint32_t i;
+  int index;
+
+  memset(log2_counts, 0, sizeof(log2_counts));
+  index = power2_allocator_first_alloc(allocator);
+  while (index != -1) {
+    size = power2_allocator_get_index_size(allocator, index);
+    used_indexes += size;
+    used_blocks++;
+    log2_counts[log2_uint32_ceil(size)]++;
+    JLI(Pcount, size_counts, size);
+    bf_sys_assert(Pcount != PJERR);
+    (*Pcount)++;
+    index = power2_allocator_next_alloc(allocator, index);
+  }
+  bf_sys_assert(used_indexes == allocator->used_indexes);
+  bf_sys_assert(used_blocks == allocator->used_blocks);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    bf_sys_assert(power2_bitmap_used_count(allocator->bitmap) == used_indexes);
+    bf_sys_assert(power2_bitmap_alloc_count(allocator->bitmap) == used_blocks);
+  }
+  for (i = 0; i < POWER2_ALLOCATOR_LOG2_COUNTS; i++) {
+    bf_sys_assert(log2_counts[i] == allocator->log2_counts[i]);
+  }
+  JLC(Rc_word, size_counts, 0, -1);
+  JLC(size, allocator->size_counts, 0, -1);
+  bf_sys_assert(Rc_word == size);
+  size = 0;
+  JLF(Pcount, size_counts, size);
+  while (Pcount) {
+    JLG(Pcount_exp, allocator->size_counts, size);
+    bf_sys_assert(Pcount_exp && *Pcount_exp == *Pcount);
+    JLN(Pcount, size_counts, size);
+  }
+  JLFA(Rc_word, size_counts);
+  (void)Rc_word;
+}
+
 void power2_allocator_assert(power2_allocator_t *allocator) {
   Pvoid_t free_array = NULL;
   Pvoid_t inuse_array = NULL;
   PWord_t Pfree;
+  PWord_t Psize;
   PWord_t Pinuse;
   Word_t index;
   Word_t Rc_word;
@@ -1100,6 +2732,12 @@ void power2_allocator_assert(power2_allocator_t *allocator) {
     return;
   }
 
+  power2_allocator_assert_counters(allocator);
+  if (allocator->engine == POWER2_ALLOCATOR_ENGINE_BITMAP) {
+    power2_bitmap_assert(allocator->bitmap);
+    return;
+  }
+
   /* For each of the indexes that are in the free list, make sure that they
    * are not in inuse list
    */
@@ -1111,6 +2749,10 @@ void power2_allocator_assert(power2_allocator_t *allocator) {
       size = *Pfree;
       bf_sys_assert(size <= (1u << log2_index));
       bf_sys_assert(size > ((1u << log2_index) >> 1));
+      JLG(Psize, allocator->size_lists[log2_index], (Word_t)size);
+      bf_sys_assert(Psize);
+      J1T(Rc_int, *(Pvoid_t *)Psize, index);
+      bf_sys_assert(Rc_int);
       for (i = index; i < index + size; i++) {
         Word_t free_index = i;
         J1S(Rc_int, free_array, free_index);
@@ -1118,6 +2760,17 @@ void power2_allocator_assert(power2_allocator_t *allocator) {
       }
       JLN(Pfree, allocator->free_lists[log2_index], index);
     }
+
+    /* The size index must not hold anything beyond the free list */
+    Word_t free_count, size_count = 0, size_key = 0;
+    JLC(free_count, allocator->free_lists[log2_index], 0, -1);
+    JLF(Psize, allocator->size_lists[log2_index], size_key);
+    while (Psize) {
+      J1C(Rc_word, *(Pvoid_t *)Psize, 0, -1);
+      size_count += Rc_word;
+      JLN(Psize, allocator->size_lists[log2_index], size_key);
+    }
+    bf_sys_assert(free_count == size_count);
   }
 
   index = 0;
@@ -1131,6 +2784,33 @@ void power2_allocator_assert(power2_allocator_t *allocator) {
     JLN(Pinuse, allocator->inuse_list, index);
   }
 
+  /* The free run index holds the gaps between the allocations longer than
+   * max_size
+   */
+  Word_t run_index = 0, run_count = 0;
+  index = 0;
+  JLF(Pinuse, allocator->inuse_list, index);
+  while (true) {
+    Word_t run_end = Pinuse ? index : allocator->total_size;
+    if (run_index + allocator->max_size < run_end) {
+      PWord_t Prun;
+      JLG(Prun, allocator->free_runs, run_index);
+      bf_sys_assert(Prun && *Prun == run_end - run_index);
+      JLG(Psize, allocator->run_sizes, *Prun);
+      bf_sys_assert(Psize);
+      J1T(Rc_int, *(Pvoid_t *)Psize, run_index);
+      bf_sys_assert(Rc_int);
+      run_count++;
+    }
+    if (!Pinuse) {
+      break;
+    }
+    run_index = index + *Pinuse;
+    JLN(Pinuse, allocator->inuse_list, index);
+  }
+  JLC(Rc_word, allocator->free_runs, 0, -1);
+  bf_sys_assert(Rc_word == run_count);
+
   int Rc_free, Rc_inuse;
   /* Now verify that there's no overlap */
   for (i = 0; i < allocator->total_size; i++) {
@@ -1172,9 +2852,22 @@ void power2_allocator_assert(power2_allocator_t *allocator) {
 }
 
 int power2_alloc_utest(void) {
-  power2_allocator_t *a1 = NULL, *a2 = NULL;
+  power2_allocator_t *a1 = NULL, *a2 = NULL, *a3 = NULL;
+  power2_allocator_t *b1 = NULL, *b2 = NULL;
+  power2_allocator_t *a4 = NULL, *copy1 = NULL, *copy2 = NULL;
+  power2_allocator_stats_t stats;
+  uint32_t batch_sizes[10] = {3, 16, 1, 5, 16, 2, 8, 16, 3, 1};
+  uint32_t batch_full[8] = {16, 16, 16, 16, 16, 16, 16, 16};
+  power2_allocator_frag_stats_t frag;
+  power2_allocator_move_t moves[8];
+  uint32_t image[6 + 2 * 9];
+  uint32_t batch_indexes[11];
+  uint32_t set_pairs[2];
   uint32_t index = 0;
+  const power2_allocator_engine_t engines[] = {POWER2_ALLOCATOR_ENGINE_JUDY,
+                                               POWER2_ALLOCATOR_ENGINE_BITMAP};
   uint32_t r = 0, c = 0, s = 0;
+  size_t e;
   int rc = 0;
 
   a1 = power2_allocator_create(1024, 2);
@@ -1298,7 +2991,459 @@ int power2_alloc_utest(void) {
   bf_sys_assert(ctz(index) >= log2_uint32_ceil(r));
   power2_allocator_assert(a2);
 
+  /* Leave only undersized fragments in the size 4 free list except for the
+   * last chunk, which the size index must find directly.
+   */
+  a3 = power2_allocator_create(4, 64);
+  bf_sys_assert(a3);
+  for (c = 0; c < 64; c++) {
+    index = power2_allocator_alloc(a3, 4);
+    bf_sys_assert(index != (uint32_t)-1);
+  }
+  for (c = 0; c < 64; c++) {
+    rc = power2_allocator_release(a3, c * 4);
+    bf_sys_assert(!rc);
+    if (c != 40) {
+      rc = power2_allocator_reserve(a3, c * 4 + 3, 1);
+      bf_sys_assert(!rc);
+    }
+  }
+  power2_allocator_assert(a3);
+
+  index = power2_allocator_alloc(a3, 4);
+  bf_sys_assert(index == 160);
+  power2_allocator_assert(a3);
+
+  index = power2_allocator_alloc(a3, 4);
+  bf_sys_assert(index == (uint32_t)-1);
+
+  index = power2_allocator_alloc(a3, 3);
+  bf_sys_assert(index == 0);
+  power2_allocator_assert(a3);
+
+  /* Bitmap engine, which places blocks at the lowest aligned fit */
+  b1 = power2_allocator_create_engine(1024, 2, POWER2_ALLOCATOR_ENGINE_BITMAP);
+  bf_sys_assert(b1);
+
+  index = power2_allocator_alloc(b1, 1);
+  bf_sys_assert(index == 0);
+  index = power2_allocator_alloc(b1, 3);
+  bf_sys_assert(index == 4);
+  index = power2_allocator_alloc(b1, 50);
+  bf_sys_assert(index == 64);
+  power2_allocator_assert(b1);
+
+  rc = power2_allocator_reserve(b1, 100, 20);
+  // Fail
+  bf_sys_assert(rc);
+  rc = power2_allocator_reserve(b1, 1, 3);
+  bf_sys_assert(!rc);
+  rc = power2_allocator_reserve(b1, 1020, 10);
+  bf_sys_assert(!rc);
+  power2_allocator_assert(b1);
+  bf_sys_assert(power2_allocator_get_index_size(b1, 64) == 50);
+  bf_sys_assert(power2_allocator_get_index_size(b1, 1) == 3);
+  bf_sys_assert(power2_allocator_get_index_size(b1, 2) == (uint32_t)-1);
+  bf_sys_assert(power2_allocator_usage(b1) == 67);
+  bf_sys_assert(power2_allocator_alloc_count(b1) == 5);
+  bf_sys_assert(power2_allocator_alloc_count_by_size(b1, 3) == 2);
+
+  /* 1020-1029 is in use so neither 1024 block is fully free */
+  index = power2_allocator_alloc(b1, 1024);
+  bf_sys_assert(index == (uint32_t)-1);
+  index = power2_allocator_alloc(b1, 512);
+  bf_sys_assert(index == 512 + 1024);
+  index = power2_allocator_alloc(b1, 100);
+  bf_sys_assert(index == 128);
+  power2_allocator_assert(b1);
+
+  index = power2_allocator_first_alloc(b1);
+  bf_sys_assert(index == 0);
+  index = power2_allocator_next_alloc(b1, index);
+  bf_sys_assert(index == 1);
+  index = power2_allocator_next_alloc(b1, 1020);
+  bf_sys_assert(index == 1536);
+  index = power2_allocator_next_alloc(b1, index);
+  bf_sys_assert(index == (uint32_t)-1);
+
+  rc = power2_allocator_release(b1, 1020);
+  bf_sys_assert(!rc);
+  rc = power2_allocator_release(b1, 1020);
+  bf_sys_assert(rc);
+  index = power2_allocator_alloc(b1, 1000);
+  bf_sys_assert(index == (uint32_t)-1);
+  rc = power2_allocator_release(b1, 1536);
+  bf_sys_assert(!rc);
+  index = power2_allocator_alloc(b1, 1000);
+  bf_sys_assert(index == 1024);
+  power2_allocator_assert(b1);
+
+  b2 = power2_allocator_create_engine(128, 16, POWER2_ALLOCATOR_ENGINE_BITMAP);
+  bf_sys_assert(b2);
+  index = power2_allocator_alloc_multiple(b2, 1, 1);
+  bf_sys_assert(index == 0);
+  index = power2_allocator_alloc_multiple(b2, 127, 2);
+  bf_sys_assert(index == 256);
+  index = power2_allocator_alloc_multiple(b2, 128, 8);
+  bf_sys_assert(index == 1024);
+  bf_sys_assert(power2_allocator_usage(b2) == 1 + 254 + 1024);
+  power2_allocator_assert(b2);
+  rc = power2_allocator_release_multiple(b2, 256, 2);
+  bf_sys_assert(!rc);
+  rc = power2_allocator_release_multiple(b2, 1024, 8);
+  bf_sys_assert(!rc);
+  bf_sys_assert(power2_allocator_usage(b2) == 1);
+  power2_allocator_assert(b2);
+
+  /* Fill the allocator with mixed sizes, then free every other block and
+   * refill the holes
+   */
+  for (c = 0, s = 1; power2_allocator_usage(b2) < 2000; c++) {
+    s = (s * 7 + 3) % 128 + 1;
+    index = power2_allocator_alloc(b2, s);
+    if (index == (uint32_t)-1) {
+      continue;
+    }
+    bf_sys_assert(ctz(index) >= log2_uint32_ceil(s));
+    bf_sys_assert(power2_allocator_get_index_size(b2, index) == s);
+  }
+  power2_allocator_assert(b2);
+  index = power2_allocator_first_alloc(b2);
+  for (c = 0; index != (uint32_t)-1; c++) {
+    r = power2_allocator_next_alloc(b2, index);
+    if (c & 1) {
+      rc = power2_allocator_release(b2, index);
+      bf_sys_assert(!rc);
+    }
+    index = r;
+  }
+  power2_allocator_assert(b2);
+  for (s = 1; s <= 128; s++) {
+    index = power2_allocator_alloc(b2, s);
+    if (index != (uint32_t)-1) {
+      bf_sys_assert(ctz(index) >= log2_uint32_ceil(s));
+    }
+  }
+  power2_allocator_assert(b2);
+
+  /* The rest runs on each engine */
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    /* Batches are allocated and released all or nothing */
+    a4 = power2_allocator_create_engine(16, 8, engines[e]);
+    bf_sys_assert(a4);
+    rc = power2_allocator_alloc_batch(a4, batch_sizes, 10, batch_indexes);
+    bf_sys_assert(!rc);
+    for (r = 0; r < 10; r++) {
+      bf_sys_assert(ctz(batch_indexes[r]) >=
+                    log2_uint32_ceil(batch_sizes[r]));
+      bf_sys_assert(power2_allocator_get_index_size(a4, batch_indexes[r]) ==
+                    batch_sizes[r]);
+    }
+    bf_sys_assert(power2_allocator_usage(a4) == 71);
+    power2_allocator_assert(a4);
+    /* Repeated index */
+    batch_indexes[10] = batch_indexes[5];
+    rc = power2_allocator_release_batch(a4, &batch_indexes[2], 9);
+    bf_sys_assert(rc == -1);
+    bf_sys_assert(power2_allocator_usage(a4) == 71);
+    rc = power2_allocator_release_batch(a4, &batch_indexes[2], 8);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_usage(a4) == 19);
+    power2_allocator_assert(a4);
+    /* Doesn't fit, nothing is allocated */
+    rc = power2_allocator_alloc_batch(a4, batch_full, 8, batch_indexes);
+    bf_sys_assert(rc == -1);
+    bf_sys_assert(power2_allocator_usage(a4) == 19);
+    bf_sys_assert(power2_allocator_alloc_count(a4) == 2);
+    power2_allocator_assert(a4);
+    rc = power2_allocator_alloc_batch(a4, &batch_sizes[2], 8, batch_indexes);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_usage(a4) == 71);
+    power2_allocator_assert(a4);
+    power2_allocator_destroy(a4);
+
+    /* Multiple blocks smaller than the largest size */
+    a4 = power2_allocator_create_engine(64, 4, engines[e]);
+    bf_sys_assert(a4);
+    index = power2_allocator_alloc(a4, 1);
+    bf_sys_assert(index != (uint32_t)-1);
+    /* 3 blocks of 5, 8 apart, starting on a multiple of 32 */
+    r = power2_allocator_alloc_multiple(a4, 5, 3);
+    bf_sys_assert(r != (uint32_t)-1 && (r % 32) == 0);
+    for (s = 0; s < 3; s++) {
+      bf_sys_assert(power2_allocator_get_index_size(a4, r + s * 8) == 5);
+      bf_sys_assert(power2_allocator_get_index_size(a4, r + s * 8 + 5) ==
+                    (uint32_t)-1);
+    }
+    /* The space between the blocks is still free */
+    bf_sys_assert(power2_allocator_reserve(a4, r + 5, 3) == 0);
+    bf_sys_assert(power2_allocator_usage(a4) == 19);
+    power2_allocator_assert(a4);
+    /* Not all blocks in use */
+    rc = power2_allocator_release_multiple(a4, r, 4);
+    bf_sys_assert(rc);
+    bf_sys_assert(power2_allocator_usage(a4) == 19);
+    rc = power2_allocator_release_multiple(a4, r, 3);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_usage(a4) == 4);
+    power2_allocator_assert(a4);
+    /* 32 blocks of 2 need a free stretch of 64 */
+    r = power2_allocator_alloc_multiple(a4, 2, 32);
+    bf_sys_assert(r != (uint32_t)-1 && (r % 64) == 0);
+    bf_sys_assert(power2_allocator_alloc_count(a4) == 34);
+    index = power2_allocator_alloc_multiple(a4, 2, 128);
+    bf_sys_assert(index == (uint32_t)-1);
+    power2_allocator_assert(a4);
+    rc = power2_allocator_release_multiple(a4, r, 32);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_usage(a4) == 4);
+    power2_allocator_assert(a4);
+    power2_allocator_destroy(a4);
+
+    /* Below the largest size the space between the blocks must be free too,
+     * so with 3 in use 0-2 and 4-6 are passed over for 8-10 and 12-14 */
+    a4 = power2_allocator_create_engine(16, 1, engines[e]);
+    bf_sys_assert(a4);
+    bf_sys_assert(power2_allocator_reserve(a4, 3, 1) == 0);
+    r = power2_allocator_alloc_multiple(a4, 3, 2);
+    bf_sys_assert(r == 8);
+    bf_sys_assert(power2_allocator_usage(a4) == 7);
+    power2_allocator_assert(a4);
+    power2_allocator_destroy(a4);
+
+    /* Blocks of the largest size only need the blocks to be free, the space
+     * between them may be in use */
+    a4 = power2_allocator_create_engine(16, 2, engines[e]);
+    bf_sys_assert(a4);
+    bf_sys_assert(power2_allocator_reserve(a4, 12, 2) == 0);
+    r = power2_allocator_alloc_multiple(a4, 11, 2);
+    bf_sys_assert(r == 0);
+    bf_sys_assert(power2_allocator_get_index_size(a4, 16) == 11);
+    bf_sys_assert(power2_allocator_usage(a4) == 24);
+    power2_allocator_assert(a4);
+    power2_allocator_destroy(a4);
+
+    /* Fragmentation metrics and compaction plan */
+    a4 = power2_allocator_create_engine(16, 8, engines[e]);
+    bf_sys_assert(a4);
+    rc = power2_allocator_get_frag_stats(a4, &frag);
+    bf_sys_assert(!rc);
+    bf_sys_assert(frag.free_indexes == 128 && frag.largest_alloc_size == 16);
+    bf_sys_assert(frag.free_max_blocks == 8 && frag.frag_score == 0);
+    bf_sys_assert(frag.free_chunks_by_log2[4] == 8);
+    /* Every other index in use */
+    for (r = 0; r < 128; r++) {
+      bf_sys_assert(power2_allocator_alloc(a4, 1) != -1);
+    }
+    for (r = 0; r < 128; r += 2) {
+      bf_sys_assert(!power2_allocator_release(a4, r));
+    }
+    rc = power2_allocator_get_frag_stats(a4, &frag);
+    bf_sys_assert(!rc);
+    bf_sys_assert(frag.free_indexes == 64 && frag.largest_alloc_size == 1);
+    bf_sys_assert(frag.free_max_blocks == 0 && frag.frag_score == 100);
+    bf_sys_assert(frag.free_chunks_by_log2[0] == 64);
+    bf_sys_assert(power2_allocator_alloc(a4, 4) == -1);
+
+    rc = power2_allocator_plan_compaction(a4, 4, moves, 1, &s);
+    bf_sys_assert(rc == -1);
+    rc = power2_allocator_plan_compaction(a4, 4, moves, 8, &s);
+    bf_sys_assert(!rc && s == 2);
+    for (r = 0; r < s; r++) {
+      bf_sys_assert(moves[r].size == 1);
+      bf_sys_assert(
+          !power2_allocator_reserve(a4, moves[r].new_index, moves[r].size));
+      bf_sys_assert(!power2_allocator_release(a4, moves[r].old_index));
+    }
+    power2_allocator_assert(a4);
+    index = power2_allocator_alloc(a4, 4);
+    bf_sys_assert(index != (uint32_t)-1);
+    rc = power2_allocator_plan_compaction(a4, 1, moves, 8, &s);
+    bf_sys_assert(!rc && s == 0);
+    power2_allocator_destroy(a4);
+
+    /* Serialize and restore */
+    a4 = power2_allocator_create_engine(16, 8, engines[e]);
+    bf_sys_assert(a4);
+    rc = power2_allocator_alloc_batch(a4, batch_sizes, 10, batch_indexes);
+    bf_sys_assert(!rc);
+    bf_sys_assert(!power2_allocator_release(a4, batch_indexes[4]));
+    bf_sys_assert(power2_allocator_serialize_size(a4) == sizeof(image));
+    rc = power2_allocator_serialize(a4, image, sizeof(image) - 1);
+    bf_sys_assert(rc == -1);
+    rc = power2_allocator_serialize(a4, image, sizeof(image));
+    bf_sys_assert(!rc);
+    copy1 = power2_allocator_deserialize(image, sizeof(image));
+    bf_sys_assert(copy1 && copy1->engine == a4->engine);
+    power2_allocator_assert(copy1);
+    bf_sys_assert(power2_allocator_usage(copy1) == 55);
+    bf_sys_assert(power2_allocator_alloc_count(copy1) == 9);
+    for (r = 0; r < 10; r++) {
+      bf_sys_assert(power2_allocator_get_index_size(copy1, batch_indexes[r]) ==
+                    (r == 4 ? (uint32_t)-1 : batch_sizes[r]));
+    }
+    bf_sys_assert(power2_allocator_alloc(copy1, 16) == (int)batch_indexes[4]);
+    power2_allocator_destroy(copy1);
+    /* Truncated or overlapping */
+    bf_sys_assert(!power2_allocator_deserialize(image, sizeof(image) - 1));
+    image[8] = image[6];
+    bf_sys_assert(!power2_allocator_deserialize(image, sizeof(image)));
+    power2_allocator_destroy(a4);
+
+    /* Replay the allocations of one allocator into another */
+    a4 = power2_allocator_create_engine(16, 8, engines[e]);
+    copy1 = power2_allocator_create_engine(16, 8, engines[e]);
+    bf_sys_assert(a4 && copy1);
+    rc = power2_allocator_alloc_batch(a4, batch_sizes, 10, batch_indexes);
+    bf_sys_assert(!rc);
+    rc = power2_allocator_set_batch(copy1, batch_indexes, batch_sizes, 10);
+    bf_sys_assert(!rc);
+    power2_allocator_assert(copy1);
+    bf_sys_assert(power2_allocator_usage(copy1) == 71);
+    bf_sys_assert(power2_allocator_alloc_count(copy1) == 10);
+    for (r = 0; r < 10; r++) {
+      bf_sys_assert(power2_allocator_get_index_size(copy1, batch_indexes[r]) ==
+                    batch_sizes[r]);
+    }
+    /* Overlapping, in use or out of range blocks leave it unchanged */
+    rc = power2_allocator_release(copy1, batch_indexes[4]);
+    bf_sys_assert(!rc);
+    set_pairs[0] = batch_indexes[4] + 8;
+    set_pairs[1] = batch_indexes[4];
+    rc = power2_allocator_set_batch(copy1, set_pairs, batch_full, 2);
+    bf_sys_assert(rc == -1);
+    rc = power2_allocator_set(copy1, set_pairs[0], 1);
+    bf_sys_assert(!rc);
+    rc = power2_allocator_set(copy1, batch_indexes[4], 16);
+    bf_sys_assert(rc == -1);
+    rc = power2_allocator_release(copy1, set_pairs[0]);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_set(copy1, batch_indexes[4], 17) == -1);
+    bf_sys_assert(power2_allocator_set(copy1, 127, 2) == -1);
+    bf_sys_assert(power2_allocator_usage(copy1) == 55);
+    rc = power2_allocator_set(copy1, batch_indexes[4], 16);
+    bf_sys_assert(!rc);
+    bf_sys_assert(power2_allocator_usage(copy1) == 71);
+    power2_allocator_assert(copy1);
+    bf_sys_assert(power2_allocator_alloc(copy1, 16) ==
+                  power2_allocator_alloc(a4, 16));
+    power2_allocator_destroy(copy1);
+    power2_allocator_destroy(a4);
+
+    /* Copies share the state until either side changes it */
+    a4 = power2_allocator_create_engine(16, 8, engines[e]);
+    bf_sys_assert(a4);
+    index = power2_allocator_alloc(a4, 3);
+    bf_sys_assert(index != (uint32_t)-1);
+    copy1 = power2_allocator_make_copy(a4);
+    copy2 = power2_allocator_make_copy(copy1);
+    bf_sys_assert(copy1 && copy2);
+    r = power2_allocator_alloc(a4, 16);
+    bf_sys_assert(r != (uint32_t)-1);
+    bf_sys_assert(power2_allocator_usage(a4) == 19);
+    bf_sys_assert(power2_allocator_usage(copy1) == 3);
+    bf_sys_assert(power2_allocator_usage(copy2) == 3);
+    bf_sys_assert(power2_allocator_get_index_size(copy1, r) == (uint32_t)-1);
+    bf_sys_assert(power2_allocator_alloc(copy2, 5) != -1);
+    bf_sys_assert(power2_allocator_usage(copy1) == 3);
+    power2_allocator_assert(a4);
+    power2_allocator_assert(copy1);
+    power2_allocator_assert(copy2);
+
+    /* Restore twice from the same copy */
+    for (s = 0; s < 2; s++) {
+      rc = power2_allocator_restore(a4, copy1);
+      bf_sys_assert(!rc);
+      bf_sys_assert(power2_allocator_usage(a4) == 3);
+      bf_sys_assert(power2_allocator_get_index_size(a4, index) == 3);
+      bf_sys_assert(power2_allocator_alloc(a4, 16) != -1);
+      rc = power2_allocator_release(a4, index);
+      bf_sys_assert(!rc);
+      bf_sys_assert(power2_allocator_usage(a4) == 16);
+      bf_sys_assert(power2_allocator_usage(copy1) == 3);
+      power2_allocator_assert(a4);
+    }
+    rc = power2_allocator_get_stats(a4, &stats);
+    bf_sys_assert(!rc);
+    bf_sys_assert(stats.total_size == 128 && stats.max_size == 16);
+    bf_sys_assert(stats.used_indexes == 16 && stats.free_indexes == 112);
+    bf_sys_assert(stats.alloc_count == 1);
+    bf_sys_assert(stats.alloc_count_by_log2[4] == 1);
+    bf_sys_assert(power2_allocator_alloc_count_by_size(a4, 16) == 1);
+    rc = power2_allocator_get_stats(copy2, &stats);
+    bf_sys_assert(!rc);
+    bf_sys_assert(stats.used_indexes == 8 && stats.alloc_count == 2);
+    bf_sys_assert(stats.alloc_count_by_log2[2] == 1);
+    bf_sys_assert(stats.alloc_count_by_log2[3] == 1);
+    bf_sys_assert(power2_allocator_alloc_count_by_size(copy2, 3) == 1);
+    bf_sys_assert(power2_allocator_alloc_count_by_size(copy2, 5) == 1);
+    bf_sys_assert(power2_allocator_alloc_count_by_size(copy2, 4) == 0);
+    rc = power2_allocator_restore(a4, b1);
+    bf_sys_assert(rc == -1);
+    power2_allocator_destroy(copy1);
+    power2_allocator_destroy(copy2);
+    power2_allocator_destroy(a4);
+  }
+
   power2_allocator_destroy(a1);
   power2_allocator_destroy(a2);
+  power2_allocator_destroy(a3);
+  power2_allocator_destroy(b1);
+  power2_allocator_destroy(b2);
+  return 0;
+}
+
+#ifdef POWER2_ALLOCATOR_BENCH
+
+#include <time.h>
+
+#define BENCH_ITERS 2000
+
+/* Latency of an alloc and release of a size 4 block when the free list of
+ * its log2 also holds N undersized fragments of size 3, for N from 1K to 1M.
+ * The size index keeps it flat, a walk of the free list grows with N. */
+int power2_alloc_bench_main(void) {
+  uint32_t counts[] = {1000, 10000, 100000, 1000000};
+  struct timespec start, end;
+  power2_allocator_t *a;
+  uint32_t i, k, n;
+  int index;
+
+  printf("fragments  us per alloc+release\n");
+  for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    n = counts[k];
+    a = power2_allocator_create(4, n + 1);
+    if (!a) {
+      return -1;
+    }
+    for (i = 0; i <= n; i++) {
+      power2_allocator_alloc(a, 4);
+    }
+    /* Leave the first three indexes of every block but the last free */
+    for (i = 0; i < n; i++) {
+      power2_allocator_release(a, i * 4);
+      power2_allocator_reserve(a, i * 4 + 3, 1);
+    }
+    power2_allocator_release(a, n * 4);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERS; i++) {
+      index = power2_allocator_alloc(a, 4);
+      if (index < 0) {
+        power2_allocator_destroy(a);
+        return -1;
+      }
+      power2_allocator_release(a, index);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%9u  %8.2f\n",
+           n,
+           ((end.tv_sec - start.tv_sec) * 1e6 +
+            (end.tv_nsec - start.tv_nsec) / 1e3) /
+               BENCH_ITERS);
+    power2_allocator_destroy(a);
+  }
   return 0;
 }
+
+#endif /* POWER2_ALLOCATOR_BENCH */
@@ -0,0 +1,80 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _POWER2_ALLOCATOR_INT_H_
+#define _POWER2_ALLOCATOR_INT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bitmap engine of the power2 allocator.
+ * One bit per index tells whether the index is in use and a second bit marks
+ * the first index of every allocation, so the size of an allocation is the
+ * distance to the next start bit or the next free index. For every block
+ * size up to 64, a summary bitmap keeps one bit per word of the in use
+ * bitmap, set when a block of that size fits in the word, with a second
+ * summary level above it. Larger blocks are found through the summary of
+ * entirely free words. Searches skip through the summaries with ctz rather
+ * than testing each index.
+ */
+typedef struct power2_bitmap_s power2_bitmap_t;
+
+power2_bitmap_t *power2_bitmap_create(uint32_t total_size);
+void power2_bitmap_destroy(power2_bitmap_t *bitmap);
+power2_bitmap_t *power2_bitmap_copy(power2_bitmap_t *src);
+
+/* Returns the lowest index aligned to align (a power of 2 no smaller than
+ * size) such that size indexes starting there are free. -1 if none.
+ */
+uint32_t power2_bitmap_find(power2_bitmap_t *bitmap,
+                            uint32_t size,
+                            uint32_t align);
+bool power2_bitmap_is_free(power2_bitmap_t *bitmap,
+                           uint32_t index,
+                           uint32_t size);
+void power2_bitmap_mark_inuse(power2_bitmap_t *bitmap,
+                              uint32_t index,
+                              uint32_t size);
+/* Marks count allocations, given as pairs of index and size, in use. The
+ * allocations must not overlap anything in use. The summaries are rebuilt
+ * once at the end.
+ */
+void power2_bitmap_load(power2_bitmap_t *bitmap,
+                        const uint32_t *allocs,
+                        uint32_t count);
+void power2_bitmap_mark_free(power2_bitmap_t *bitmap,
+                             uint32_t index,
+                             uint32_t size);
+
+/* Size of the allocation starting at index, -1 if no allocation starts
+ * there.
+ */
+uint32_t power2_bitmap_get_index_size(power2_bitmap_t *bitmap, uint32_t index);
+
+/* First allocation starting at or after index, -1 if none. */
+uint32_t power2_bitmap_next_alloc(power2_bitmap_t *bitmap, uint32_t index);
+
+/* First free index at or after index, -1 if none. size is set to the number
+ * of free indexes from there.
+ */
+uint32_t power2_bitmap_next_free_run(power2_bitmap_t *bitmap,
+                                     uint32_t index,
+                                     uint32_t *size);
+
+uint32_t power2_bitmap_used_count(power2_bitmap_t *bitmap);
+uint32_t power2_bitmap_alloc_count(power2_bitmap_t *bitmap);
+void power2_bitmap_assert(power2_bitmap_t *bitmap);
+
+#endif  // _POWER2_ALLOCATOR_INT_H_
@@ -0,0 +1,565 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*!
+ * @file power2_bitmap.c
+ * @date
+ *
+ * Hierarchical bitmap engine for the power2 allocator
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <target-utils/bit_utils/bit_utils.h>
+#include <target-sys/bf_sal/bf_sys_intf.h>
+#include "power2_allocator_int.h"
+
+#define BM_ALL_ONES UINT64_C(0xFFFFFFFFFFFFFFFF)
+/* Block sizes which fit within a word, tracked by the summaries */
+#define BM_SIZES 64
+
+struct power2_bitmap_s {
+  uint32_t total_size;
+  uint32_t nwords;  // Words in the used, start and fits bitmaps
+  uint32_t nsum;    // Words in each of the avail bitmaps
+  uint32_t ntop;    // Words in each of the top bitmaps
+  uint64_t *used;
+  uint64_t *start;
+  /* Bit s - 1 of fits[w] is set when a block of size s, aligned to the next
+   * power of 2 of s, is free in used word w.
+   */
+  uint64_t *fits;
+  /* avail[s - 1] has one bit per used word with bit s - 1 set in fits.
+   * avail[0] marks the words with any free index and avail[63] the words
+   * with no index in use.
+   */
+  uint64_t *avail[BM_SIZES];
+  /* top[s - 1] has one bit per non zero word of avail[s - 1] */
+  uint64_t *top[BM_SIZES];
+  uint64_t words[];
+};
+
+/* Bits at every multiple of 2^log2 within a word, for log2 0 to 6 */
+static const uint64_t bm_align_masks[] = {BM_ALL_ONES,
+                                          UINT64_C(0x5555555555555555),
+                                          UINT64_C(0x1111111111111111),
+                                          UINT64_C(0x0101010101010101),
+                                          UINT64_C(0x0001000100010001),
+                                          UINT64_C(0x0000000100000001),
+                                          UINT64_C(0x0000000000000001)};
+
+static inline size_t bm_alloc_size(uint32_t nwords,
+                                   uint32_t nsum,
+                                   uint32_t ntop) {
+  return sizeof(power2_bitmap_t) +
+         (3 * nwords + BM_SIZES * (nsum + ntop)) * sizeof(uint64_t);
+}
+
+static inline void bm_set_pointers(power2_bitmap_t *bm) {
+  uint64_t *avail, *top;
+  uint32_t i;
+
+  bm->used = bm->words;
+  bm->start = bm->used + bm->nwords;
+  bm->fits = bm->start + bm->nwords;
+  avail = bm->fits + bm->nwords;
+  top = avail + BM_SIZES * bm->nsum;
+  for (i = 0; i < BM_SIZES; i++) {
+    bm->avail[i] = avail + i * bm->nsum;
+    bm->top[i] = top + i * bm->ntop;
+  }
+}
+
+/* Bit j of the result is set iff bits j to j + n - 1 of m are all set */
+static inline uint64_t bm_run_mask(uint64_t m, uint32_t n) {
+  uint32_t k = 1, shift;
+
+  while (k < n && m) {
+    shift = (k < n - k) ? k : n - k;
+    m &= m >> shift;
+    k += shift;
+  }
+  return m;
+}
+
+/* Returns the fits mask for a word with the given free bits */
+static inline uint64_t bm_fits(uint64_t free_bits) {
+  uint64_t fits = 0;
+  uint64_t run = free_bits;
+  uint32_t s;
+
+  if (free_bits == BM_ALL_ONES) {
+    return BM_ALL_ONES;
+  }
+  /* run has bit j set iff the s bits from j are all free */
+  for (s = 1; s <= BM_SIZES && run; s++) {
+    if (s > 1) {
+      run &= free_bits >> (s - 1);
+    }
+    if (run & bm_align_masks[log2_uint32_ceil(s)]) {
+      fits |= UINT64_C(1) << (s - 1);
+    }
+  }
+  return fits;
+}
+
+static inline void bm_update_summary(power2_bitmap_t *bm, uint32_t w) {
+  uint64_t bit = UINT64_C(1) << (w & 63);
+  uint64_t top_bit = UINT64_C(1) << ((w >> 6) & 63);
+  uint64_t fits = bm_fits(~bm->used[w]);
+  uint64_t changed = fits ^ bm->fits[w];
+  uint64_t *sum;
+  uint32_t i;
+
+  bm->fits[w] = fits;
+  while (changed) {
+    i = __builtin_ctzll(changed);
+    changed &= changed - 1;
+    sum = &bm->avail[i][w >> 6];
+    *sum ^= bit;
+    if (*sum) {
+      bm->top[i][w >> 12] |= top_bit;
+    } else {
+      bm->top[i][w >> 12] &= ~top_bit;
+    }
+  }
+}
+
+/* Returns the first used word at or after w with avail bit i set, -1 if
+ * none.
+ */
+static uint32_t bm_next_avail(power2_bitmap_t *bm, uint32_t i, uint32_t w) {
+  uint32_t sw = w >> 6;
+  uint32_t tw;
+  uint64_t x;
+
+  if (sw >= bm->nsum) {
+    return -1;
+  }
+  x = bm->avail[i][sw] & (BM_ALL_ONES << (w & 63));
+  if (x) {
+    return (sw << 6) + __builtin_ctzll(x);
+  }
+
+  sw++;
+  for (tw = sw >> 6; tw < bm->ntop; tw++) {
+    x = bm->top[i][tw];
+    if (tw == (sw >> 6)) {
+      x &= BM_ALL_ONES << (sw & 63);
+    }
+    if (x) {
+      sw = (tw << 6) + __builtin_ctzll(x);
+      return (sw << 6) + __builtin_ctzll(bm->avail[i][sw]);
+    }
+  }
+  return -1;
+}
+
+/* Sets or clears the used bits of a range. The summaries of the words
+ * changed are updated unless the caller rebuilds them afterwards.
+ */
+static void bm_update_used(power2_bitmap_t *bm,
+                           uint32_t index,
+                           uint32_t size,
+                           bool inuse,
+                           bool update_summary) {
+  uint32_t w = index >> 6;
+  uint32_t off = index & 63;
+  uint32_t n;
+  uint64_t mask;
+
+  while (size) {
+    n = (64 - off < size) ? 64 - off : size;
+    mask = (n == 64) ? BM_ALL_ONES : ((UINT64_C(1) << n) - 1) << off;
+    if (inuse) {
+      bf_sys_assert(!(bm->used[w] & mask));
+      bm->used[w] |= mask;
+    } else {
+      bf_sys_assert((bm->used[w] & mask) == mask);
+      bm->used[w] &= ~mask;
+    }
+    if (update_summary) {
+      bm_update_summary(bm, w);
+    }
+    size -= n;
+    off = 0;
+    w++;
+  }
+}
+
+power2_bitmap_t *power2_bitmap_create(uint32_t total_size) {
+  power2_bitmap_t *bm;
+  uint32_t nwords = (total_size + 63) / 64;
+  uint32_t nsum = (nwords + 63) / 64;
+  uint32_t ntop = (nsum + 63) / 64;
+  uint32_t w;
+
+  bm = (power2_bitmap_t *)bf_sys_calloc(bm_alloc_size(nwords, nsum, ntop), 1);
+  if (bm == NULL) {
+    return NULL;
+  }
+  bm->total_size = total_size;
+  bm->nwords = nwords;
+  bm->nsum = nsum;
+  bm->ntop = ntop;
+  bm_set_pointers(bm);
+
+  /* Indexes past total_size in the last word are permanently in use */
+  if (total_size & 63) {
+    bm->used[nwords - 1] = BM_ALL_ONES << (total_size & 63);
+  }
+  for (w = 0; w < nwords; w++) {
+    bm_update_summary(bm, w);
+  }
+  return bm;
+}
+
+void power2_bitmap_destroy(power2_bitmap_t *bitmap) { bf_sys_free(bitmap); }
+
+power2_bitmap_t *power2_bitmap_copy(power2_bitmap_t *src) {
+  power2_bitmap_t *dst;
+  size_t len = bm_alloc_size(src->nwords, src->nsum, src->ntop);
+
+  dst = (power2_bitmap_t *)bf_sys_malloc(len);
+  if (dst == NULL) {
+    return NULL;
+  }
+  memcpy(dst, src, len);
+  bm_set_pointers(dst);
+  return dst;
+}
+
+/* Returns true if bits [pos, pos + n) are all set, pos being word aligned */
+static bool bm_all_ones(const uint64_t *bits, uint64_t pos, uint64_t n) {
+  uint64_t w = pos >> 6;
+  uint64_t mask;
+
+  for (; n >= 64; n -= 64, w++) {
+    if (bits[w] != BM_ALL_ONES) {
+      return false;
+    }
+  }
+  if (n) {
+    mask = (UINT64_C(1) << n) - 1;
+    if ((bits[w] & mask) != mask) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Returns the lowest pos >= from, aligned to align, such that the bits
+ * [pos, pos + n) are all set. n must not be larger than align. Bits past
+ * nbits in the last word must be clear. -1 if there's no such pos.
+ */
+static int64_t bm_find_ones(const uint64_t *bits,
+                            uint64_t nbits,
+                            uint64_t n,
+                            uint64_t align,
+                            uint64_t from) {
+  uint64_t w, m, pos;
+  uint64_t nwords = (nbits + 63) / 64;
+
+  bf_sys_assert(n && n <= align);
+  if (align <= 64) {
+    uint64_t amask = bm_align_masks[log2_uint32_ceil(align)];
+
+    for (w = from >> 6; w < nwords; w++) {
+      m = bm_run_mask(bits[w], n) & amask;
+      if (w == (from >> 6)) {
+        m &= BM_ALL_ONES << (from & 63);
+      }
+      if (m) {
+        pos = (w << 6) + __builtin_ctzll(m);
+        return (pos + n <= nbits) ? (int64_t)pos : -1;
+      }
+    }
+    return -1;
+  }
+
+  for (pos = (from + align - 1) & ~(align - 1); pos + n <= nbits;
+       pos += align) {
+    if (bm_all_ones(bits, pos, n)) {
+      return pos;
+    }
+  }
+  return -1;
+}
+
+uint32_t power2_bitmap_find(power2_bitmap_t *bm,
+                            uint32_t size,
+                            uint32_t align) {
+  uint32_t w, nw, rem, aw;
+  uint64_t m;
+  int64_t found;
+
+  if (size == 0 || size > bm->total_size) {
+    return -1;
+  }
+  bf_sys_assert(is_uint32_power2(align) && size <= align);
+
+  if (align <= 64) {
+    /* The block can't straddle a word, so the first word whose summary bit
+     * is set for this size is a fit.
+     */
+    w = bm_next_avail(bm, size - 1, 0);
+    if (w == (uint32_t)-1) {
+      return -1;
+    }
+    m = bm_run_mask(~bm->used[w], size) &
+        bm_align_masks[log2_uint32_ceil(align)];
+    bf_sys_assert(m);
+    return (w << 6) + __builtin_ctzll(m);
+  }
+
+  /* The block starts on a word boundary. Find aligned runs of entirely free
+   * words in the summary and check the trailing partial word, if any.
+   */
+  nw = size / 64;
+  rem = size % 64;
+  aw = align / 64;
+  found = 0;
+  while (true) {
+    found = bm_find_ones(bm->avail[BM_SIZES - 1], bm->nwords, nw, aw, found);
+    if (found < 0) {
+      return -1;
+    }
+    w = found;
+    if (rem == 0) {
+      return w << 6;
+    }
+    if ((w + nw < bm->nwords) &&
+        !(bm->used[w + nw] & ((UINT64_C(1) << rem) - 1))) {
+      return w << 6;
+    }
+    found = w + aw;
+  }
+  return -1;
+}
+
+bool power2_bitmap_is_free(power2_bitmap_t *bm, uint32_t index, uint32_t size) {
+  uint32_t w = index >> 6;
+  uint32_t off = index & 63;
+  uint32_t n;
+  uint64_t mask;
+
+  if (((uint64_t)index + size) > bm->total_size) {
+    return false;
+  }
+  while (size) {
+    n = (64 - off < size) ? 64 - off : size;
+    mask = (n == 64) ? BM_ALL_ONES : ((UINT64_C(1) << n) - 1) << off;
+    if (bm->used[w] & mask) {
+      return false;
+    }
+    size -= n;
+    off = 0;
+    w++;
+  }
+  return true;
+}
+
+void power2_bitmap_mark_inuse(power2_bitmap_t *bm,
+                              uint32_t index,
+                              uint32_t size) {
+  bf_sys_assert(size && ((uint64_t)index + size) <= bm->total_size);
+  bm_update_used(bm, index, size, true, true);
+  bm->start[index >> 6] |= UINT64_C(1) << (index & 63);
+}
+
+void power2_bitmap_load(power2_bitmap_t *bm,
+                        const uint32_t *allocs,
+                        uint32_t count) {
+  uint32_t index, size;
+  uint32_t i, w;
+
+  for (i = 0; i < count; i++) {
+    index = allocs[2 * i];
+    size = allocs[2 * i + 1];
+    bf_sys_assert(size && ((uint64_t)index + size) <= bm->total_size);
+    bm_update_used(bm, index, size, true, false);
+    bm->start[index >> 6] |= UINT64_C(1) << (index & 63);
+  }
+  for (w = 0; w < bm->nwords; w++) {
+    bm_update_summary(bm, w);
+  }
+}
+
+void power2_bitmap_mark_free(power2_bitmap_t *bm,
+                             uint32_t index,
+                             uint32_t size) {
+  bf_sys_assert(size && ((uint64_t)index + size) <= bm->total_size);
+  bf_sys_assert(bm->start[index >> 6] & (UINT64_C(1) << (index & 63)));
+  bm->start[index >> 6] &= ~(UINT64_C(1) << (index & 63));
+  bm_update_used(bm, index, size, false, true);
+}
+
+uint32_t power2_bitmap_get_index_size(power2_bitmap_t *bm, uint32_t index) {
+  uint32_t next = index + 1;
+  uint32_t w;
+  uint64_t x;
+
+  if (index >= bm->total_size) {
+    return -1;
+  }
+  if (!(bm->start[index >> 6] & (UINT64_C(1) << (index & 63)))) {
+    return -1;
+  }
+
+  /* The allocation ends at the next start or free index */
+  for (w = next >> 6; w < bm->nwords; w++) {
+    x = bm->start[w] | ~bm->used[w];
+    if (w == (next >> 6)) {
+      x &= BM_ALL_ONES << (next & 63);
+    }
+    if (x) {
+      return (w << 6) + __builtin_ctzll(x) - index;
+    }
+  }
+  return bm->total_size - index;
+}
+
+uint32_t power2_bitmap_next_alloc(power2_bitmap_t *bm, uint32_t index) {
+  uint32_t w;
+  uint64_t x;
+
+  for (w = index >> 6; w < bm->nwords; w++) {
+    x = bm->start[w];
+    if (w == (index >> 6)) {
+      x &= BM_ALL_ONES << (index & 63);
+    }
+    if (x) {
+      return (w << 6) + __builtin_ctzll(x);
+    }
+  }
+  return -1;
+}
+
+/* Returns the first index of the bit array from index whose bit is equal to
+ * set, -1 if none before the end of the used bitmap
+ */
+static uint32_t bm_next_bit(const power2_bitmap_t *bm,
+                            uint32_t index,
+                            bool set) {
+  uint32_t w;
+  uint64_t x;
+
+  for (w = index >> 6; w < bm->nwords; w++) {
+    x = set ? bm->used[w] : ~bm->used[w];
+    if (w == (index >> 6)) {
+      x &= BM_ALL_ONES << (index & 63);
+    }
+    if (x) {
+      return (w << 6) + __builtin_ctzll(x);
+    }
+  }
+  return -1;
+}
+
+uint32_t power2_bitmap_next_free_run(power2_bitmap_t *bm,
+                                     uint32_t index,
+                                     uint32_t *size) {
+  uint32_t start, end;
+
+  if (index >= bm->total_size) {
+    return -1;
+  }
+  start = bm_next_bit(bm, index, false);
+  if (start == (uint32_t)-1 || start >= bm->total_size) {
+    return -1;
+  }
+  /* The padding past total_size is in use, a run can only go past the end of
+   * the bitmap when total_size is a multiple of 64
+   */
+  end = bm_next_bit(bm, start, true);
+  if (end == (uint32_t)-1) {
+    end = bm->total_size;
+  }
+  bf_sys_assert(end <= bm->total_size);
+  *size = end - start;
+  return start;
+}
+
+uint32_t power2_bitmap_used_count(power2_bitmap_t *bm) {
+  uint32_t count = 0;
+  uint32_t w;
+
+  for (w = 0; w < bm->nwords; w++) {
+    count += __builtin_popcountll(bm->used[w]);
+  }
+  /* Don't count the padding in the last word */
+  return count - (bm->nwords * 64 - bm->total_size);
+}
+
+uint32_t power2_bitmap_alloc_count(power2_bitmap_t *bm) {
+  uint32_t count = 0;
+  uint32_t w;
+
+  for (w = 0; w < bm->nwords; w++) {
+    count += __builtin_popcountll(bm->start[w]);
+  }
+  return count;
+}
+
+void power2_bitmap_assert(power2_bitmap_t *bm) {
+  uint32_t w, i;
+  uint64_t bit;
+
+  if (bm->total_size & 63) {
+    uint64_t pad = BM_ALL_ONES << (bm->total_size & 63);
+    bf_sys_assert((bm->used[bm->nwords - 1] & pad) == pad);
+    bf_sys_assert(!(bm->start[bm->nwords - 1] & pad));
+  }
+  for (w = 0; w < bm->nwords; w++) {
+    bit = UINT64_C(1) << (w & 63);
+    /* Every allocation starts on an index in use */
+    bf_sys_assert((bm->start[w] & bm->used[w]) == bm->start[w]);
+    bf_sys_assert(bm->fits[w] == bm_fits(~bm->used[w]));
+    for (i = 0; i < BM_SIZES; i++) {
+      bf_sys_assert(!!(bm->avail[i][w >> 6] & bit) ==
+                    !!(bm_run_mask(~bm->used[w], i + 1) &
+                       bm_align_masks[log2_uint32_ceil(i + 1)]));
+    }
+  }
+  for (w = bm->nwords; w < bm->nsum * 64; w++) {
+    bit = UINT64_C(1) << (w & 63);
+    for (i = 0; i < BM_SIZES; i++) {
+      bf_sys_assert(!(bm->avail[i][w >> 6] & bit));
+    }
+  }
+  for (w = 0; w < bm->ntop * 64; w++) {
+    bit = UINT64_C(1) << (w & 63);
+    for (i = 0; i < BM_SIZES; i++) {
+      bf_sys_assert(!!(bm->top[i][w >> 6] & bit) ==
+                    (w < bm->nsum && bm->avail[i][w] != 0));
+    }
+  }
+  /* An in use index must belong to some allocation */
+  for (w = 0; w < bm->nwords; w++) {
+    uint64_t used = bm->used[w];
+    if (w == bm->nwords - 1 && (bm->total_size & 63)) {
+      used &= (UINT64_C(1) << (bm->total_size & 63)) - 1;
+    }
+    /* Lowest index of each in use run within the word */
+    uint64_t run_starts = used & ~(used << 1);
+    if (w && (bm->used[w - 1] >> 63) && (used & 1)) {
+      run_starts &= ~UINT64_C(1);
+    }
+    bf_sys_assert((run_starts & bm->start[w]) == run_starts);
+  }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "runs_index.h"
+#include <target-sys/bf_sal/bf_sys_intf.h>
+
+void bf_runs_clear(Pvoid_t *free_runs, Pvoid_t *run_sizes) {
+  PWord_t Pstarts;
+  Word_t Rc_word;
+  Word_t len = 0;
+
+  JLF(Pstarts, *run_sizes, len);
+  while (Pstarts) {
+    J1FA(Rc_word, *(Pvoid_t *)Pstarts);
+    JLN(Pstarts, *run_sizes, len);
+  }
+  JLFA(Rc_word, *run_sizes);
+  JLFA(Rc_word, *free_runs);
+  (void)Rc_word;
+}
+
+int bf_runs_add(Pvoid_t *free_runs,
+                Pvoid_t *run_sizes,
+                Word_t start,
+                Word_t len) {
+  PWord_t Prun;
+  PWord_t Pstarts;
+  int Rc_int;
+
+  JLI(Prun, *free_runs, start);
+  if (Prun == PJERR) {
+    return -1;
+  }
+  *Prun = len;
+  JLI(Pstarts, *run_sizes, len);
+  if (Pstarts == PJERR) {
+    return -1;
+  }
+  J1S(Rc_int, *(Pvoid_t *)Pstarts, start);
+  if (Rc_int == JERR) {
+    return -1;
+  }
+  return 0;
+}
+
+Word_t bf_runs_del(Pvoid_t *free_runs, Pvoid_t *run_sizes, Word_t start) {
+  PWord_t Prun;
+  PWord_t Pstarts;
+  Word_t len;
+  int Rc_int;
+
+  JLG(Prun, *free_runs, start);
+  bf_sys_assert(Prun);
+  len = *Prun;
+  JLD(Rc_int, *free_runs, start);
+  JLG(Pstarts, *run_sizes, len);
+  bf_sys_assert(Pstarts);
+  J1U(Rc_int, *(Pvoid_t *)Pstarts, start);
+  if (*(Pvoid_t *)Pstarts == NULL) {
+    JLD(Rc_int, *run_sizes, len);
+  }
+  (void)Rc_int;
+  return len;
+}
+
+int bf_runs_update(Pvoid_t *free_runs,
+                   Pvoid_t *run_sizes,
+                   Word_t start,
+                   Word_t end,
+                   bool used) {
+  PWord_t Prun;
+  Word_t index = start;
+  Word_t run_start, run_end;
+  Word_t free_start = start, free_end = end;
+  int rc = 0;
+
+  JLL(Prun, *free_runs, index);
+  if (!Prun || index + *Prun < start || (used && index + *Prun == start)) {
+    index = start;
+    JLF(Prun, *free_runs, index);
+  }
+  while (Prun && (index < end || (!used && index == end))) {
+    run_start = index;
+    run_end = run_start + bf_runs_del(free_runs, run_sizes, run_start);
+    if (used) {
+      if (run_start < start) {
+        rc |= bf_runs_add(free_runs, run_sizes, run_start, start - run_start);
+      }
+      if (run_end > end) {
+        rc |= bf_runs_add(free_runs, run_sizes, end, run_end - end);
+      }
+    } else {
+      if (run_start < free_start) {
+        free_start = run_start;
+      }
+      if (run_end > free_end) {
+        free_end = run_end;
+      }
+    }
+    index = run_end;
+    JLF(Prun, *free_runs, index);
+  }
+  if (!used) {
+    rc |= bf_runs_add(free_runs, run_sizes, free_start, free_end - free_start);
+  }
+  if (rc) {
+    bf_runs_clear(free_runs, run_sizes);
+    return -1;
+  }
+  return 0;
+}
+
+size_t bf_runs_memory_used(Pvoid_t *free_runs, Pvoid_t *run_sizes) {
+  PWord_t Pstarts;
+  Word_t Rc_word;
+  Word_t len = 0;
+  size_t bytes;
+
+  JLMU(Rc_word, *free_runs);
+  bytes = Rc_word;
+  JLMU(Rc_word, *run_sizes);
+  bytes += Rc_word;
+  JLF(Pstarts, *run_sizes, len);
+  while (Pstarts) {
+    J1MU(Rc_word, *(Pvoid_t *)Pstarts);
+    bytes += Rc_word;
+    JLN(Pstarts, *run_sizes, len);
+  }
+  return bytes;
+}
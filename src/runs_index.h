@@ -0,0 +1,56 @@
+/*
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/* runs_index.h - Index of the free runs of an id space, shared by the id
+ * allocator and fbitset. free_runs maps the first index of every free run
+ * to its length and run_sizes maps every length to a Judy1 array of the
+ * first indexes of the runs of that length, so that the runs of a length or
+ * longer are found without walking the shorter ones.
+ */
+
+#ifndef _BF_RUNS_INDEX_H_
+#define _BF_RUNS_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <Judy.h>
+
+/* Frees the index, both arrays are NULL afterwards */
+void bf_runs_clear(Pvoid_t *free_runs, Pvoid_t *run_sizes);
+
+/* Adds the run [start, start + len), returns -1 when out of memory */
+int bf_runs_add(Pvoid_t *free_runs,
+                Pvoid_t *run_sizes,
+                Word_t start,
+                Word_t len);
+
+/* Removes the run starting at start, which must exist, returns its length */
+Word_t bf_runs_del(Pvoid_t *free_runs, Pvoid_t *run_sizes, Word_t start);
+
+/* Indexes [start, end) were used (set) or freed. The runs overlapping the
+ * range, or touching it when freed, are replaced by what is left free of
+ * them, or by their union with the range. When out of memory the index is
+ * cleared and -1 returned.
+ */
+int bf_runs_update(Pvoid_t *free_runs,
+                   Pvoid_t *run_sizes,
+                   Word_t start,
+                   Word_t end,
+                   bool used);
+
+/* Bytes of memory used by the index */
+size_t bf_runs_memory_used(Pvoid_t *free_runs, Pvoid_t *run_sizes);
+
+#endif /* _BF_RUNS_INDEX_H_ */